@@ -0,0 +1,355 @@
+#include "Chain.h"
+#include "Matrix.h"
+#include "MixedPrecision.h"
+#include "Morton.h"
+#include "Random.h"
+#include "Simd.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Timing sweeps over the multiplication kernels. Every combination of
+// size, thread count, Strassen cutoff and kernel is run a few times
+// untimed, then timed with steady_clock over the product alone (operands
+// are generated and converted beforehand); the results go to the console
+// and, if asked for, to CSV and JSON files for comparing builds.
+//
+//   Benchmark [--type double|float|int] [--sizes 256,512,1024]
+//             [--threads 1,4] [--cutoffs 0,64,128] [--kernels list]
+//             [--warmup 1] [--reps 5] [--csv file] [--json file]
+//
+// Kernels: naive (Multiplication), blocked (BlockedMultiplication),
+// pstrassen (P_Strassen), classic, fused, winograd and lean (Multiply with
+// that schedule), morton (multiply on MortonMatrix), mixed (multiplyMixed
+// from int8, Half or float storage for int, float and double results) and
+// prepared (b as a PreparedOperand, formed before the timed runs the way
+// fixed weights would be).
+// naive and blocked run on one thread without a cutoff, so they are timed
+// once per size. A cutoff of 0 is the tuned crossover.
+
+struct BenchmarkOptions {
+	std::string type;
+	std::vector<int> sizes, threads, cutoffs;
+	std::vector<std::string> kernels;
+	int warmup, reps;
+	std::string csv, json;
+};
+
+struct BenchmarkResult {
+	std::string kernel;
+	int n, threads, cutoff;
+	std::vector<double> seconds;	// sorted
+	double error;					// largest difference from the blocked kernel
+};
+
+static std::vector<std::string> splitList(const std::string& text) {
+	std::vector<std::string> items;
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ','))
+		if (!item.empty())
+			items.push_back(item);
+	return items;
+}
+
+static std::vector<int> intList(const std::string& text) {
+	std::vector<int> values;
+	for (const std::string& item : splitList(text))
+		values.push_back(atoi(item.c_str()));
+	return values;
+}
+
+static bool parseOptions(int argc, char** argv, BenchmarkOptions& options) {
+	const int hardware = (int)std::max(1u, std::thread::hardware_concurrency());
+	options.type = "double";
+	options.sizes = { 256, 512, 1024 };
+	options.threads = { 1 };
+	if (hardware > 1)
+		options.threads.push_back(hardware);
+	options.cutoffs = { 0 };
+	options.kernels = { "blocked", "pstrassen", "winograd", "lean", "morton", "mixed" };
+	options.warmup = 1;
+	options.reps = 5;
+	for (int i = 1; i < argc; i++) {
+		const std::string flag = argv[i];
+		if (i + 1 >= argc) {
+			std::cerr << "missing value for " << flag << "\n";
+			return false;
+		}
+		const std::string value = argv[++i];
+		if (flag == "--type")
+			options.type = value;
+		else if (flag == "--sizes")
+			options.sizes = intList(value);
+		else if (flag == "--threads")
+			options.threads = intList(value);
+		else if (flag == "--cutoffs")
+			options.cutoffs = intList(value);
+		else if (flag == "--kernels")
+			options.kernels = splitList(value);
+		else if (flag == "--warmup")
+			options.warmup = atoi(value.c_str());
+		else if (flag == "--reps")
+			options.reps = std::max(1, atoi(value.c_str()));
+		else if (flag == "--csv")
+			options.csv = value;
+		else if (flag == "--json")
+			options.json = value;
+		else {
+			std::cerr << "unknown option " << flag << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+//value at fraction q of the sorted samples, interpolated between neighbours
+static double percentile(const std::vector<double>& sorted, double q) {
+	const double position = q * (sorted.size() - 1);
+	const size_t low = (size_t)position;
+	if (low + 1 >= sorted.size())
+		return sorted.back();
+	return sorted[low] + (position - low) * (sorted[low + 1] - sorted[low]);
+}
+
+// Storage type of the mixed kernel for results in T.
+template <typename T> struct BenchmarkNarrow;
+template <> struct BenchmarkNarrow<int> { typedef int8_t type; };
+template <> struct BenchmarkNarrow<float> { typedef Half type; };
+template <> struct BenchmarkNarrow<double> { typedef float type; };
+
+// Operands of a run: integers in the range of main.cpp (which also fits
+// int8 storage), reals in [-1, 1). Fixed seed, so every run and thread
+// count times the same matrices.
+template <typename T>
+RandomDistribution benchmarkDistribution() {
+	return std::is_integral<T>::value ? uniformDistribution(-100, 100) : uniformDistribution(-1, 1);
+}
+
+template <typename T>
+double largestDifference(Matrix<T>& x, Matrix<T>& y) {
+	double largest = 0;
+	for (int i = 0; i < x.getRows(); i++)
+		for (int j = 0; j < x.getCols(); j++)
+			largest = std::max(largest, std::fabs((double)x(i, j) - (double)y(i, j)));
+	return largest;
+}
+
+template <typename T>
+class KernelRunner {
+public:
+	explicit KernelRunner(int size) : n(size), a(size, size), b(size, size), c(size, size),
+		reference(size, size), ma(size, size), mb(size, size), mc(size, size),
+		na(size, size), nb(size, size) {
+		View<T> fa = a.makeView(0, 0, n, n), fb = b.makeView(0, 0, n, n);
+		fillRandom(fa, benchmarkDistribution<T>(), 12345, 0);
+		fillRandom(fb, benchmarkDistribution<T>(), 12345, 1);
+		View<T> va = a.makeView(0, 0, n, n), vb = b.makeView(0, 0, n, n), vr = reference.makeView(0, 0, n, n);
+		Matrix<T>::BlockedMultiplication(va, vb, vr, n);
+		ma.fromRowMajor(va);
+		mb.fromRowMajor(vb);
+		typedef typename BenchmarkNarrow<T>::type Narrow;
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				na(i, j) = Narrow(a(i, j));
+				nb(i, j) = Narrow(b(i, j));
+			}
+		}
+	}
+
+	static bool known(const std::string& kernel) {
+		static const char* names[] = { "naive", "blocked", "pstrassen", "classic", "fused", "winograd",
+			"lean", "morton", "mixed", "prepared" };
+		for (const char* name : names)
+			if (kernel == name)
+				return true;
+		return false;
+	}
+	static bool serial(const std::string& kernel) { return kernel == "naive" || kernel == "blocked"; }
+
+	//untimed setup of kernel for the runs under config, and its cleanup
+	//(before the pool of config goes away)
+	void prepare(const std::string& kernel, const StrassenConfig& config) {
+		if (kernel == "prepared") {
+			View<T> vb = b.makeView(0, 0, n, n);
+			prepared.reset(new PreparedOperand<T>(vb, PreparedRight, -1, n, config));
+		}
+	}
+	void finish() { prepared.reset(); }
+
+	void run(const std::string& kernel, const StrassenConfig& config) {
+		View<T> va = a.makeView(0, 0, n, n), vb = b.makeView(0, 0, n, n), vc = c.makeView(0, 0, n, n);
+		StrassenConfig scheduled = config;
+		if (kernel == "naive")
+			Matrix<T>::Multiplication(va, vb, vc, n);
+		else if (kernel == "blocked")
+			Matrix<T>::BlockedMultiplication(va, vb, vc, n);
+		else if (kernel == "pstrassen")
+			Matrix<T>::P_Strassen(va, vb, vc, n, 0, config);
+		else if (kernel == "morton")
+			multiply(ma, mb, mc, config);
+		else if (kernel == "mixed") {
+			typedef typename BenchmarkNarrow<T>::type Narrow;
+			View<Narrow> vna = na.makeView(0, 0, n, n), vnb = nb.makeView(0, 0, n, n);
+			multiplyMixed(vna, vnb, vc, config);
+		}
+		else if (kernel == "prepared")
+			prepared->multiply(va, vc);
+		else {
+			scheduled.schedule = kernel == "classic" ? StrassenClassic : kernel == "fused" ? StrassenFused :
+				kernel == "winograd" ? StrassenWinograd : StrassenLean;
+			Matrix<T>::Multiply(va, vb, vc, scheduled);
+		}
+	}
+
+	//difference of the last result of kernel from the blocked kernel
+	double error(const std::string& kernel) {
+		if (kernel == "morton") {
+			View<T> vc = c.makeView(0, 0, n, n);
+			mc.toRowMajor(vc);
+		}
+		return largestDifference(c, reference);
+	}
+private:
+	int n;
+	Matrix<T> a, b, c, reference;
+	MortonMatrix<T> ma, mb, mc;
+	Matrix<typename BenchmarkNarrow<T>::type> na, nb;
+	std::unique_ptr<PreparedOperand<T> > prepared;
+};
+
+template <typename T>
+std::vector<BenchmarkResult> runBenchmarks(const BenchmarkOptions& options) {
+	std::vector<BenchmarkResult> results;
+	typedef std::chrono::steady_clock Clock;
+	for (int n : options.sizes) {
+		KernelRunner<T> runner(n);
+		for (const std::string& kernel : options.kernels) {
+			for (size_t t = 0; t < options.threads.size(); t++) {
+				for (size_t x = 0; x < options.cutoffs.size(); x++) {
+					const bool serial = KernelRunner<T>::serial(kernel);
+					if (serial && (t > 0 || x > 0))
+						continue;
+					ThreadPool pool(serial ? 1 : options.threads[t]);
+					StrassenConfig config = strassenDefaults();
+					config.pool = &pool;
+					config.crossover = options.cutoffs[x];
+					BenchmarkResult result;
+					result.kernel = kernel;
+					result.n = n;
+					result.threads = pool.size();
+					result.cutoff = serial ? 0 : options.cutoffs[x];
+					runner.prepare(kernel, config);
+					for (int w = 0; w < options.warmup; w++)
+						runner.run(kernel, config);
+					for (int r = 0; r < options.reps; r++) {
+						const Clock::time_point start = Clock::now();
+						runner.run(kernel, config);
+						const Clock::time_point end = Clock::now();
+						result.seconds.push_back(std::chrono::duration<double>(end - start).count());
+					}
+					std::sort(result.seconds.begin(), result.seconds.end());
+					result.error = runner.error(kernel);
+					runner.finish();
+					results.push_back(result);
+
+					const double median = percentile(result.seconds, 0.5);
+					std::cout << std::setw(10) << kernel << std::setw(7) << n << std::setw(4) << result.threads
+						<< std::setw(6) << result.cutoff << std::fixed << std::setprecision(3)
+						<< std::setw(11) << median * 1e3 << " ms" << std::setw(10)
+						<< 2.0 * n * n * n / median * 1e-9 << " GFLOP/s" << std::scientific
+						<< std::setprecision(2) << std::setw(11) << result.error << "\n"
+						<< std::defaultfloat;
+				}
+			}
+		}
+	}
+	return results;
+}
+
+static const char* simdName() {
+	switch (simdLevel()) {
+	case SimdSSE: return "sse4.1";
+	case SimdAVX2: return "avx2";
+	case SimdAVX512: return "avx512";
+	case SimdNEON: return "neon";
+	default: return "scalar";
+	}
+}
+
+//GFLOP/s counts the 2 n^3 operations of the ordinary product for every
+//kernel, so Strassen shows up as a higher rate; GB/s is the compulsory
+//traffic of reading a and b and writing c once
+static void writeResults(const BenchmarkOptions& options, size_t element,
+	const std::vector<BenchmarkResult>& results) {
+	if (!options.csv.empty()) {
+		std::ofstream out(options.csv);
+		out << "kernel,type,n,threads,cutoff,reps,min_ms,median_ms,p90_ms,max_ms,gflops,gbps,max_error\n";
+		for (const BenchmarkResult& r : results) {
+			const double median = percentile(r.seconds, 0.5);
+			out << r.kernel << "," << options.type << "," << r.n << "," << r.threads << "," << r.cutoff << ","
+				<< r.seconds.size() << "," << r.seconds.front() * 1e3 << "," << median * 1e3 << ","
+				<< percentile(r.seconds, 0.9) * 1e3 << "," << r.seconds.back() * 1e3 << ","
+				<< 2.0 * r.n * r.n * r.n / median * 1e-9 << ","
+				<< 3.0 * r.n * r.n * element / median * 1e-9 << "," << r.error << "\n";
+		}
+	}
+	if (!options.json.empty()) {
+		std::ofstream out(options.json);
+		out << "{\n  \"type\": \"" << options.type << "\",\n  \"simd\": \"" << simdName()
+			<< "\",\n  \"hardware_threads\": " << std::thread::hardware_concurrency()
+			<< ",\n  \"results\": [";
+		for (size_t i = 0; i < results.size(); i++) {
+			const BenchmarkResult& r = results[i];
+			const double median = percentile(r.seconds, 0.5);
+			out << (i ? "," : "") << "\n    {\"kernel\": \"" << r.kernel << "\", \"n\": " << r.n
+				<< ", \"threads\": " << r.threads << ", \"cutoff\": " << r.cutoff << ", \"seconds\": [";
+			for (size_t s = 0; s < r.seconds.size(); s++)
+				out << (s ? ", " : "") << r.seconds[s];
+			out << "], \"median\": " << median << ", \"p90\": " << percentile(r.seconds, 0.9)
+				<< ", \"gflops\": " << 2.0 * r.n * r.n * r.n / median * 1e-9
+				<< ", \"gbps\": " << 3.0 * r.n * r.n * element / median * 1e-9
+				<< ", \"max_error\": " << r.error << "}";
+		}
+		out << "\n  ]\n}\n";
+	}
+}
+
+template <typename T>
+int benchmark(const BenchmarkOptions& options) {
+	for (const std::string& kernel : options.kernels) {
+		if (!KernelRunner<T>::known(kernel)) {
+			std::cerr << "unknown kernel " << kernel << "\n";
+			return 1;
+		}
+	}
+	std::cout << "    kernel      n thr  cut     median      rate       error\n";
+	std::vector<BenchmarkResult> results = runBenchmarks<T>(options);
+	writeResults(options, sizeof(T), results);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	BenchmarkOptions options;
+	if (!parseOptions(argc, argv, options))
+		return 1;
+	if (options.type == "double")
+		return benchmark<double>(options);
+	if (options.type == "float")
+		return benchmark<float>(options);
+	if (options.type == "int")
+		return benchmark<int>(options);
+	std::cerr << "unknown type " << options.type << "\n";
+	return 1;
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <new>
+#include <stddef.h>
+#include <stdlib.h>
+#include <type_traits>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+#include "ThreadPool.h"
+#include "Trace.h"
+
+// Storage policy of Matrix. The buffer is aligned for the vector kernels,
+// the leading dimension can be padded so the rows of power of two sized
+// matrices do not map to the same cache sets, and the pages can be first
+// touched by the threads of the pool that later works on them, so on NUMA
+// systems each node holds the rows its threads read.
+struct MatrixAllocation {
+	size_t alignment;	// bytes, a power of two
+	bool padStride;		// round rows up to whole cache lines and break power of two strides
+	bool firstTouch;	// initialize the rows in parallel on the threads of pool
+	ThreadPool* pool;	// nullptr means ThreadPool::global()
+};
+
+// Policy used by the Matrix constructors that do not take one.
+inline MatrixAllocation& matrixAllocationDefaults() {
+	static MatrixAllocation allocation = { 64, false, true, nullptr };
+	return allocation;
+}
+
+// bytes of memory aligned to alignment (rounded up to a power of two no
+// smaller than a pointer); throws std::bad_alloc
+inline void* alignedAllocate(size_t bytes, size_t alignment) {
+	size_t align = sizeof(void*);
+	while (align < alignment)
+		align *= 2;
+	if (bytes == 0)
+		bytes = align;
+	void* memory = nullptr;
+#ifdef _MSC_VER
+	memory = _aligned_malloc(bytes, align);
+#else
+	if (posix_memalign(&memory, align, bytes) != 0)
+		memory = nullptr;
+#endif
+	if (memory == nullptr)
+		throw std::bad_alloc();
+	MATRIX_TRACE_COUNT("bytes allocated", (double)bytes);
+	return memory;
+}
+
+inline void alignedFree(void* memory) {
+#ifdef _MSC_VER
+	_aligned_free(memory);
+#else
+	free(memory);
+#endif
+}
+
+// Leading dimension of a matrix with cols columns. When padStride is set,
+// rows are rounded up to whole cache lines (or alignment units, if larger),
+// and one more line is added when a row is a multiple of 512 bytes: with
+// such strides a walk down a column touches only a few cache sets, and the
+// power of two sizes Strassen favours hit this at every level.
+template <typename T>
+int matrixStride(int cols, const MatrixAllocation& allocation) {
+	if (!allocation.padStride)
+		return cols;
+	const size_t line = allocation.alignment > 64 ? allocation.alignment : 64;
+	const size_t unit = line > sizeof(T) ? line / sizeof(T) : 1;
+	size_t ld = ((size_t)cols + unit - 1) / unit * unit;
+	if ((ld * sizeof(T)) % 512 == 0)
+		ld += unit;
+	return (int)ld;
+}
+
+// count elements of T in aligned memory, default initialized as by
+// new T[count] (so left as they are for arithmetic types)
+template <typename T>
+T* alignedNew(size_t count, size_t alignment) {
+	T* data = static_cast<T*>(alignedAllocate(count * sizeof(T), alignment));
+	if (!std::is_trivially_default_constructible<T>::value) {
+		for (size_t i = 0; i < count; i++)
+			new (data + i) T;
+	}
+	return data;
+}
+
+template <typename T>
+void alignedDelete(T* data, size_t count) {
+	if (data == nullptr)
+		return;
+	if (!std::is_trivially_destructible<T>::value) {
+		for (size_t i = 0; i < count; i++)
+			data[i].~T();
+	}
+	alignedFree(data);
+}
+
+// Owned block of aligned raw memory, for I/O buffers.
+class AlignedBuffer {
+public:
+	AlignedBuffer(size_t bytes, size_t alignment) : memory(alignedAllocate(bytes, alignment)) {}
+	~AlignedBuffer() { alignedFree(memory); }
+
+	char* data() { return static_cast<char*>(memory); }
+private:
+	void* memory;
+
+	AlignedBuffer(const AlignedBuffer& other);
+	AlignedBuffer& operator=(const AlignedBuffer& other);
+};
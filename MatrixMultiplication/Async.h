@@ -0,0 +1,116 @@
+#pragma once
+#include <exception>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include "Matrix.h"
+#include "ThreadPool.h"
+
+// Products that run in the background on a thread pool, so the caller can
+// prepare the next operands or do I/O meanwhile, or keep several products
+// in flight. The pool is the persistent one of the config (by default
+// ThreadPool::global(), see threadPoolDefaults()); no threads are started
+// per call.
+
+// Completion handle of a product started by multiplyAsync. It can be moved
+// but not copied; destroying a handle that was not waited for waits for
+// the product (and drops its exception), as the views it writes may go
+// away with the caller.
+class AsyncMultiply {
+public:
+	AsyncMultiply() {}
+	AsyncMultiply(AsyncMultiply&& other) noexcept : state(std::move(other.state)) {}
+	AsyncMultiply& operator=(AsyncMultiply&& other) noexcept {
+		if (this != &other) {
+			finish();
+			state = std::move(other.state);
+		}
+		return *this;
+	}
+	~AsyncMultiply() { finish(); }
+
+	// false for a default constructed or already waited for handle
+	bool valid() const { return state != nullptr; }
+	bool ready() const { return state == nullptr || state->group.done(); }
+
+	// Block until the product is done, running tasks of its pool in the
+	// meantime (so this also works for a pool with a single thread), and
+	// rethrow what the product or its callback threw.
+	void wait() {
+		if (state == nullptr)
+			return;
+		std::shared_ptr<State> current = std::move(state);
+		current->pool->wait(current->group);
+	}
+private:
+	template <typename T, typename Access>
+	friend AsyncMultiply multiplyAsync(View<T, Access> a, View<T, Access> b, View<T, Access> c,
+		typename std::common_type<T>::type alpha, typename std::common_type<T>::type beta,
+		StrassenWorkspace<T>* workspace, const StrassenConfig& config,
+		std::function<void(std::exception_ptr)> done);
+
+	struct State {
+		explicit State(ThreadPool* p) : pool(p) {}
+		ThreadPool* pool;
+		TaskGroup group;
+	};
+	std::shared_ptr<State> state;
+
+	void finish() noexcept {
+		try {
+			wait();
+		}
+		catch (...) {
+		}
+	}
+
+	AsyncMultiply(const AsyncMultiply& other);
+	AsyncMultiply& operator=(const AsyncMultiply& other);
+};
+
+// Start c = alpha * a * b + beta * c and return at once. The views are
+// copied, but the memory behind them must stay valid until the handle is
+// waited for. workspace, if not null, is used instead of a fresh one and
+// must not be shared with a product running at the same time. done, if
+// set, is called on the pool thread when the product is finished, with the
+// exception it threw or a null pointer.
+template <typename T, typename Access>
+AsyncMultiply multiplyAsync(View<T, Access> a, View<T, Access> b, View<T, Access> c,
+	typename std::common_type<T>::type alpha, typename std::common_type<T>::type beta,
+	StrassenWorkspace<T>* workspace, const StrassenConfig& config,
+	std::function<void(std::exception_ptr)> done) {
+	ThreadPool* pool = config.pool ? config.pool : &ThreadPool::global();
+	AsyncMultiply handle;
+	handle.state = std::make_shared<AsyncMultiply::State>(pool);
+	pool->submit(handle.state->group, [a, b, c, alpha, beta, workspace, config, done]() mutable {
+		std::exception_ptr error;
+		try {
+			if (workspace)
+				Matrix<T, Access>::Multiply(a, b, c, alpha, beta, *workspace, config);
+			else
+				Matrix<T, Access>::Multiply(a, b, c, alpha, beta, config);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		if (done)
+			done(error);
+		if (error)
+			std::rethrow_exception(error);
+	});
+	return handle;
+}
+
+template <typename T, typename Access>
+AsyncMultiply multiplyAsync(View<T, Access> a, View<T, Access> b, View<T, Access> c,
+	const StrassenConfig& config = strassenDefaults(),
+	std::function<void(std::exception_ptr)> done = nullptr) {
+	return multiplyAsync(a, b, c, T(1), T(0), (StrassenWorkspace<T>*)nullptr, config, done);
+}
+
+template <typename T, typename Access>
+AsyncMultiply multiplyAsync(View<T, Access> a, View<T, Access> b, View<T, Access> c,
+	StrassenWorkspace<T>& workspace, const StrassenConfig& config = strassenDefaults(),
+	std::function<void(std::exception_ptr)> done = nullptr) {
+	return multiplyAsync(a, b, c, T(1), T(0), &workspace, config, done);
+}
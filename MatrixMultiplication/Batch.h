@@ -0,0 +1,150 @@
+#pragma once
+#include <algorithm>
+#include <stddef.h>
+#include <type_traits>
+#include <vector>
+#include "Gemm.h"
+#include "Matrix.h"
+#include "ThreadPool.h"
+
+// Many independent products at once. Small and medium products do not
+// scale well over a whole pool one at a time, so the batch is cut into
+// groups of about equal work with each group run start to finish by one
+// thread (reusing one Strassen workspace for all of its products), while
+// products large enough to keep the pool busy on their own run one after
+// another with the full parallel recursion.
+
+// How multiplyBatch computes one product.
+enum BatchMethod {
+	BatchNaive,		// triple loop; tiny products, where packing costs more than it saves
+	BatchBlocked,	// the packed, blocked kernel
+	BatchStrassen	// Matrix::Multiply
+};
+
+// Method for an m x k by k x n product under config, which must be resolved.
+inline BatchMethod batchMethod(int m, int k, int n, const StrassenConfig& config) {
+	const int smallest = std::min(m, std::min(k, n));
+	if ((double)m * k * n <= 32.0 * 32 * 32)
+		return BatchNaive;
+	if (smallest < config.crossover)
+		return BatchBlocked;
+	return BatchStrassen;
+}
+
+template <typename T, typename Access>
+void batchProduct(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c, T alpha, T beta,
+	BatchMethod method, StrassenWorkspace<T>* workspace, const StrassenConfig& config) {
+	const int m = a.getRows(), k = a.getCols(), n = b.getCols();
+	switch (method) {
+	case BatchNaive:
+		for (int i = 0; i < m; i++) {
+			T* ci = c.getRow(i);
+			const T* ai = a.getRow(i);
+			for (int j = 0; j < n; j++)
+				ci[j] = beta == T(0) ? T(0) : beta * ci[j];
+			for (int p = 0; p < k; p++) {
+				const T aip = alpha * ai[p];
+				const T* bp = b.getRow(p);
+				for (int j = 0; j < n; j++)
+					ci[j] += aip * bp[j];
+			}
+		}
+		break;
+	case BatchBlocked:
+		gemmBlocked(m, n, k, alpha, a.getData(), a.getStride(), b.getData(), b.getStride(), beta,
+			c.getData(), c.getStride());
+		break;
+	default:
+		Matrix<T, Access>::Multiply(a, b, c, alpha, beta, *workspace, config);
+	}
+}
+
+// c[i] = alpha * a[i] * b[i] + beta * c[i] for i < count. The products may
+// have different shapes but must not write overlapping parts of memory.
+// Throws DimensionMismatch before any product runs if one of them does not
+// fit together.
+template <typename T, typename Access>
+void multiplyBatch(View<T, Access>* a, View<T, Access>* b, View<T, Access>* c, int count,
+	typename std::common_type<T>::type alpha, typename std::common_type<T>::type beta,
+	const StrassenConfig& config = strassenDefaults()) {
+	for (int i = 0; i < count; i++) {
+		if (b[i].getRows() != a[i].getCols())
+			throw DimensionMismatch(a[i].getCols(), b[i].getRows());
+		if (c[i].getRows() != a[i].getRows())
+			throw DimensionMismatch(a[i].getRows(), c[i].getRows());
+		if (c[i].getCols() != b[i].getCols())
+			throw DimensionMismatch(b[i].getCols(), c[i].getCols());
+	}
+	const StrassenConfig resolved = resolveStrassenConfig<T>(config);
+	ThreadPool& pool = resolved.pool ? *resolved.pool : ThreadPool::global();
+	//products inside a group run on one thread, so their recursion gets a
+	//pool of its own with no workers
+	StrassenConfig serial = resolved;
+	serial.parallelDepth = 0;
+
+	//largest products first, so the last groups to start are the cheap ones
+	std::vector<double> cost(count);
+	std::vector<int> order(count);
+	double total = 0;
+	for (int i = 0; i < count; i++) {
+		cost[i] = (double)a[i].getRows() * a[i].getCols() * b[i].getCols();
+		total += cost[i];
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&cost](int x, int y) { return cost[x] > cost[y]; });
+	const double share = total / pool.size();
+	const double target = total / (4.0 * pool.size());
+
+	size_t first = 0;
+	while (first < order.size() && pool.size() > 1 && cost[order[first]] > share)
+		first++;
+	TaskGroup groups;
+	for (size_t start = first; start < order.size(); ) {
+		size_t end = start;
+		double work = 0;
+		while (end < order.size() && (end == start || work + cost[order[end]] <= target)) {
+			work += cost[order[end]];
+			end++;
+		}
+		const int* items = order.data() + start;
+		const int length = (int)(end - start);
+		pool.submit(groups, [a, b, c, items, length, alpha, beta, &serial]() {
+			ThreadPool local(1);
+			StrassenConfig config = serial;
+			config.pool = &local;
+			size_t scratch = 0;
+			for (int i = 0; i < length; i++) {
+				const int x = items[i];
+				const int m = a[x].getRows(), k = a[x].getCols(), n = b[x].getCols();
+				if (batchMethod(m, k, n, config) == BatchStrassen)
+					scratch = std::max(scratch, StrassenWorkspace<T>::scratchElements(m, k, n, 0, config));
+			}
+			StrassenWorkspace<T> workspace(scratch);
+			for (int i = 0; i < length; i++) {
+				const int x = items[i];
+				batchProduct(a[x], b[x], c[x], T(alpha), T(beta),
+					batchMethod(a[x].getRows(), a[x].getCols(), b[x].getCols(), config), &workspace, config);
+			}
+		});
+		start = end;
+	}
+	//the calling thread takes the large products, running their parallel
+	//tasks alongside the groups
+	try {
+		for (size_t i = 0; i < first; i++) {
+			const int x = order[i];
+			Matrix<T, Access>::Multiply(a[x], b[x], c[x], T(alpha), T(beta), resolved);
+		}
+	}
+	catch (...) {
+		pool.wait(groups);
+		throw;
+	}
+	pool.wait(groups);
+}
+
+template <typename T, typename Access>
+void multiplyBatch(View<T, Access>* a, View<T, Access>* b, View<T, Access>* c, int count,
+	const StrassenConfig& config = strassenDefaults()) {
+	multiplyBatch(a, b, c, count, T(1), T(0), config);
+}
@@ -0,0 +1,443 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <stddef.h>
+#include <vector>
+#include "Allocation.h"
+#include "Matrix.h"
+#include "ThreadPool.h"
+
+// Products of more than two matrices: powers a^e by repeated squaring, and
+// chains a1 a2 ... an in the cheapest order. Each runs all of its products
+// with one Strassen workspace and keeps its intermediate results in a few
+// reused buffers (two for a power and for a chain multiplied left to
+// right), instead of the temporaries and result matrices of one P_Strassen
+// call per product. PreparedOperand keeps what the recursion derives from
+// an operand used in many products, such as the a power() multiplies by
+// again and again.
+
+// Which operand of its products a PreparedOperand is.
+enum PreparedSide {
+	PreparedLeft,	// a in products a * b
+	PreparedRight	// b in products a * b, such as fixed weights
+};
+
+// A fixed operand of any number of products, with everything the Strassen
+// recursion derives from it alone formed once instead of in every product:
+// the sums of its side at each Strassen step, and for a right operand also
+// its leaf blocks packed for the blocked kernel, so products only form and
+// pack the sums of the other side. levels bounds how many Strassen levels
+// deep the sums go (-1 = all of them, which is what reaches the packed
+// leaves); level l costs 5/4 (7/4)^l of the size of the operand. The
+// transform follows the way StrassenWorkspace::plan splits products with
+// other operands of other rows (for a right operand) or columns (for a
+// left one), 0 meaning square ones; products of other shapes still work
+// and use what their recursion meets. The view is kept, so its elements
+// must not change while this is used.
+template <typename T, typename Access = DefaultAccess>
+class PreparedOperand {
+public:
+	PreparedOperand(View<T, Access>& x, PreparedSide which = PreparedLeft, int levels = -1,
+		int other = 0, const StrassenConfig& settings = strassenDefaults())
+		: operand(x), side(which), config(resolveStrassenConfig<T>(settings)),
+		packing(gemmPacking<T>()), depth(levels), elements(0), used(0), nodes(0), data(nullptr),
+		root(nullptr) {
+		int m, k, n;
+		shape(other, m, k, n);
+		//one walk counts the transform, the second one forms it
+		walk(nullptr, m, k, n, 0);
+		if (elements > 0)
+			data = alignedNew<T>(elements, matrixAllocationDefaults().alignment);
+		transforms.reserve(nodes);
+		root = walk(&operand, m, k, n, 0);
+	}
+	~PreparedOperand() { alignedDelete(data, elements); }
+
+	// c = alpha * x * other + beta * c for a left operand x, alpha * other *
+	// x + beta * c for a right one, as Matrix::Multiply with the config given
+	// at construction. Throws DimensionMismatch if the shapes do not fit.
+	void multiply(View<T, Access>& other, View<T, Access>& c, T alpha, T beta,
+		StrassenWorkspace<T>& workspace) {
+		View<T, Access>& a = side == PreparedLeft ? operand : other;
+		View<T, Access>& b = side == PreparedLeft ? other : operand;
+		Matrix<T, Access>::checkShapes(a, b, c);
+		const int m = a.getRows(), k = a.getCols(), n = b.getCols();
+		size_t required = StrassenWorkspace<T>::scratchElements(m, k, n, 0, config);
+		if (workspace.size() < required)
+			throw WorkspaceTooSmall(required * sizeof(T), workspace.bytes());
+		Matrix<T, Access>::multiplyStep(a, b, c, m, k, n, alpha, beta, 0, workspace.get(), config,
+			side == PreparedLeft ? root : nullptr, side == PreparedRight ? root : nullptr);
+	}
+	void multiply(View<T, Access>& other, View<T, Access>& c, T alpha, T beta) {
+		View<T, Access>& a = side == PreparedLeft ? operand : other;
+		View<T, Access>& b = side == PreparedLeft ? other : operand;
+		StrassenWorkspace<T> workspace(a.getRows(), a.getCols(), b.getCols(), config);
+		multiply(other, c, alpha, beta, workspace);
+	}
+	void multiply(View<T, Access>& other, View<T, Access>& c, StrassenWorkspace<T>& workspace) {
+		multiply(other, c, T(1), T(0), workspace);
+	}
+	void multiply(View<T, Access>& other, View<T, Access>& c) {
+		multiply(other, c, T(1), T(0));
+	}
+
+	View<T, Access>& getOperand() { return operand; }
+	PreparedSide getSide() const { return side; }
+	// the resolved config products run with
+	const StrassenConfig& getConfig() const { return config; }
+	// memory held by the prepared sums and packed blocks
+	size_t size() const { return elements; }
+	size_t bytes() const { return elements * sizeof(T); }
+private:
+	View<T, Access> operand;
+	PreparedSide side;
+	StrassenConfig config;
+	GemmPacking packing;
+	int depth;
+	size_t elements, used;
+	int nodes;
+	T* data;
+	std::vector<StrassenTransform<T>> transforms;
+	const StrassenTransform<T>* root;
+
+	//shape of the products the transform is laid out for
+	void shape(int other, int& m, int& k, int& n) const {
+		if (side == PreparedLeft) {
+			m = operand.getRows();
+			k = operand.getCols();
+			n = other > 0 ? other : k;
+		}
+		else {
+			k = operand.getRows();
+			n = operand.getCols();
+			m = other > 0 ? other : k;
+		}
+	}
+
+	//count elements there, or hand them out once data is allocated
+	T* reserve(size_t count, bool counting) {
+		if (counting) {
+			elements += count;
+			return nullptr;
+		}
+		T* region = data + used;
+		used += count;
+		return region;
+	}
+
+	//the transform of block x of the operand within an m x k by k x n
+	//product, following multiplyStep: splits that keep all of the operand
+	//and peeling (which keeps its even leading block) pass on what is
+	//prepared below them, splits that halve it prepare both halves. With x
+	//nullptr this only counts nodes and elements
+	const StrassenTransform<T>* walk(View<T, Access>* x, int m, int k, int n, int level) {
+		const bool right = side == PreparedRight, counting = x == nullptr;
+		const StrassenStep step = StrassenWorkspace<T>::plan(m, k, n, level, config);
+		const int rows = right ? k : m, cols = right ? n : k;
+		const bool winograd = config.schedule == StrassenWinograd;
+		StrassenTransform<T> transform = { rows, cols, step, winograd, nullptr, nullptr, packing, {} };
+		switch (step) {
+		case StepLeaf:
+			if (!right)
+				return nullptr;
+			transform.packed = reserve(gemmPackedElements(k, n, packing), counting);
+			if (!counting)
+				gemmPackPanels(k, n, x->getData(), (size_t)x->getStride(), transform.packed, packing);
+			break;
+		case StepPeel: {
+			View<T, Access> even;
+			if (!counting)
+				even = x->makeView(0, 0, rows - rows % 2, cols - cols % 2);
+			return walk(counting ? nullptr : &even, m - m % 2, k - k % 2, n - n % 2, level);
+		}
+		case StepStrassen: {
+			if (config.schedule == StrassenLean || (depth >= 0 && level >= depth))
+				return nullptr;
+			const int rh = rows / 2, ch = cols / 2;
+			transform.sums = reserve(5 * (size_t)rh * ch, counting);
+			View<T, Access> operands[7];
+			if (!counting) {
+				//the temporaries of this side in strassenStep, in its order
+				static const int sums[2][2][5] = {
+					{ { 1, 2, 4, 6, 8 }, { 0, 1, 2, 3, 8 } },
+					{ { 0, 3, 5, 7, 9 }, { 4, 5, 6, 7, 9 } }
+				};
+				View<T, Access> s[10];
+				for (int i = 0; i < 5; i++)
+					s[sums[right][winograd][i]] = View<T, Access>(transform.sums + (size_t)i * rh * ch,
+						ch, rh, ch);
+				View<T, Access> x11 = x->makeView(0, 0, rh, ch);
+				View<T, Access> x12 = x->makeView(0, ch, rh, ch);
+				View<T, Access> x21 = x->makeView(rh, 0, rh, ch);
+				View<T, Access> x22 = x->makeView(rh, ch, rh, ch);
+				ThreadPool& pool = config.pool ? *config.pool : ThreadPool::global();
+				Matrix<T, Access>::formSums(pool, config.schedule, !right, x11, x12, x21, x22, s);
+				//operands of the sub-products on this side, as in strassenStep
+				const View<T, Access> list[2][2][7] = {
+					{ { x11, s[1], s[2], x22, s[4], s[6], s[8] },
+					{ x11, x12, s[3], x22, s[0], s[1], s[2] } },
+					{ { s[0], x22, x11, s[3], s[5], s[7], s[9] },
+					{ x11, x21, x22, s[7], s[4], s[5], s[6] } }
+				};
+				for (int i = 0; i < 7; i++)
+					operands[i] = list[right][winograd][i];
+			}
+			for (int i = 0; i < 7; i++)
+				transform.children[i] = walk(counting ? nullptr : &operands[i], m / 2, k / 2, n / 2,
+					level + 1);
+			break;
+		}
+		default: {
+			//StepSplitM halves a, StepSplitN halves b, StepSplitK both
+			const bool halves = step == StepSplitK || (step == StepSplitN) == right;
+			const int mt = step == StepSplitM ? m / 2 : m;
+			const int kt = step == StepSplitK ? k / 2 : k;
+			const int nt = step == StepSplitN ? n / 2 : n;
+			if (!halves)
+				return walk(x, mt, kt, nt, level);
+			View<T, Access> parts[2];
+			if (!counting) {
+				const int rt = right ? kt : mt, ct = right ? nt : kt;
+				const bool byRows = rt != rows;
+				parts[0] = x->makeView(0, 0, rt, ct);
+				parts[1] = byRows ? x->makeView(rt, 0, rows - rt, cols) : x->makeView(0, ct, rows, cols - ct);
+			}
+			transform.children[0] = walk(counting ? nullptr : &parts[0], mt, kt, nt, level);
+			transform.children[1] = walk(counting ? nullptr : &parts[1], step == StepSplitM ? m - mt : m,
+				step == StepSplitK ? k - kt : k, step == StepSplitN ? n - nt : n, level);
+		}
+		}
+		if (counting) {
+			nodes++;
+			return nullptr;
+		}
+		transforms.push_back(transform);
+		return &transforms.back();
+	}
+
+	PreparedOperand(const PreparedOperand<T, Access>& other);
+	PreparedOperand<T, Access>& operator=(const PreparedOperand<T, Access>& other);
+};
+
+// c = a^exponent for a square matrix a, by repeated squaring from the top
+// bit of the exponent down, multiplying by a (prepared once) for each set
+// bit: about 2 log2(exponent) products in one workspace, alternating
+// between c and one temporary. c must not overlap a. Throws
+// DimensionMismatch if a is not square or c is not its size.
+template <typename T, typename Access>
+void power(View<T, Access>& a, unsigned int exponent, View<T, Access>& c,
+	const StrassenConfig& config = strassenDefaults()) {
+	const int n = a.getRows();
+	if (a.getCols() != n)
+		throw DimensionMismatch(n, a.getCols());
+	if (c.getRows() != n)
+		throw DimensionMismatch(n, c.getRows());
+	if (c.getCols() != n)
+		throw DimensionMismatch(n, c.getCols());
+	if (exponent <= 1) {
+		for (int i = 0; i < n; i++) {
+			T* ci = c.getRow(i);
+			const T* ai = a.getRow(i);
+			for (int j = 0; j < n; j++)
+				ci[j] = exponent == 1 ? ai[j] : T(i == j ? 1 : 0);
+		}
+		return;
+	}
+	int top = 31;
+	while (!(exponent >> top & 1u))
+		top--;
+	int products = 0;
+	for (int bit = top - 1; bit >= 0; bit--)
+		products += (exponent >> bit & 1u) ? 2 : 1;
+
+	const StrassenConfig resolved = resolveStrassenConfig<T>(config);
+	StrassenWorkspace<T> workspace(n, n, n, resolved);
+	//the last product has to land in c, so the chain of results starts in
+	//c or in the temporary depending on how many products there are
+	const int size = products > 1 ? n : 0;
+	Matrix<T, Access> temporary(size, size);
+	View<T, Access> buffers[2] = { c, temporary.makeView(0, 0, size, size) };
+	std::unique_ptr<PreparedOperand<T, Access> > prepared;
+	if (products > top)
+		prepared.reset(new PreparedOperand<T, Access>(a, PreparedLeft, 1, n, resolved));
+	View<T, Access>* current = &a;
+	for (int bit = top - 1; bit >= 0; bit--) {
+		View<T, Access>* square = &buffers[--products % 2];
+		Matrix<T, Access>::Multiply(*current, *current, *square, workspace, resolved);
+		current = square;
+		if (exponent >> bit & 1u) {
+			//powers of a commute, so a can always be the (prepared) left operand
+			View<T, Access>* product = &buffers[--products % 2];
+			prepared->multiply(*current, *product, workspace);
+			current = product;
+		}
+	}
+}
+
+template <typename T, typename Access>
+Matrix<T, Access> power(View<T, Access>& a, unsigned int exponent,
+	const StrassenConfig& config = strassenDefaults()) {
+	Matrix<T, Access> c(a.getRows(), a.getCols());
+	View<T, Access> result = c.makeView(0, 0, a.getRows(), a.getCols());
+	power(a, exponent, result, config);
+	return c;
+}
+
+// Cheapest order for the product of count matrices where factor i is
+// dims[i] x dims[i + 1], by the classical O(count^3) dynamic program over
+// m k n multiply counts. split[i * count + j] is where the product of
+// factors i..j is cut: (i..split) times (split + 1..j).
+inline std::vector<int> chainOrder(const int* dims, int count) {
+	std::vector<double> cost((size_t)count * count, 0.0);
+	std::vector<int> split((size_t)count * count, 0);
+	for (int length = 2; length <= count; length++) {
+		for (int i = 0; i + length <= count; i++) {
+			const int j = i + length - 1;
+			double best = -1;
+			for (int s = i; s < j; s++) {
+				const double total = cost[(size_t)i * count + s] + cost[(size_t)(s + 1) * count + j] +
+					(double)dims[i] * dims[s + 1] * dims[j + 1];
+				if (best < 0 || total < best) {
+					best = total;
+					split[(size_t)i * count + j] = s;
+				}
+			}
+			cost[(size_t)i * count + j] = best;
+		}
+	}
+	return split;
+}
+
+// The products of one chain() call: a shared workspace and a set of equal
+// intermediate buffers, each held from the product that writes it to the
+// one that reads it. The operands of a product are evaluated before its
+// result buffer is taken, so a left to right chain ping-pongs between two.
+template <typename T, typename Access>
+class ChainEvaluation {
+public:
+	ChainEvaluation(View<T, Access>* f, int n, const StrassenConfig& settings)
+		: factors(f), count(n), config(settings), largest(0), scratch(0) {
+		std::vector<int> dims(count + 1);
+		for (int i = 0; i < count; i++)
+			dims[i] = factors[i].getRows();
+		dims[count] = factors[count - 1].getCols();
+		split = chainOrder(dims.data(), count);
+		measure(0, count - 1, true);
+		workspace.reset(new StrassenWorkspace<T>(scratch));
+	}
+
+	void evaluate(View<T, Access>& c) {
+		View<T, Access> result;
+		evaluate(0, count - 1, &c, result);
+	}
+private:
+	View<T, Access>* factors;
+	int count;
+	StrassenConfig config;
+	std::vector<int> split;
+	size_t largest, scratch;
+	std::unique_ptr<StrassenWorkspace<T> > workspace;
+	//intermediates change shape from product to product, so they are
+	//plain memory of the largest size, viewed in the shape of each result
+	std::vector<std::unique_ptr<AlignedBuffer> > buffers;
+	std::vector<bool> busy;
+
+	//largest intermediate result and largest scratch over the products
+	void measure(int i, int j, bool outer) {
+		if (i == j)
+			return;
+		const int s = split[(size_t)i * count + j];
+		const int m = factors[i].getRows(), k = factors[s].getCols(), n = factors[j].getCols();
+		if (!outer)
+			largest = std::max(largest, (size_t)m * n);
+		scratch = std::max(scratch, StrassenWorkspace<T>::scratchElements(m, k, n, 0, config));
+		measure(i, s, false);
+		measure(s + 1, j, false);
+	}
+
+	int acquire() {
+		for (size_t b = 0; b < busy.size(); b++) {
+			if (!busy[b]) {
+				busy[b] = true;
+				return (int)b;
+			}
+		}
+		buffers.emplace_back(new AlignedBuffer(largest * sizeof(T),
+			matrixAllocationDefaults().alignment));
+		busy.push_back(true);
+		return (int)buffers.size() - 1;
+	}
+	void release(int b) {
+		if (b >= 0)
+			busy[b] = false;
+	}
+
+	//the product of factors i..j into target, or into a buffer taken for
+	//it when target is nullptr; result views it, and the buffer (-1 for
+	//none) is returned to be released by the caller
+	int evaluate(int i, int j, View<T, Access>* target, View<T, Access>& result) {
+		if (i == j) {
+			result = factors[i];
+			return -1;
+		}
+		const int s = split[(size_t)i * count + j];
+		View<T, Access> left, right;
+		const int leftBuffer = evaluate(i, s, nullptr, left);
+		const int rightBuffer = evaluate(s + 1, j, nullptr, right);
+		int buffer = -1;
+		if (target)
+			result = *target;
+		else {
+			buffer = acquire();
+			const int rows = factors[i].getRows(), cols = factors[j].getCols();
+			T* data = reinterpret_cast<T*>(buffers[buffer]->data());
+			result = View<T, Access>(data, cols, rows, cols);
+		}
+		Matrix<T, Access>::Multiply(left, right, result, *workspace, config);
+		release(leftBuffer);
+		release(rightBuffer);
+		return buffer;
+	}
+
+	ChainEvaluation(const ChainEvaluation<T, Access>& other);
+	ChainEvaluation<T, Access>& operator=(const ChainEvaluation<T, Access>& other);
+};
+
+// c = factors[0] * factors[1] * ... * factors[count - 1], parenthesized to
+// need the fewest multiplications. c must not overlap the factors. Throws
+// DimensionMismatch if neighbouring factors or c do not fit together.
+template <typename T, typename Access>
+void chain(View<T, Access>* factors, int count, View<T, Access>& c,
+	const StrassenConfig& config = strassenDefaults()) {
+	if (count < 1)
+		throw DimensionMismatch(1, count);
+	for (int i = 0; i + 1 < count; i++)
+		if (factors[i + 1].getRows() != factors[i].getCols())
+			throw DimensionMismatch(factors[i].getCols(), factors[i + 1].getRows());
+	if (c.getRows() != factors[0].getRows())
+		throw DimensionMismatch(factors[0].getRows(), c.getRows());
+	if (c.getCols() != factors[count - 1].getCols())
+		throw DimensionMismatch(factors[count - 1].getCols(), c.getCols());
+	if (count == 1) {
+		for (int i = 0; i < c.getRows(); i++) {
+			T* ci = c.getRow(i);
+			const T* fi = factors[0].getRow(i);
+			for (int j = 0; j < c.getCols(); j++)
+				ci[j] = fi[j];
+		}
+		return;
+	}
+	ChainEvaluation<T, Access> evaluation(factors, count, resolveStrassenConfig<T>(config));
+	evaluation.evaluate(c);
+}
+
+template <typename T, typename Access>
+Matrix<T, Access> chain(View<T, Access>* factors, int count,
+	const StrassenConfig& config = strassenDefaults()) {
+	const int rows = count > 0 ? factors[0].getRows() : 0;
+	const int cols = count > 0 ? factors[count - 1].getCols() : 0;
+	Matrix<T, Access> c(rows, cols);
+	View<T, Access> result = c.makeView(0, 0, rows, cols);
+	chain(factors, count, result, config);
+	return c;
+}
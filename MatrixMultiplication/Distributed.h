@@ -0,0 +1,323 @@
+#pragma once
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <stddef.h>
+#include <vector>
+#include <mpi.h>
+#include "Matrix.h"
+#include "Simd.h"
+
+// Strassen across the ranks of an MPI communicator. One step of the
+// recursion forms the operands of the seven sub-products on the first rank
+// of the communicator, splits the ranks into up to seven groups, sends each
+// group's operands to its first rank, lets the group compute its products
+// (recursively, with the same scheme) and collects the products to form c.
+// With 7, 49 or 343 ranks every rank ends up with one local product, which
+// it computes with Matrix::Multiply and the thread pool. An odd dimension
+// is peeled: the leading even block is split across the ranks, and the
+// first rank adds the odd row, column and inner index in afterwards.
+//
+// All seven products of a step in flight at once is the breadth first step
+// of CAPS (communication avoiding parallel Strassen): the most parallelism,
+// but the operands and products of all seven live at once. When they do
+// not fit into memoryBytes the step goes depth first instead: the products
+// are computed a few at a time, each batch by all ranks (split between the
+// products of the batch), which communicates more but holds less.
+
+struct DistributedConfig {
+	StrassenConfig local;	// for the products computed on one rank
+	size_t memoryBytes;		// per rank budget for the operands and products of one step, 0 = none
+	int minSize;			// blocks with a smaller dimension are not split across ranks
+};
+
+// Configuration used by multiplyDistributed when none is given.
+inline DistributedConfig& distributedDefaults() {
+	static DistributedConfig config = { strassenDefaults(), 0, 512 };
+	return config;
+}
+
+class MpiError : public std::exception {
+public:
+	MpiError(int e) noexcept
+		: error(e) {}
+	virtual const char* what() const noexcept
+	{
+		return "MPI call failed";
+	}
+
+	//MPI error code
+	int getError() { return error; }
+private:
+	int error;
+};
+
+inline void mpiCheck(int code) {
+	if (code != MPI_SUCCESS)
+		throw MpiError(code);
+}
+
+// MPI type of the elements of a matrix.
+template <typename T>
+MPI_Datatype mpiType();
+template <>
+inline MPI_Datatype mpiType<int>() { return MPI_INT; }
+template <>
+inline MPI_Datatype mpiType<unsigned>() { return MPI_UNSIGNED; }
+template <>
+inline MPI_Datatype mpiType<long long>() { return MPI_LONG_LONG; }
+template <>
+inline MPI_Datatype mpiType<float>() { return MPI_FLOAT; }
+template <>
+inline MPI_Datatype mpiType<double>() { return MPI_DOUBLE; }
+
+//elements per message; MPI counts are int
+const size_t mpiChunk = (size_t)1 << 28;
+
+//send or receive a contiguous rows x cols matrix, in chunks
+template <typename T, typename Access>
+void sendMatrix(Matrix<T, Access>& m, int to, int tag, MPI_Comm comm) {
+	const size_t elements = (size_t)m.getRows() * m.getCols();
+	for (size_t at = 0; at < elements; at += mpiChunk)
+		mpiCheck(MPI_Send(m.getData() + at, (int)std::min(mpiChunk, elements - at), mpiType<T>(), to,
+			tag, comm));
+}
+template <typename T, typename Access>
+void receiveMatrix(Matrix<T, Access>& m, int from, int tag, MPI_Comm comm) {
+	const size_t elements = (size_t)m.getRows() * m.getCols();
+	for (size_t at = 0; at < elements; at += mpiChunk)
+		mpiCheck(MPI_Recv(m.getData() + at, (int)std::min(mpiChunk, elements - at), mpiType<T>(), from,
+			tag, comm, MPI_STATUS_IGNORE));
+}
+template <typename T, typename Access>
+void startReceive(Matrix<T, Access>& m, int from, int tag, MPI_Comm comm,
+	std::vector<MPI_Request>& requests) {
+	const size_t elements = (size_t)m.getRows() * m.getCols();
+	for (size_t at = 0; at < elements; at += mpiChunk) {
+		requests.push_back(MPI_REQUEST_NULL);
+		mpiCheck(MPI_Irecv(m.getData() + at, (int)std::min(mpiChunk, elements - at), mpiType<T>(), from,
+			tag, comm, &requests.back()));
+	}
+}
+
+//dst = sum of signs[t] * terms[t], row by row
+template <typename T, typename Access>
+void distributedCombine(ThreadPool& pool, View<T, Access>& dst, View<T, Access>* const* terms,
+	const int* signs, int count) {
+	const int rows = dst.getRows(), cols = dst.getCols();
+	pool.parallelFor(0, rows, 1, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			const T* src[3];
+			for (int t = 0; t < count; t++)
+				src[t] = terms[t]->getRow(i);
+			simdCombine((size_t)cols, dst.getRow(i), src, signs, count);
+		}
+	});
+}
+
+//the rims a distributed step leaves when m, k or n is odd, added on the
+//first rank after the leading even block c11 = a11 * b11: a rank one update
+//of c11 for an odd k, the last column of c for an odd n, the last row for
+//an odd m
+template <typename T, typename Access>
+void distributedPeel(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c, int m, int k,
+	int n, const StrassenConfig& config) {
+	const int me = m - m % 2, ke = k - k % 2, ne = n - n % 2;
+	if (k != ke && me > 0 && ne > 0) {
+		View<T, Access> ak = a.makeView(0, ke, me, 1);
+		View<T, Access> bk = b.makeView(ke, 0, 1, ne);
+		View<T, Access> c11 = c.makeView(0, 0, me, ne);
+		Matrix<T, Access>::Multiply(ak, bk, c11, T(1), T(1), config);
+	}
+	if (n != ne && me > 0) {
+		View<T, Access> at = a.makeView(0, 0, me, k);
+		View<T, Access> bn = b.makeView(0, ne, k, 1);
+		View<T, Access> cn = c.makeView(0, ne, me, 1);
+		Matrix<T, Access>::Multiply(at, bn, cn, config);
+	}
+	if (m != me) {
+		View<T, Access> am = a.makeView(me, 0, 1, k);
+		View<T, Access> cm = c.makeView(me, 0, 1, n);
+		Matrix<T, Access>::Multiply(am, b, cm, config);
+	}
+}
+
+//one step of multiplyDistributed for an m x k by k x n block: all ranks of
+//comm call it, and a, b and c are only used on its first rank
+template <typename T, typename Access>
+void distributedStep(MPI_Comm comm, View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	int m, int k, int n, const DistributedConfig& config) {
+	int ranks, rank;
+	mpiCheck(MPI_Comm_size(comm, &ranks));
+	mpiCheck(MPI_Comm_rank(comm, &rank));
+	const int smallest = std::min(m, std::min(k, n));
+	if (ranks == 1 || smallest < config.minSize) {
+		if (rank == 0)
+			Matrix<T, Access>::Multiply(a, b, c, config.local);
+		return;
+	}
+	if (m % 2 != 0 || k % 2 != 0 || n % 2 != 0) {
+		//the leading even block across the ranks, the odd rims on the first
+		const int me = m - m % 2, ke = k - k % 2, ne = n - n % 2;
+		View<T, Access> a11, b11, c11;
+		if (rank == 0) {
+			a11 = a.makeView(0, 0, me, ke);
+			b11 = b.makeView(0, 0, ke, ne);
+			c11 = c.makeView(0, 0, me, ne);
+		}
+		distributedStep(comm, a11, b11, c11, me, ke, ne, config);
+		if (rank == 0)
+			distributedPeel(a, b, c, m, k, n, config.local);
+		return;
+	}
+	const int mh = m / 2, kh = k / 2, nh = n / 2;
+	const size_t perProduct = ((size_t)mh * kh + (size_t)kh * nh + (size_t)mh * nh) * sizeof(T);
+	int width = 7;
+	if (config.memoryBytes != 0)
+		width = (int)std::max((size_t)1, std::min((size_t)7, config.memoryBytes / perProduct));
+	ThreadPool& pool = config.local.pool ? *config.local.pool : ThreadPool::global();
+	MatrixAllocation packed = matrixAllocationDefaults();
+	packed.padStride = false;
+	packed.pool = &pool;
+
+	//the operands of product i are left[i] = l0 + ls * l1 and right[i] =
+	//r0 + rs * r1 (one term where the sign is 0), from the quadrants
+	//11, 12, 21, 22 = 0, 1, 2, 3; it adds cs[q] times itself to quadrant q
+	//of c
+	static const int l0[7] = { 0, 0, 2, 3, 0, 1, 0 }, ls[7] = { 0, 1, 1, 0, 1, -1, -1 },
+		l1[7] = { 0, 1, 3, 0, 3, 3, 2 };
+	static const int r0[7] = { 1, 3, 0, 2, 0, 2, 0 }, rs[7] = { -1, 0, 0, -1, 1, 1, 1 },
+		r1[7] = { 3, 0, 0, 0, 3, 3, 1 };
+	static const int cs[7][4] = {
+		{ 0, 1, 0, 1 }, { -1, 1, 0, 0 }, { 0, 0, 1, -1 }, { 1, 0, 1, 0 },
+		{ 1, 0, 0, 1 }, { 1, 0, 0, 0 }, { 0, 0, 0, -1 }
+	};
+	View<T, Access> aq[4], bq[4], cq[4];
+	if (rank == 0) {
+		for (int q = 0; q < 4; q++) {
+			aq[q] = a.makeView(q / 2 * mh, q % 2 * kh, mh, kh);
+			bq[q] = b.makeView(q / 2 * kh, q % 2 * nh, kh, nh);
+			cq[q] = c.makeView(q / 2 * mh, q % 2 * nh, mh, nh);
+		}
+		pool.parallelFor(0, m, 1, [&](int lo, int hi) {
+			for (int i = lo; i < hi; i++)
+				std::fill(c.getRow(i), c.getRow(i) + n, T(0));
+		});
+	}
+
+	for (int first = 0; first < 7; first += width) {
+		const int count = std::min(width, 7 - first);
+		const int groups = std::min(ranks, count);
+		const int group = (int)((long long)rank * groups / ranks);
+		//first rank of group g, which leads it
+		auto leader = [ranks, groups](int g) {
+			return (int)(((long long)g * ranks + groups - 1) / groups);
+		};
+		std::unique_ptr<Matrix<T, Access>> left[7], right[7], product[7];
+		std::vector<MPI_Request> requests;
+
+		//hand out the operands; the leaders take all of theirs before they
+		//start, so the first rank never waits for a busy one
+		for (int i = first; i < first + count; i++) {
+			const int owner = leader((i - first) % groups);
+			if (rank != 0 && rank != owner)
+				continue;
+			left[i].reset(new Matrix<T, Access>(mh, kh, packed));
+			right[i].reset(new Matrix<T, Access>(kh, nh, packed));
+			product[i].reset(new Matrix<T, Access>(mh, nh, packed));
+			if (rank == 0) {
+				View<T, Access> l = left[i]->makeView(0, 0, mh, kh);
+				View<T, Access> r = right[i]->makeView(0, 0, kh, nh);
+				View<T, Access>* lt[2] = { &aq[l0[i]], &aq[l1[i]] };
+				View<T, Access>* rt[2] = { &bq[r0[i]], &bq[r1[i]] };
+				const int lsigns[2] = { 1, ls[i] }, rsigns[2] = { 1, rs[i] };
+				distributedCombine(pool, l, lt, lsigns, ls[i] != 0 ? 2 : 1);
+				distributedCombine(pool, r, rt, rsigns, rs[i] != 0 ? 2 : 1);
+				if (owner != 0) {
+					sendMatrix(*left[i], owner, 3 * i, comm);
+					sendMatrix(*right[i], owner, 3 * i + 1, comm);
+					left[i].reset();
+					right[i].reset();
+					startReceive(*product[i], owner, 3 * i + 2, comm, requests);
+				}
+			}
+			else {
+				receiveMatrix(*left[i], 0, 3 * i, comm);
+				receiveMatrix(*right[i], 0, 3 * i + 1, comm);
+			}
+		}
+
+		//every group computes its products with its own ranks
+		MPI_Comm sub;
+		mpiCheck(MPI_Comm_split(comm, group, rank, &sub));
+		try {
+			for (int i = first; i < first + count; i++) {
+				if ((i - first) % groups != group)
+					continue;
+				const int owner = leader(group);
+				View<T, Access> l, r, p;
+				if (rank == owner) {
+					l = left[i]->makeView(0, 0, mh, kh);
+					r = right[i]->makeView(0, 0, kh, nh);
+					p = product[i]->makeView(0, 0, mh, nh);
+				}
+				distributedStep(sub, l, r, p, mh, kh, nh, config);
+				if (rank == owner && owner != 0)
+					sendMatrix(*product[i], 0, 3 * i + 2, comm);
+			}
+		}
+		catch (...) {
+			MPI_Comm_free(&sub);
+			throw;
+		}
+		mpiCheck(MPI_Comm_free(&sub));
+		if (rank != 0)
+			continue;
+
+		if (!requests.empty())
+			mpiCheck(MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE));
+		for (int i = first; i < first + count; i++) {
+			View<T, Access> p = product[i]->makeView(0, 0, mh, nh);
+			for (int q = 0; q < 4; q++) {
+				if (cs[i][q] == 0)
+					continue;
+				View<T, Access>* terms[2] = { &cq[q], &p };
+				const int signs[2] = { 1, cs[i][q] };
+				distributedCombine(pool, cq[q], terms, signs, 2);
+			}
+		}
+	}
+}
+
+// c = a * b using all ranks of comm, which must all call it with the same
+// config. a, b and c live on rank 0 of comm; the other ranks pass empty
+// views. Throws DimensionMismatch on every rank if the shapes on rank 0 do
+// not fit together.
+template <typename T, typename Access>
+void multiplyDistributed(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c, MPI_Comm comm,
+	const DistributedConfig& config = distributedDefaults()) {
+	int rank;
+	mpiCheck(MPI_Comm_rank(comm, &rank));
+	//m, k, n, and the dimension that does not fit with the one it should
+	int shape[5] = { a.getRows(), a.getCols(), b.getCols(), 0, 0 };
+	if (rank == 0) {
+		if (b.getRows() != a.getCols()) {
+			shape[3] = a.getCols();
+			shape[4] = b.getRows();
+		}
+		else if (c.getRows() != a.getRows()) {
+			shape[3] = a.getRows();
+			shape[4] = c.getRows();
+		}
+		else if (c.getCols() != b.getCols()) {
+			shape[3] = b.getCols();
+			shape[4] = c.getCols();
+		}
+	}
+	mpiCheck(MPI_Bcast(shape, 5, MPI_INT, 0, comm));
+	if (shape[3] != shape[4])
+		throw DimensionMismatch(shape[3], shape[4]);
+	DistributedConfig resolved = config;
+	resolved.local = resolveStrassenConfig<T>(config.local);
+	distributedStep(comm, a, b, c, shape[0], shape[1], shape[2], resolved);
+}
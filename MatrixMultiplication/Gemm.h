@@ -0,0 +1,274 @@
+#pragma once
+#include <stddef.h>
+#include "Simd.h"
+
+// Cache blocked matrix multiplication on raw row major storage, used as
+// the leaf kernel of P_Strassen. The loop structure follows the usual
+// packed GEMM scheme: a kc x nc panel of B is packed so it stays in L2/L3,
+// an mc x kc panel of A is packed so it stays in L2, and a micro-kernel
+// computes an mr x nr register block of C from one sliver of each.
+
+// Cache blocking parameters. They can be changed at run time (before any
+// multiplication is started) to tune for a particular machine.
+struct GemmBlocking {
+	int mc, kc, nc;
+};
+
+inline GemmBlocking& gemmBlocking() {
+	static GemmBlocking blocking = { 128, 256, 2048 };
+	return blocking;
+}
+
+// Portable register block micro-kernel, written so the nr loop vectorizes.
+// gemmBlocked uses the vector kernels from Simd.h instead when the CPU has
+// one for T.
+template <typename T>
+struct GemmKernel {
+	static const int mr = 4;
+	static const int nr = 8;
+
+	// c[0..m)[0..n) = (accumulate ? c : 0) + a * b, where a is an mr x kc
+	// packed sliver of A and b a kc x nr packed sliver of B
+	static void micro(int kc, const T* a, const T* b, T* c, size_t ldc,
+		int m, int n, bool accumulate) {
+		T acc[mr][nr];
+		int i, j, k;
+		for (i = 0; i < mr; i++)
+			for (j = 0; j < nr; j++)
+				acc[i][j] = T(0);
+		for (k = 0; k < kc; k++) {
+			for (i = 0; i < mr; i++) {
+				const T aik = a[k*mr + i];
+				for (j = 0; j < nr; j++)
+					acc[i][j] += aik * b[k*nr + j];
+			}
+		}
+		for (i = 0; i < m; i++) {
+			T* row = c + i * ldc;
+			if (accumulate) {
+				for (j = 0; j < n; j++)
+					row[j] += acc[i][j];
+			}
+			else {
+				for (j = 0; j < n; j++)
+					row[j] = acc[i][j];
+			}
+		}
+	}
+};
+
+// Per thread packing buffers, grown on demand and reused across calls so
+// the leaf kernel does not allocate once a thread has warmed up.
+template <typename T>
+class GemmBuffers {
+public:
+	GemmBuffers() : a(nullptr), b(nullptr), aSize(0), bSize(0) {}
+	~GemmBuffers() { delete[] a; delete[] b; }
+
+	T* getA(size_t n) { return grow(a, aSize, n); }
+	T* getB(size_t n) { return grow(b, bSize, n); }
+private:
+	T* a;
+	T* b;
+	size_t aSize, bSize;
+
+	static T* grow(T*& buffer, size_t& size, size_t n) {
+		if (n > size) {
+			delete[] buffer;
+			buffer = new T[n];
+			size = n;
+		}
+		return buffer;
+	}
+
+	GemmBuffers(const GemmBuffers<T>& other);
+	GemmBuffers<T>& operator=(const GemmBuffers<T>& other);
+};
+
+template <typename T>
+GemmBuffers<T>& gemmBuffers() {
+	thread_local GemmBuffers<T> buffers;
+	return buffers;
+}
+
+// Pack alpha times the m x k block at a into slivers of mr rows, each
+// stored k major (mr consecutive values per k). Rows past m are zero filled.
+// a may hold a narrower type than T; it is widened while packing.
+template <typename T, typename S>
+void gemmPackA(int m, int k, const S* a, size_t lda, T* packed, int mr, T alpha = T(1)) {
+	for (int ir = 0; ir < m; ir += mr) {
+		const int rows = m - ir < mr ? m - ir : mr;
+		for (int p = 0; p < k; p++) {
+			int i;
+			if (alpha == T(1)) {
+				for (i = 0; i < rows; i++)
+					packed[i] = T(a[(ir + i) * lda + p]);
+			}
+			else {
+				for (i = 0; i < rows; i++)
+					packed[i] = alpha * T(a[(ir + i) * lda + p]);
+			}
+			for (; i < mr; i++)
+				packed[i] = T(0);
+			packed += mr;
+		}
+	}
+}
+
+// Pack the k x n block at b into slivers of nr columns, each stored k major
+// (nr consecutive values per k). Columns past n are zero filled, and b is
+// widened to T as for gemmPackA.
+template <typename T, typename S>
+void gemmPackB(int k, int n, const S* b, size_t ldb, T* packed, int nr) {
+	for (int jr = 0; jr < n; jr += nr) {
+		const int cols = n - jr < nr ? n - jr : nr;
+		for (int p = 0; p < k; p++) {
+			const S* row = b + p * ldb + jr;
+			int j;
+			for (j = 0; j < cols; j++)
+				packed[j] = T(row[j]);
+			for (; j < nr; j++)
+				packed[j] = T(0);
+			packed += nr;
+		}
+	}
+}
+
+// Register and cache blocking gemmBlocked uses for T on this machine: the
+// layout of its packed B panels.
+struct GemmPacking {
+	int kc, nc, nr;
+};
+
+inline bool operator==(const GemmPacking& x, const GemmPacking& y) {
+	return x.kc == y.kc && x.nc == y.nc && x.nr == y.nr;
+}
+
+template <typename T>
+GemmPacking gemmPacking() {
+	SimdMicroKernel<T> kernel = { GemmKernel<T>::mr, GemmKernel<T>::nr, &GemmKernel<T>::micro };
+	simdMicroKernel(kernel);
+	const GemmBlocking blocking = gemmBlocking();
+	//keep the panel width a multiple of the register block
+	GemmPacking packing = { blocking.kc, (blocking.nc + kernel.nr - 1) / kernel.nr * kernel.nr,
+		kernel.nr };
+	return packing;
+}
+
+// Elements of a k x n block of B packed whole by gemmPackPanels.
+inline size_t gemmPackedElements(int k, int n, const GemmPacking& packing) {
+	return (size_t)k * ((n + packing.nr - 1) / packing.nr * packing.nr);
+}
+
+// Pack all kc x nc panels of the k x n block at b, as gemmBlocked packs
+// them one at a time: the panels of the columns jc..jc + nc start at
+// packed + jc * k, each after the full kc panels above it. A fixed B packed
+// once this way can then be multiplied by gemmBlockedPacked without
+// packing it again.
+template <typename T, typename SB>
+void gemmPackPanels(int k, int n, const SB* b, size_t ldb, T* packed, const GemmPacking& packing) {
+	for (int jc = 0; jc < n; jc += packing.nc) {
+		const int nb = n - jc < packing.nc ? n - jc : packing.nc;
+		const size_t width = (size_t)(nb + packing.nr - 1) / packing.nr * packing.nr;
+		for (int pc = 0; pc < k; pc += packing.kc) {
+			const int kb = k - pc < packing.kc ? k - pc : packing.kc;
+			gemmPackB(kb, nb, b + pc * ldb + jc, ldb, packed + (size_t)jc * k + pc * width, packing.nr);
+		}
+	}
+}
+
+// The loops of gemmBlocked, over either b or a block packed whole (packed
+// is then not null): c gets the columns first..first + n of a k x width
+// packed block, first being a multiple of nr.
+template <typename T, typename SA, typename SB>
+void gemmPanels(int m, int n, int k, T alpha, const SA* a, size_t lda, const SB* b, size_t ldb,
+	const T* packed, int width, int first, T beta, T* c, size_t ldc) {
+	SimdMicroKernel<T> kernel = { GemmKernel<T>::mr, GemmKernel<T>::nr, &GemmKernel<T>::micro };
+	simdMicroKernel(kernel);
+	const int mr = kernel.mr;
+	const int nr = kernel.nr;
+	const GemmBlocking blocking = gemmBlocking();
+	//keep the panel sizes multiples of the register block
+	const int mc = (blocking.mc + mr - 1) / mr * mr;
+	const int nc = (blocking.nc + nr - 1) / nr * nr;
+	const int kc = blocking.kc;
+	GemmBuffers<T>& buffers = gemmBuffers<T>();
+	T* packedA = buffers.getA((size_t)mc * kc);
+	T* packedB = packed ? nullptr : buffers.getB((size_t)kc * nc);
+
+	if (beta != T(0) && beta != T(1)) {
+		for (int i = 0; i < m; i++)
+			for (int j = 0; j < n; j++)
+				c[i * ldc + j] *= beta;
+	}
+	const bool overwrite = beta == T(0);
+	if (k == 0) {
+		if (overwrite) {
+			for (int i = 0; i < m; i++)
+				for (int j = 0; j < n; j++)
+					c[i * ldc + j] = T(0);
+		}
+		return;
+	}
+	//jc walks the column panels of the packed layout, lo..hi is the part of
+	//one that c gets
+	for (int jc = first / nc * nc; jc < first + n; jc += nc) {
+		const int lo = jc > first ? jc : first;
+		const int hi = jc + nc < first + n ? jc + nc : first + n;
+		const int span = width - jc < nc ? width - jc : nc;
+		for (int pc = 0; pc < k; pc += kc) {
+			const int kb = k - pc < kc ? k - pc : kc;
+			//sliver jr of the panel starts at panel + (jr - origin) * kb
+			const T* panel;
+			int origin;
+			if (packed) {
+				panel = packed + (size_t)jc * k + (size_t)pc * ((span + nr - 1) / nr * nr);
+				origin = jc;
+			}
+			else {
+				gemmPackB(kb, hi - lo, b + pc * ldb + (lo - first), ldb, packedB, nr);
+				panel = packedB;
+				origin = lo;
+			}
+			for (int ic = 0; ic < m; ic += mc) {
+				const int mb = m - ic < mc ? m - ic : mc;
+				gemmPackA(mb, kb, a + ic * lda + pc, lda, packedA, mr, alpha);
+				for (int jr = lo; jr < hi; jr += nr) {
+					const int cols = hi - jr < nr ? hi - jr : nr;
+					for (int ir = 0; ir < mb; ir += mr) {
+						const int rows = mb - ir < mr ? mb - ir : mr;
+						kernel.run(kb, packedA + (size_t)ir * kb, panel + (size_t)(jr - origin) * kb,
+							c + (ic + ir) * ldc + (jr - first), ldc, rows, cols, pc != 0 || !overwrite);
+					}
+				}
+			}
+		}
+	}
+}
+
+// c (m x n) = alpha * a (m x k) * b (k x n) + beta * c. With beta == 0 c is
+// not read, with beta == 1 the kernels accumulate into it directly; other
+// values scale c once before the first k panel. a and b can be stored in
+// narrower types than T (see MixedPrecision.h): the packed panels and all
+// arithmetic are in T, so only the reads of a and b get cheaper.
+template <typename T, typename SA, typename SB>
+void gemmBlocked(int m, int n, int k, T alpha, const SA* a, size_t lda, const SB* b, size_t ldb,
+	T beta, T* c, size_t ldc) {
+	gemmPanels(m, n, k, alpha, a, lda, b, ldb, (const T*)nullptr, n, 0, beta, c, ldc);
+}
+
+// gemmBlocked with b packed whole by gemmPackPanels under the current
+// gemmPacking(): c (m x n) = alpha * a * (columns first..first + n of the
+// k x width packed block) + beta * c, with first a multiple of nr.
+template <typename T, typename SA>
+void gemmBlockedPacked(int m, int n, int k, T alpha, const SA* a, size_t lda, const T* packed,
+	int width, int first, T beta, T* c, size_t ldc) {
+	gemmPanels(m, n, k, alpha, a, lda, (const T*)nullptr, 0, packed, width, first, beta, c, ldc);
+}
+
+// c (m x n) = a (m x k) * b (k x n)
+template <typename T>
+void gemmBlocked(int m, int n, int k, const T* a, size_t lda, const T* b, size_t ldb,
+	T* c, size_t ldc) {
+	gemmBlocked(m, n, k, T(1), a, lda, b, ldb, T(0), c, ldc);
+}
@@ -0,0 +1,528 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <stddef.h>
+#include <vector>
+#if defined(STRASSEN_HIP)
+#include <hip/hip_runtime.h>
+#include <hipblas/hipblas.h>
+#else
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#endif
+#include "Matrix.h"
+#include "ThreadPool.h"
+
+// GPU backend for float and double products, on CUDA with cuBLAS or, with
+// STRASSEN_HIP defined, on ROCm with hipBLAS. The top levels of Strassen
+// run breadth first on the device: the operand sums of all 7^levels leaf
+// products are formed with geam, the leaves run as a single batched GEMM
+// and the products are combined back with geam, all on device memory. A
+// product is split by rows between the device and the CPU (Matrix::Multiply
+// on the pool) in the ratio of their measured throughputs, and the device
+// rows go through in panels whose transfers overlap the compute of the
+// neighbouring panels.
+
+#if defined(STRASSEN_HIP)
+typedef hipError_t gpuError_t;
+typedef hipStream_t gpuStream_t;
+typedef hipEvent_t gpuEvent_t;
+typedef hipblasHandle_t gpuBlasHandle_t;
+typedef hipblasStatus_t gpuBlasStatus_t;
+#define gpuSuccess hipSuccess
+#define gpuMalloc hipMalloc
+#define gpuFree hipFree
+#define gpuMemcpyAsync hipMemcpyAsync
+#define gpuMemcpy2DAsync hipMemcpy2DAsync
+#define gpuMemcpyHostToDevice hipMemcpyHostToDevice
+#define gpuMemcpyDeviceToHost hipMemcpyDeviceToHost
+#define gpuSetDevice hipSetDevice
+#define gpuStreamCreate hipStreamCreate
+#define gpuStreamDestroy hipStreamDestroy
+#define gpuStreamSynchronize hipStreamSynchronize
+#define gpuStreamWaitEvent hipStreamWaitEvent
+#define gpuEventCreate hipEventCreate
+#define gpuEventDestroy hipEventDestroy
+#define gpuEventRecord hipEventRecord
+#define gpuEventElapsedTime hipEventElapsedTime
+#define gpuHostRegister hipHostRegister
+#define gpuHostUnregister hipHostUnregister
+#define gpuHostRegisterDefault hipHostRegisterDefault
+#define gpuBlasSuccess HIPBLAS_STATUS_SUCCESS
+#define gpuBlasNoTrans HIPBLAS_OP_N
+#define gpuBlasCreate hipblasCreate
+#define gpuBlasDestroy hipblasDestroy
+#define gpuBlasSetStream hipblasSetStream
+#define gpuBlasSgeam hipblasSgeam
+#define gpuBlasDgeam hipblasDgeam
+#define gpuBlasSgemmBatched hipblasSgemmBatched
+#define gpuBlasDgemmBatched hipblasDgemmBatched
+#else
+typedef cudaError_t gpuError_t;
+typedef cudaStream_t gpuStream_t;
+typedef cudaEvent_t gpuEvent_t;
+typedef cublasHandle_t gpuBlasHandle_t;
+typedef cublasStatus_t gpuBlasStatus_t;
+#define gpuSuccess cudaSuccess
+#define gpuMalloc cudaMalloc
+#define gpuFree cudaFree
+#define gpuMemcpyAsync cudaMemcpyAsync
+#define gpuMemcpy2DAsync cudaMemcpy2DAsync
+#define gpuMemcpyHostToDevice cudaMemcpyHostToDevice
+#define gpuMemcpyDeviceToHost cudaMemcpyDeviceToHost
+#define gpuSetDevice cudaSetDevice
+#define gpuStreamCreate cudaStreamCreate
+#define gpuStreamDestroy cudaStreamDestroy
+#define gpuStreamSynchronize cudaStreamSynchronize
+#define gpuStreamWaitEvent cudaStreamWaitEvent
+#define gpuEventCreate cudaEventCreate
+#define gpuEventDestroy cudaEventDestroy
+#define gpuEventRecord cudaEventRecord
+#define gpuEventElapsedTime cudaEventElapsedTime
+#define gpuHostRegister cudaHostRegister
+#define gpuHostUnregister cudaHostUnregister
+#define gpuHostRegisterDefault cudaHostRegisterDefault
+#define gpuBlasSuccess CUBLAS_STATUS_SUCCESS
+#define gpuBlasNoTrans CUBLAS_OP_N
+#define gpuBlasCreate cublasCreate
+#define gpuBlasDestroy cublasDestroy
+#define gpuBlasSetStream cublasSetStream
+#define gpuBlasSgeam cublasSgeam
+#define gpuBlasDgeam cublasDgeam
+#define gpuBlasSgemmBatched cublasSgemmBatched
+#define gpuBlasDgemmBatched cublasDgemmBatched
+#endif
+
+class GpuError : public std::exception {
+public:
+	GpuError(const char* r, int e) noexcept
+		: reason(r), error(e) {}
+	virtual const char* what() const noexcept
+	{
+		return reason;
+	}
+
+	//runtime or BLAS status code
+	int getError() { return error; }
+private:
+	const char* reason;
+	int error;
+};
+
+inline void gpuCheck(gpuError_t code) {
+	if (code != gpuSuccess)
+		throw GpuError("GPU runtime call failed", (int)code);
+}
+inline void gpuBlasCheck(gpuBlasStatus_t code) {
+	if (code != gpuBlasSuccess)
+		throw GpuError("GPU BLAS call failed", (int)code);
+}
+
+// The BLAS calls for row major matrices: a row major matrix is the column
+// major transpose, so (A B)^T = B^T A^T turns into a column major GEMM with
+// the operands swapped.
+inline gpuBlasStatus_t deviceGeam(gpuBlasHandle_t handle, int rows, int cols, float alpha,
+	const float* x, int ldx, float beta, const float* y, int ldy, float* z, int ldz) {
+	return gpuBlasSgeam(handle, gpuBlasNoTrans, gpuBlasNoTrans, cols, rows, &alpha, x, ldx, &beta, y,
+		ldy, z, ldz);
+}
+inline gpuBlasStatus_t deviceGeam(gpuBlasHandle_t handle, int rows, int cols, double alpha,
+	const double* x, int ldx, double beta, const double* y, int ldy, double* z, int ldz) {
+	return gpuBlasDgeam(handle, gpuBlasNoTrans, gpuBlasNoTrans, cols, rows, &alpha, x, ldx, &beta, y,
+		ldy, z, ldz);
+}
+inline gpuBlasStatus_t deviceGemmBatched(gpuBlasHandle_t handle, int m, int n, int k,
+	const float* const* a, int lda, const float* const* b, int ldb, float* const* c, int ldc,
+	int count) {
+	const float one = 1, zero = 0;
+#if defined(STRASSEN_HIP)
+	return gpuBlasSgemmBatched(handle, gpuBlasNoTrans, gpuBlasNoTrans, n, m, k, &one,
+		const_cast<float* const*>(b), ldb, const_cast<float* const*>(a), lda, &zero, const_cast<float**>(c),
+		ldc, count);
+#else
+	return gpuBlasSgemmBatched(handle, gpuBlasNoTrans, gpuBlasNoTrans, n, m, k, &one, b, ldb, a, lda,
+		&zero, c, ldc, count);
+#endif
+}
+inline gpuBlasStatus_t deviceGemmBatched(gpuBlasHandle_t handle, int m, int n, int k,
+	const double* const* a, int lda, const double* const* b, int ldb, double* const* c, int ldc,
+	int count) {
+	const double one = 1, zero = 0;
+#if defined(STRASSEN_HIP)
+	return gpuBlasDgemmBatched(handle, gpuBlasNoTrans, gpuBlasNoTrans, n, m, k, &one,
+		const_cast<double* const*>(b), ldb, const_cast<double* const*>(a), lda, &zero,
+		const_cast<double**>(c), ldc, count);
+#else
+	return gpuBlasDgemmBatched(handle, gpuBlasNoTrans, gpuBlasNoTrans, n, m, k, &one, b, ldb, a, lda,
+		&zero, c, ldc, count);
+#endif
+}
+
+// Device memory of count elements of T.
+template <typename T>
+class DeviceBuffer {
+public:
+	DeviceBuffer() : data(nullptr), count(0) {}
+	explicit DeviceBuffer(size_t elements) : data(nullptr), count(0) {
+		resize(elements);
+	}
+	~DeviceBuffer() {
+		if (data)
+			gpuFree(data);
+	}
+
+	//grow to at least elements; the contents are lost
+	void resize(size_t elements) {
+		if (elements <= count)
+			return;
+		if (data)
+			gpuFree(data);
+		data = nullptr;
+		count = 0;
+		void* memory = nullptr;
+		gpuCheck(gpuMalloc(&memory, elements * sizeof(T)));
+		data = static_cast<T*>(memory);
+		count = elements;
+	}
+	T* get() { return data; }
+	size_t size() const { return count; }
+private:
+	T* data;
+	size_t count;
+
+	DeviceBuffer(const DeviceBuffer<T>& other);
+	DeviceBuffer<T>& operator=(const DeviceBuffer<T>& other);
+};
+
+// A row major block of device memory.
+template <typename T>
+struct DeviceBlock {
+	T* data;
+	int ld, rows, cols;
+
+	DeviceBlock<T> quadrant(int q) const {
+		const int rh = rows / 2, ch = cols / 2;
+		const DeviceBlock<T> block = { data + (size_t)(q / 2) * rh * ld + (q % 2) * ch, ld, rh, ch };
+		return block;
+	}
+};
+
+// Settings of a GpuBackend.
+struct GpuOptions {
+	int device;			// device index
+	int levels;			// Strassen levels done breadth first on the device
+	int panelRows;		// rows of c per transfer panel
+	bool pinHost;		// page lock the host operands for the duration of a product
+	double gpuShare;	// initial share of rows for the device, before anything is measured
+};
+
+inline GpuOptions& gpuDefaults() {
+	static GpuOptions options = { 0, 2, 2048, true, 0.5 };
+	return options;
+}
+
+// One device with its BLAS handle, a compute and a copy stream, and device
+// memory reused across products.
+template <typename T>
+class GpuBackend {
+public:
+	explicit GpuBackend(const GpuOptions& o = gpuDefaults()) : options(o), share(o.gpuShare) {
+		static_assert(std::is_same<T, float>::value || std::is_same<T, double>::value,
+			"the GPU backend supports float and double");
+		gpuCheck(gpuSetDevice(options.device));
+		gpuBlasCheck(gpuBlasCreate(&blas));
+		gpuCheck(gpuStreamCreate(&compute));
+		gpuCheck(gpuStreamCreate(&copy));
+		gpuBlasCheck(gpuBlasSetStream(blas, compute));
+	}
+	~GpuBackend() {
+		//unchecked like the calls below, a destructor must not throw
+		gpuSetDevice(options.device);
+		gpuBlasDestroy(blas);
+		gpuStreamDestroy(compute);
+		gpuStreamDestroy(copy);
+	}
+
+	// Fraction of the rows of c the next product gives to the device.
+	double gpuShare() const { return share; }
+
+	// c = a * b, rows split between the device and cpuConfig's pool.
+	template <typename Access>
+	void multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		const StrassenConfig& cpuConfig = strassenDefaults()) {
+		if (b.getRows() != a.getCols())
+			throw DimensionMismatch(a.getCols(), b.getRows());
+		if (c.getRows() != a.getRows())
+			throw DimensionMismatch(a.getRows(), c.getRows());
+		if (c.getCols() != b.getCols())
+			throw DimensionMismatch(b.getCols(), c.getCols());
+		const int m = a.getRows(), k = a.getCols(), n = b.getCols();
+		//device rows in whole multiples of the breadth first block height
+		const int unit = 1 << options.levels;
+		const int gpuRows = std::max(0, std::min(m, (int)(m * share) / unit * unit));
+		ThreadPool& pool = cpuConfig.pool ? *cpuConfig.pool : ThreadPool::global();
+
+		//the device part is driven from a pool thread, the rest of c is
+		//computed on the pool meanwhile
+		double gpuSeconds = 0, cpuSeconds = 0;
+		TaskGroup device;
+		if (gpuRows > 0) {
+			pool.submit(device, [&]() {
+				gpuSeconds = devicePart(a, b, c, gpuRows, k, n);
+			});
+		}
+		std::exception_ptr cpuFailure;
+		if (gpuRows < m) {
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			try {
+				View<T, Access> ca = a.makeView(gpuRows, 0, m - gpuRows, k);
+				View<T, Access> cc = c.makeView(gpuRows, 0, m - gpuRows, n);
+				Matrix<T, Access>::Multiply(ca, b, cc, cpuConfig);
+			}
+			catch (...) {
+				cpuFailure = std::current_exception();
+			}
+			cpuSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		pool.wait(device);
+		if (cpuFailure)
+			std::rethrow_exception(cpuFailure);
+
+		//rows per second on each side decide the next split
+		if (gpuRows > 0 && gpuRows < m && gpuSeconds > 0 && cpuSeconds > 0) {
+			const double gpuRate = gpuRows / gpuSeconds, cpuRate = (m - gpuRows) / cpuSeconds;
+			share = 0.5 * share + 0.5 * gpuRate / (gpuRate + cpuRate);
+		}
+	}
+
+	// c = a * b for device blocks of the same shapes, on the compute stream.
+	void deviceMultiply(const DeviceBlock<T>& a, const DeviceBlock<T>& b, const DeviceBlock<T>& c) {
+		int levels = 0;
+		while (levels < options.levels && a.rows % (2 << levels) == 0 && a.cols % (2 << levels) == 0 &&
+			b.cols % (2 << levels) == 0 && a.rows >> levels >= 64 && a.cols >> levels >= 64 &&
+			b.cols >> levels >= 64)
+			levels++;
+		scratch.resize(scratchElements(a.rows, a.cols, b.cols, levels));
+		T* next = scratch.get();
+		std::vector<Node> nodes;
+		std::vector<const T*> left, right;
+		std::vector<T*> out;
+		expand(a, b, c, 0, levels, next, nodes, left, right, out);
+
+		//the leaves, as one batched GEMM over pointer arrays on the device
+		const int count = (int)out.size();
+		std::vector<const void*> pointers;
+		for (int i = 0; i < count; i++)
+			pointers.push_back(left[i]);
+		for (int i = 0; i < count; i++)
+			pointers.push_back(right[i]);
+		for (int i = 0; i < count; i++)
+			pointers.push_back(out[i]);
+		arrays.resize(pointers.size() * sizeof(void*) / sizeof(T) + 1);
+		//on the compute stream, so the GEMM of the previous call has read
+		//the arrays before they are overwritten
+		gpuCheck(gpuMemcpyAsync(arrays.get(), pointers.data(), pointers.size() * sizeof(void*),
+			gpuMemcpyHostToDevice, compute));
+		void** da = reinterpret_cast<void**>(arrays.get());
+		const int lm = a.rows >> levels, lk = a.cols >> levels, ln = b.cols >> levels;
+		const int lda = nodes.empty() ? a.ld : lk, ldb = nodes.empty() ? b.ld : ln,
+			ldc = nodes.empty() ? c.ld : ln;
+		gpuBlasCheck(deviceGemmBatched(blas, lm, ln, lk, reinterpret_cast<const T* const*>(da), lda,
+			reinterpret_cast<const T* const*>(da + count), ldb, reinterpret_cast<T* const*>(da + 2 * count),
+			ldc, count));
+
+		for (size_t i = nodes.size(); i-- > 0; )
+			combine(nodes[i]);
+	}
+private:
+	GpuOptions options;
+	double share;
+	gpuBlasHandle_t blas;
+	gpuStream_t compute, copy;
+	DeviceBuffer<T> scratch, arrays, deviceB, panelA[2], panelC[2];
+
+	//a step taken breadth first: c gets the seven products in p
+	struct Node {
+		DeviceBlock<T> c;
+		DeviceBlock<T> p[7];
+	};
+
+	//operands of product i: l0 + ls * l1 and r0 + rs * r1 (one term where
+	//the sign is 0) from the quadrants 11, 12, 21, 22 = 0, 1, 2, 3
+	static const int* table(int which) {
+		static const int tables[6][7] = {
+			{ 0, 0, 2, 3, 0, 1, 0 }, { 0, 1, 1, 0, 1, -1, -1 }, { 0, 1, 3, 0, 3, 3, 2 },
+			{ 1, 3, 0, 2, 0, 2, 0 }, { -1, 0, 0, -1, 1, 1, 1 }, { 3, 0, 0, 0, 3, 3, 1 }
+		};
+		return tables[which];
+	}
+
+	static size_t scratchElements(int m, int k, int n, int levels) {
+		if (levels == 0)
+			return 0;
+		const size_t mh = m / 2, kh = k / 2, nh = n / 2;
+		return 7 * (mh * kh + kh * nh + mh * nh) + 7 * scratchElements(m / 2, k / 2, n / 2, levels - 1);
+	}
+
+	DeviceBlock<T> take(T*& next, int rows, int cols) {
+		const DeviceBlock<T> block = { next, cols, rows, cols };
+		next += (size_t)rows * cols;
+		return block;
+	}
+
+	//z = x + sign * y, or a plain reference to x when sign is 0
+	DeviceBlock<T> operand(const DeviceBlock<T>& x, int sign, const DeviceBlock<T>& y, T*& next) {
+		if (sign == 0)
+			return x;
+		DeviceBlock<T> z = take(next, x.rows, x.cols);
+		gpuBlasCheck(deviceGeam(blas, x.rows, x.cols, T(1), x.data, x.ld, T(sign), y.data, y.ld, z.data,
+			z.ld));
+		return z;
+	}
+
+	void expand(const DeviceBlock<T>& a, const DeviceBlock<T>& b, const DeviceBlock<T>& c, int level,
+		int levels, T*& next, std::vector<Node>& nodes, std::vector<const T*>& left,
+		std::vector<const T*>& right, std::vector<T*>& out) {
+		if (level == levels) {
+			left.push_back(a.data);
+			right.push_back(b.data);
+			out.push_back(c.data);
+			return;
+		}
+		DeviceBlock<T> aq[4], bq[4];
+		for (int q = 0; q < 4; q++) {
+			aq[q] = a.quadrant(q);
+			bq[q] = b.quadrant(q);
+		}
+		Node node;
+		node.c = c;
+		DeviceBlock<T> l[7], r[7];
+		for (int i = 0; i < 7; i++) {
+			l[i] = operand(aq[table(0)[i]], table(1)[i], aq[table(2)[i]], next);
+			r[i] = operand(bq[table(3)[i]], table(4)[i], bq[table(5)[i]], next);
+			node.p[i] = take(next, c.rows / 2, c.cols / 2);
+		}
+		nodes.push_back(node);
+		//the leaves are batched with a single leading dimension, so plain
+		//quadrant operands (strided in their parent) are copied out
+		for (int i = 0; i < 7; i++) {
+			if (table(1)[i] == 0 && level + 1 == levels)
+				l[i] = copyOut(l[i], next);
+			if (table(4)[i] == 0 && level + 1 == levels)
+				r[i] = copyOut(r[i], next);
+			expand(l[i], r[i], node.p[i], level + 1, levels, next, nodes, left, right, out);
+		}
+	}
+
+	DeviceBlock<T> copyOut(const DeviceBlock<T>& x, T*& next) {
+		DeviceBlock<T> z = take(next, x.rows, x.cols);
+		gpuBlasCheck(deviceGeam(blas, x.rows, x.cols, T(1), x.data, x.ld, T(0), x.data, x.ld, z.data,
+			z.ld));
+		return z;
+	}
+
+	//c11 = p4 + p3 - p1 + p5, c12 = p0 + p1, c21 = p2 + p3,
+	//c22 = p4 + p0 - p2 - p6
+	void combine(const Node& node) {
+		static const int terms[4][4] = { { 4, 3, 1, 5 }, { 0, 1, -1, -1 }, { 2, 3, -1, -1 }, { 4, 0, 2, 6 } };
+		static const int signs[4][4] = { { 1, 1, -1, 1 }, { 1, 1, 0, 0 }, { 1, 1, 0, 0 }, { 1, 1, -1, -1 } };
+		for (int q = 0; q < 4; q++) {
+			const DeviceBlock<T> dst = node.c.quadrant(q);
+			const DeviceBlock<T>& x = node.p[terms[q][0]];
+			const DeviceBlock<T>& y = node.p[terms[q][1]];
+			gpuBlasCheck(deviceGeam(blas, dst.rows, dst.cols, T(1), x.data, x.ld, T(signs[q][1]), y.data,
+				y.ld, dst.data, dst.ld));
+			for (int t = 2; t < 4 && terms[q][t] >= 0; t++) {
+				const DeviceBlock<T>& z = node.p[terms[q][t]];
+				gpuBlasCheck(deviceGeam(blas, dst.rows, dst.cols, T(1), dst.data, dst.ld, T(signs[q][t]),
+					z.data, z.ld, dst.data, dst.ld));
+			}
+		}
+	}
+
+	//the first rows rows of c on the device, in panels: panel i + 1 is
+	//uploaded and panel i - 1 downloaded while panel i is multiplied;
+	//returns the seconds it took
+	template <typename Access>
+	double devicePart(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c, int rows, int k,
+		int n) {
+		//the device is per thread, and this runs on a pool thread
+		gpuCheck(gpuSetDevice(options.device));
+		const int unit = 1 << options.levels;
+		const int panel = std::max(unit, options.panelRows / unit * unit);
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::vector<const void*> registered;
+		auto lock = [&](const void* base, size_t bytes) {
+			if (options.pinHost && gpuHostRegister(const_cast<void*>(base), bytes,
+				gpuHostRegisterDefault) == gpuSuccess)
+				registered.push_back(base);
+		};
+		lock(a.getData(), ((size_t)(rows - 1) * a.getStride() + k) * sizeof(T));
+		lock(b.getData(), ((size_t)(k - 1) * b.getStride() + n) * sizeof(T));
+		lock(c.getData(), ((size_t)(rows - 1) * c.getStride() + n) * sizeof(T));
+
+		gpuEvent_t loaded[2], multiplied[2], stored[2], bReady;
+		gpuCheck(gpuEventCreate(&bReady));
+		for (int s = 0; s < 2; s++) {
+			gpuCheck(gpuEventCreate(&loaded[s]));
+			gpuCheck(gpuEventCreate(&multiplied[s]));
+			gpuCheck(gpuEventCreate(&stored[s]));
+		}
+		try {
+			deviceB.resize((size_t)k * n);
+			gpuCheck(gpuMemcpy2DAsync(deviceB.get(), n * sizeof(T), b.getData(), b.getStride() * sizeof(T),
+				n * sizeof(T), k, gpuMemcpyHostToDevice, copy));
+			gpuCheck(gpuEventRecord(bReady, copy));
+			gpuCheck(gpuStreamWaitEvent(compute, bReady, 0));
+			for (int s = 0; s < 2; s++) {
+				panelA[s].resize((size_t)panel * k);
+				panelC[s].resize((size_t)panel * n);
+			}
+			const DeviceBlock<T> db = { deviceB.get(), n, k, n };
+			int index = 0;
+			for (int row = 0; row < rows; row += panel, index++) {
+				const int height = std::min(panel, rows - row);
+				const int s = index % 2;
+				gpuCheck(gpuMemcpy2DAsync(panelA[s].get(), k * sizeof(T), a.getRow(row),
+					a.getStride() * sizeof(T), k * sizeof(T), height, gpuMemcpyHostToDevice, copy));
+				gpuCheck(gpuEventRecord(loaded[s], copy));
+				gpuCheck(gpuStreamWaitEvent(compute, loaded[s], 0));
+				if (index >= 2)
+					gpuCheck(gpuStreamWaitEvent(compute, stored[s], 0));
+				const DeviceBlock<T> da = { panelA[s].get(), k, height, k };
+				const DeviceBlock<T> dc = { panelC[s].get(), n, height, n };
+				deviceMultiply(da, db, dc);
+				gpuCheck(gpuEventRecord(multiplied[s], compute));
+				gpuCheck(gpuStreamWaitEvent(copy, multiplied[s], 0));
+				gpuCheck(gpuMemcpy2DAsync(c.getRow(row), c.getStride() * sizeof(T), panelC[s].get(),
+					n * sizeof(T), n * sizeof(T), height, gpuMemcpyDeviceToHost, copy));
+				gpuCheck(gpuEventRecord(stored[s], copy));
+			}
+			gpuCheck(gpuStreamSynchronize(copy));
+		}
+		catch (...) {
+			gpuStreamSynchronize(compute);
+			gpuStreamSynchronize(copy);
+			release(registered, loaded, multiplied, stored, bReady);
+			throw;
+		}
+		release(registered, loaded, multiplied, stored, bReady);
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	static void release(std::vector<const void*>& registered, gpuEvent_t* loaded,
+		gpuEvent_t* multiplied, gpuEvent_t* stored, gpuEvent_t bReady) {
+		for (size_t i = 0; i < registered.size(); i++)
+			gpuHostUnregister(const_cast<void*>(registered[i]));
+		for (int s = 0; s < 2; s++) {
+			gpuEventDestroy(loaded[s]);
+			gpuEventDestroy(multiplied[s]);
+			gpuEventDestroy(stored[s]);
+		}
+		gpuEventDestroy(bReady);
+	}
+
+	GpuBackend(const GpuBackend<T>& other);
+	GpuBackend<T>& operator=(const GpuBackend<T>& other);
+};
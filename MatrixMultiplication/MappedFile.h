@@ -0,0 +1,133 @@
+#pragma once
+#include <errno.h>
+#include <exception>
+#include <stddef.h>
+#include <string>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class MappedFileError : public std::exception {
+public:
+	MappedFileError(int e) noexcept
+		: error(e) {}
+	virtual const char* what() const noexcept
+	{
+		return "Cannot map matrix file";
+	}
+
+	//errno, or GetLastError() on Windows
+	int getError() { return error; }
+private:
+	int error;
+};
+
+// A file mapped read/write into memory, shared with the page cache, so the
+// operating system pages it in and out on demand. Used as the backing
+// store of matrices larger than RAM.
+class MappedFile {
+public:
+	// Open path, or create it when create is set, and map its first bytes
+	// bytes (the file is grown to that size if it is shorter).
+	MappedFile(const std::string& path, size_t bytes, bool create) : length(bytes), base(nullptr) {
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+			create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			throw MappedFileError((int)GetLastError());
+		LARGE_INTEGER size;
+		size.QuadPart = (LONGLONG)bytes;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)(size.QuadPart >> 32),
+			(DWORD)(size.QuadPart & 0xffffffff), nullptr);
+		if (mapping == nullptr) {
+			const int error = (int)GetLastError();
+			CloseHandle(file);
+			throw MappedFileError(error);
+		}
+		base = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+		if (base == nullptr) {
+			const int error = (int)GetLastError();
+			CloseHandle(mapping);
+			CloseHandle(file);
+			throw MappedFileError(error);
+		}
+#else
+		file = open(path.c_str(), create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+		if (file < 0)
+			throw MappedFileError(errno);
+		struct stat status;
+		if (fstat(file, &status) != 0 || ((size_t)status.st_size < bytes &&
+			ftruncate(file, (off_t)bytes) != 0)) {
+			const int error = errno;
+			close(file);
+			throw MappedFileError(error);
+		}
+		void* mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		if (mapped == MAP_FAILED) {
+			const int error = errno;
+			close(file);
+			throw MappedFileError(error);
+		}
+		base = mapped;
+#endif
+	}
+	~MappedFile() {
+#ifdef _WIN32
+		UnmapViewOfFile(base);
+		CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		munmap(base, length);
+		close(file);
+#endif
+	}
+
+	char* data() { return static_cast<char*>(base); }
+	size_t size() const { return length; }
+
+	// Hint that [offset, offset + bytes) is needed soon, so the operating
+	// system starts reading it in the background.
+	void willNeed(size_t offset, size_t bytes) {
+#ifndef _WIN32
+		const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		const size_t start = offset / page * page;
+		madvise(data() + start, offset + bytes - start, MADV_WILLNEED);
+#else
+		(void)offset;
+		(void)bytes;
+#endif
+	}
+
+	// Write dirty pages back to the file.
+	void flush() {
+#ifdef _WIN32
+		FlushViewOfFile(base, 0);
+		FlushFileBuffers(file);
+#else
+		msync(base, length, MS_SYNC);
+#endif
+	}
+private:
+	size_t length;
+	void* base;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int file;
+#endif
+
+	MappedFile(const MappedFile& other);
+	MappedFile& operator=(const MappedFile& other);
+};
@@ -1,12 +1,32 @@
+#pragma once
+#include <chrono>
 #include <exception>
-#include <omp.h>
-#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string>
+#include <type_traits>
+#include "Allocation.h"
+#include "Gemm.h"
+#include "Structure.h"
+#include "ThreadPool.h"
+#include "Trace.h"
 
-// Note: the code below contains error checking code for use
-// in debugging. To turn on error checking, uncomment
-// the line below:
-#define mDebug
-// To turn off error checking comment the line back out.
+// Note: Matrix and View take a bounds checking policy as their second
+// template parameter. CheckedAccess throws on out of range element access
+// and view creation, UncheckedAccess compiles the checks away so the
+// kernels get exception free inner loops. The default policy is checked
+// in debug builds and unchecked when NDEBUG is defined (the Release
+// configurations); define MATRIX_BOUNDS_CHECK to 1 or 0 to force it.
+// Defining mDebug, as older code did, also turns checking on.
+#ifndef MATRIX_BOUNDS_CHECK
+#if defined(mDebug) || !defined(NDEBUG)
+#define MATRIX_BOUNDS_CHECK 1
+#else
+#define MATRIX_BOUNDS_CHECK 0
+#endif
+#endif
 
 class BadArrayAccess : public std::exception {
 public:
@@ -38,44 +58,159 @@ private:
 	int row, col;
 };
 
+class WorkspaceTooSmall : public std::exception {
+public:
+	WorkspaceTooSmall(size_t req, size_t avail) noexcept
+		: required(req), available(avail) {}
+	virtual const char* what() const noexcept
+	{
+		return "Strassen workspace too small";
+	}
+
+	size_t getRequired() { return required; }
+	size_t getAvailable() { return available; }
+private:
+	size_t required, available;
+};
+
+class DimensionMismatch : public std::exception {
+public:
+	DimensionMismatch(int e, int a) noexcept
+		: expected(e), actual(a) {}
+	virtual const char* what() const noexcept
+	{
+		return "Matrix dimensions do not match";
+	}
+
+	int getExpected() { return expected; }
+	int getActual() { return actual; }
+private:
+	int expected, actual;
+};
+
+struct CheckedAccess {
+	static void element(int row, int col, int rows, int cols) {
+		if (row < 0 || row >= rows || col < 0 || col >= cols)
+			throw BadArrayAccess(row, col);
+	}
+	static void view(int r, int c, int rowCount, int colCount, int rows, int cols) {
+		if (r < 0 || r + rowCount > rows || c < 0 || c + colCount > cols)
+			throw IllegalViewSize(rowCount, colCount);
+	}
+};
+
+struct UncheckedAccess {
+	static void element(int, int, int, int) noexcept {}
+	static void view(int, int, int, int, int, int) noexcept {}
+};
+
+#if MATRIX_BOUNDS_CHECK
+typedef CheckedAccess DefaultAccess;
+#else
+typedef UncheckedAccess DefaultAccess;
+#endif
+
 template <typename T>
 class Viewable {
 public:
 	virtual T& operator()(int row, int col) = 0;
 };
 
-template <typename T>
-class View : public Viewable<T> {
+// A rows x cols window into contiguous row major storage. A view keeps a
+// pointer to its first element and the leading dimension (distance between
+// rows) of the storage it points into, so a view of a view flattens to one
+// pointer plus stride and element access is a single indexed load. The class
+// is final so calls through a View<T>& are not dispatched virtually.
+template <typename T, typename Access = DefaultAccess>
+class View final : public Viewable<T> {
 public:
-	View(Viewable<T>& basedOn, int r, int c, int rows, int cols) :
+	View() : data(nullptr), ld(0), maxRows(0), maxCols(0), structure(nullptr), row0(0), col0(0) {}
+	// Also the way to hand memory the caller owns (a numpy buffer, a mapped
+	// file, a receive buffer) to P_Strassen without a copy.
+	View(T* base, int leadingDim, int rows, int cols) :
+		data(base), ld(leadingDim), maxRows(rows), maxCols(cols), structure(nullptr), row0(0), col0(0) {}
+
+	T& operator()(int row, int col) {
+		Access::element(row, col, maxRows, maxCols);
+		return data[(size_t)row*ld + col];
+	}
+
+	View<T, Access> makeView(int r, int c, int rows, int cols)
+	{
+		Access::view(r, c, rows, cols, maxRows, maxCols);
+		View<T, Access> part(data + (size_t)r*ld + c, ld, rows, cols);
+		part.structure = structure;
+		part.row0 = row0 + r;
+		part.col0 = col0 + c;
+		return part;
+	}
+
+	// This view, knowing the block occupancy of the matrix it looks into: its
+	// first element is (row, col) of the matrix structure describes. Views
+	// made from it carry the structure along.
+	View<T, Access> withStructure(const MatrixStructure* s, int row = 0, int col = 0) const {
+		View<T, Access> view(*this);
+		view.structure = s;
+		view.row0 = row;
+		view.col0 = col;
+		return view;
+	}
+	const MatrixStructure* getStructure() const { return structure; }
+	// true if the rows x cols block at the start of the view is known to be zero
+	bool knownZero(int rows, int cols) const {
+		return structure && structure->zero(row0, col0, rows, cols);
+	}
+	// true if the size x size block at the start of the view is known to be I
+	bool knownIdentity(int size) const {
+		return structure && row0 == col0 && structure->identity(row0, size);
+	}
+
+	T* getData() { return data; }
+	T* getRow(int row) {
+		Access::element(row, 0, maxRows, maxCols);
+		return data + (size_t)row*ld;
+	}
+	int getStride() const { return ld; }
+	int getRows() const { return maxRows; }
+	int getCols() const { return maxCols; }
+private:
+	T* data;
+	int ld;
+	int maxRows;
+	int maxCols;
+	const MatrixStructure* structure;
+	int row0, col0;
+};
+
+// The block occupancy of the elements of view now, for View::withStructure.
+template <typename T, typename Access>
+MatrixStructure matrixStructure(View<T, Access>& view, int tile = 64,
+	ThreadPool& pool = ThreadPool::global()) {
+	return MatrixStructure(view.getData(), view.getStride(), view.getRows(), view.getCols(), tile,
+		pool);
+}
+
+// A view of any Viewable, going through its virtual operator(). Kept for
+// element sources that are not backed by row major memory; a nested view
+// costs one virtual call per level on every access.
+template <typename T, typename Access = DefaultAccess>
+class GenericView : public Viewable<T> {
+public:
+	GenericView(Viewable<T>& basedOn, int r, int c, int rows, int cols) :
 		base(basedOn), rowOffset(r), colOffset(c), maxRows(rows), maxCols(cols) {}
-	View(const View<T>& other)
+	GenericView(const GenericView<T, Access>& other)
 		: base(other.base), rowOffset(other.rowOffset), colOffset(other.colOffset),
 		maxRows(other.maxRows), maxCols(other.maxCols) {}
-	View<T>& operator=(const View<T>& other) {
-		base = other.base;
-		rowOffset = other.rowOffset;
-		colOffset = other.colOffset;
-		maxRows = other.maxRows;
-		maxCols = other.maxCols;
-		return *this;
-	}
 
 	T& operator()(int row, int col) {
-#ifdef mDebug
-		if (row < 0 || row >= maxRows || col < 0 || col >= maxCols)
-			throw BadArrayAccess(row, col);
-#endif
+		Access::element(row, col, maxRows, maxCols);
 		return base(row + rowOffset, col + colOffset);
 	}
 
-	View<T> makeView(int r, int c, int rows, int cols)
+	GenericView<T, Access> makeView(int r, int c, int rows, int cols)
 	{
-#ifdef mDebug
-		if (r < 0 || r + rows > maxRows || c < 0 || c + cols > maxCols)
-			throw IllegalViewSize(rows, cols);
-#endif
-		return View<T>(*this, r, c, rows, cols);
+		Access::view(r, c, rows, cols, maxRows, maxCols);
+		return GenericView<T, Access>(*this, r, c, rows, cols);
 	}
 private:
 	Viewable<T> &base;
@@ -85,36 +220,373 @@ private:
 	int maxCols;
 };
 
+// One output of a fused pass in P_Strassen:
+// dst = signs[0] * terms[0] + ... + signs[count - 1] * terms[count - 1]
+template <typename T, typename Access = DefaultAccess>
+struct Combination {
+	View<T, Access>* dst;
+	int count;
+	View<T, Access>* terms[5];
+	int signs[5];
+};
+
+// Order in which P_Strassen forms its operands and combines its products.
+enum StrassenSchedule {
+	StrassenClassic,	// 18 additions, each a separate pass over memory
+	StrassenFused,		// same formulas, grouped into three passes (A side, B side, C)
+	StrassenWinograd,	// Winograd's variant with 15 additions, also in three passes
+	StrassenLean		// Winograd's variant one product at a time in three temporaries,
+						// accumulating into c; the least scratch, no parallel sub-products
+};
+
+struct StrassenConfig {
+	StrassenSchedule schedule;
+	ThreadPool* pool;	// nullptr means ThreadPool::global()
+	int crossover;		// blocks smaller than this use the leaf kernel; 0 = tuned per machine
+	int parallelDepth;	// levels whose sub-products run as parallel tasks; -1 = enough for the pool
+	int maxDepth;		// recursion depth limit; -1 = none
+};
+
+// Configuration used by the P_Strassen overloads that do not take one.
+inline StrassenConfig& strassenDefaults() {
+	static StrassenConfig config = { StrassenFused, nullptr, 0, -1, -1 };
+	return config;
+}
+
+// Size from which one Strassen step beats the leaf kernel for T on this
+// machine. Defined at the end of this file.
+template <typename T>
+int strassenCrossover();
+
+// Replace the automatic (0 / -1) settings of config by concrete values.
+template <typename T>
+StrassenConfig resolveStrassenConfig(const StrassenConfig& config) {
+	StrassenConfig resolved = config;
+	if (resolved.crossover <= 0)
+		resolved.crossover = strassenCrossover<T>();
+	if (resolved.parallelDepth < 0) {
+		//enough levels to give every thread a couple of sub-products
+		const int threads = (config.pool ? *config.pool : ThreadPool::global()).size();
+		int tasks = 1;
+		resolved.parallelDepth = 0;
+		while (threads > 1 && tasks < 2 * threads) {
+			tasks *= 7;
+			resolved.parallelDepth++;
+		}
+	}
+	return resolved;
+}
+
+// What the recursion does with an m x k by k x n block.
+enum StrassenStep {
+	StepLeaf,		// leaf kernel
+	StepSplitM,		// two halves of the rows of A and C
+	StepSplitN,		// two halves of the columns of B and C
+	StepSplitK,		// two halves of the inner dimension, the second accumulated onto c
+	StepPeel,		// even leading block, then the odd last row / column
+	StepStrassen	// one Strassen step on the quadrants
+};
+
+// Preallocated scratch memory for P_Strassen and Multiply. One buffer is
+// sized up front from the top level shape and recursion depth, and each
+// recursion level carves its temporaries out of it, so the recursion itself
+// does no heap allocation. The layout of the region for one Strassen step
+// on an m x k by k x n block is
+//   [5 A side sums | 5 B side sums | p1..p7 | region for branch 1 | ... | branch 7]
+// where A side sums are m/2 x k/2, B side sums k/2 x n/2 and products
+// m/2 x n/2. Below the parallel depth the seven sub-products run
+// concurrently and need disjoint scratch; deeper levels run their products
+// one after another and reuse a single branch region.
 template <typename T>
+class StrassenWorkspace {
+public:
+	// maxBytes == 0 means no cap
+	StrassenWorkspace(int size, int level, size_t maxBytes = 0)
+		: elements(requiredElements(size, level)), data(nullptr) {
+		allocate(maxBytes);
+	}
+	StrassenWorkspace(int size, int level, const StrassenConfig& config, size_t maxBytes = 0)
+		: elements(requiredElements(size, level, config)), data(nullptr) {
+		allocate(maxBytes);
+	}
+	// for Matrix::Multiply of an m x k by a k x n matrix
+	StrassenWorkspace(int m, int k, int n, const StrassenConfig& config, size_t maxBytes = 0)
+		: elements(requiredElements(m, k, n, config)), data(nullptr) {
+		allocate(maxBytes);
+	}
+	// count elements, for one workspace shared by products of several shapes
+	explicit StrassenWorkspace(size_t count) : elements(count), data(nullptr) {
+		allocate(0);
+	}
+	~StrassenWorkspace() { alignedDelete(data, elements); }
+
+	//sums of A quadrants, sums of B quadrants and products kept per Strassen step
+	static const int aTemporaries = 5;
+	static const int bTemporaries = 5;
+	static const int products = 7;
+	//the same for StrassenLean, which reuses one of each
+	static const int leanTemporaries = 1;
+
+	//what the recursion does at this call; config must be resolved
+	static StrassenStep plan(int m, int k, int n, int level, const StrassenConfig& config) {
+		const int smallest = m < k ? (m < n ? m : n) : (k < n ? k : n);
+		const int largest = m > k ? (m > n ? m : n) : (k > n ? k : n);
+		const int cutoff = config.crossover > 2 ? config.crossover : 2;
+		if (smallest < cutoff || (config.maxDepth >= 0 && level >= config.maxDepth))
+			return StepLeaf;
+		//a Strassen step only pays on roughly square blocks, so halve long
+		//dimensions first
+		if (largest > 2 * smallest)
+			return largest == m ? StepSplitM : largest == n ? StepSplitN : StepSplitK;
+		if (m % 2 != 0 || k % 2 != 0 || n % 2 != 0)
+			return StepPeel;
+		return StepStrassen;
+	}
+
+	//scratch needed from this call down, for a resolved config
+	static size_t scratchElements(int size, int level, const StrassenConfig& config) {
+		return scratchElements(size, size, size, level, config);
+	}
+	static size_t scratchElements(int m, int k, int n, int level, const StrassenConfig& config) {
+		const bool parallel = level < config.parallelDepth;
+		switch (plan(m, k, n, level, config)) {
+		case StepSplitM:
+			return halves(scratchElements(m / 2, k, n, level, config),
+				scratchElements(m - m / 2, k, n, level, config), parallel);
+		case StepSplitN:
+			return halves(scratchElements(m, k, n / 2, level, config),
+				scratchElements(m, k, n - n / 2, level, config), parallel);
+		case StepSplitK:
+			//both halves write c, so they run one after another
+			return halves(scratchElements(m, k / 2, n, level, config),
+				scratchElements(m, k - k / 2, n, level, config), false);
+		case StepPeel:
+			return scratchElements(m - m % 2, k - k % 2, n - n % 2, level, config);
+		case StepStrassen: {
+			const size_t mh = m / 2, kh = k / 2, nh = n / 2;
+			if (config.schedule == StrassenLean)
+				return leanTemporaries * (mh * kh + kh * nh + mh * nh) +
+					scratchElements(m / 2, k / 2, n / 2, level + 1, config);
+			const size_t branches = parallel ? products : 1;
+			return aTemporaries * mh * kh + bTemporaries * kh * nh + products * mh * nh +
+				branches * scratchElements(m / 2, k / 2, n / 2, level + 1, config);
+		}
+		default:
+			return 0;
+		}
+	}
+
+	//peak scratch of one product under the schedule of config: what
+	//StrassenLean saves over the parallel schedules shows up here
+	static size_t requiredElements(int size, int level) {
+		return requiredElements(size, level, strassenDefaults());
+	}
+	static size_t requiredElements(int size, int level, const StrassenConfig& config) {
+		return scratchElements(size, level, resolveStrassenConfig<T>(config));
+	}
+	static size_t requiredElements(int m, int k, int n, const StrassenConfig& config) {
+		return scratchElements(m, k, n, 0, resolveStrassenConfig<T>(config));
+	}
+	static size_t requiredBytes(int size, int level) {
+		return requiredElements(size, level) * sizeof(T);
+	}
+	static size_t requiredBytes(int size, int level, const StrassenConfig& config) {
+		return requiredElements(size, level, config) * sizeof(T);
+	}
+	static size_t requiredBytes(int m, int k, int n, const StrassenConfig& config) {
+		return requiredElements(m, k, n, config) * sizeof(T);
+	}
+
+	size_t size() const { return elements; }
+	size_t bytes() const { return elements * sizeof(T); }
+	T* get() { return data; }
+private:
+	size_t elements;
+	T* data;
+
+	//scratch of two halves that run one after another (sharing a region)
+	//or in parallel (side by side)
+	static size_t halves(size_t first, size_t second, bool parallel) {
+		const size_t larger = first > second ? first : second;
+		return parallel ? 2 * larger : larger;
+	}
+
+	void allocate(size_t maxBytes) {
+		if (maxBytes != 0 && elements * sizeof(T) > maxBytes)
+			throw WorkspaceTooSmall(elements * sizeof(T), maxBytes);
+		MATRIX_TRACE_SPAN(span, "workspace", 0);
+		if (elements > 0)
+			data = alignedNew<T>(elements, matrixAllocationDefaults().alignment);
+	}
+
+	StrassenWorkspace(const StrassenWorkspace<T>& other);
+	StrassenWorkspace<T>& operator=(const StrassenWorkspace<T>& other);
+};
+
+// What the recursion needs of one block of a fixed operand, formed once
+// and used by every product with it (see PreparedOperand in Chain.h). At a
+// Strassen step sums holds the five temporaries of the side of the block
+// (A or B), laid out as strassenStep carves them out of the workspace, and
+// children are the same for the seven sub-product operands on that side.
+// At a split that halves the block children[0] and children[1] are its
+// halves. At a leaf of a right operand packed is the whole block packed for
+// gemmBlockedPacked. Children are nullptr where the preparation stopped.
+template <typename T>
+struct StrassenTransform {
+	int rows, cols;		// shape of the block
+	StrassenStep step;	// what the recursion does with it
+	bool winograd;		// Winograd's sums (StrassenWinograd) or Strassen's (Classic, Fused)
+	T* sums;
+	T* packed;
+	GemmPacking packing;	// layout of packed
+	const StrassenTransform<T>* children[7];
+};
+
+// Transform of part i of the block of t, if t was prepared for the step
+// the recursion takes on a rows x cols block; nullptr otherwise.
+template <typename T>
+const StrassenTransform<T>* strassenPart(const StrassenTransform<T>* t, StrassenStep step,
+	int rows, int cols, int i) {
+	if (t == nullptr || t->step != step || t->rows != rows || t->cols != cols)
+		return nullptr;
+	return t->children[i];
+}
+
+template <typename T, typename Access>
+class PreparedOperand;
+
+template <typename T, typename Access = DefaultAccess>
 class Matrix : public Viewable<T> {
+	friend class PreparedOperand<T, Access>;
 public:
 	Matrix(int r, int c) : rows(r), cols(c) {
-		data = new T[r*c];
+		allocate(matrixAllocationDefaults());
+	}
+	Matrix(int r, int c, const MatrixAllocation& allocation) : rows(r), cols(c) {
+		allocate(allocation);
+	}
+	// A matrix over memory the caller owns, leadingDim elements between rows.
+	// Nothing is copied and the buffer is not freed by the matrix.
+	Matrix(T* buffer, int leadingDim, int r, int c) : rows(r), cols(c), ld(leadingDim),
+		data(buffer), owner(false) {
+		Access::view(0, 0, r, c, r, leadingDim);
+	}
+	Matrix(Matrix<T, Access>&& other) noexcept : rows(other.rows), cols(other.cols), ld(other.ld),
+		data(other.data), owner(other.owner) {
+		other.forget();
 	}
-	~Matrix() { delete[] data; }
+	Matrix<T, Access>& operator=(Matrix<T, Access>&& other) noexcept {
+		if (this != &other) {
+			release();
+			rows = other.rows;
+			cols = other.cols;
+			ld = other.ld;
+			data = other.data;
+			owner = other.owner;
+			other.forget();
+		}
+		return *this;
+	}
+	~Matrix() { release(); }
 
-	static void Multiplication(View<T>& a, View<T>& b, View<T>& c, const int size);
-	static void P_Strassen(View<T>& a, View<T>& b, View<T>& c, const int size, int level);
+	static void Multiplication(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		const int size);
+	static void Multiplication(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		const int size, T alpha, T beta);
+	static void BlockedMultiplication(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		const int size);
+	static void P_Strassen(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		const int size, int level);
+	static void P_Strassen(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		const int size, int level, StrassenWorkspace<T>& workspace);
+	static void P_Strassen(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		const int size, int level, const StrassenConfig& config);
+	static void P_Strassen(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		const int size, int level, StrassenWorkspace<T>& workspace, const StrassenConfig& config);
+	static void Multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		const StrassenConfig& config);
+	static void Multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		StrassenWorkspace<T>& workspace, const StrassenConfig& config);
+	static void Multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		T alpha, T beta, const StrassenConfig& config);
+	static void Multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		T alpha, T beta, StrassenWorkspace<T>& workspace, const StrassenConfig& config);
 
 	T& operator()(int row, int col) {
-#ifdef mDebug
-		if (row < 0 || row >= rows || col < 0 || col >= cols)
-			throw BadArrayAccess(row, col);
-#endif
-		return data[row*cols + col];
+		Access::element(row, col, rows, cols);
+		return data[(size_t)row*ld + col];
 	}
 
-	View<T> makeView(int r, int c, int rowCount, int colCount)
+	View<T, Access> makeView(int r, int c, int rowCount, int colCount)
 	{
-#ifdef mDebug
-		if (r < 0 || r + rowCount > rows || c < 0 || c + colCount > cols)
-			throw IllegalViewSize(rowCount, colCount);
-#endif
-		return View<T>(*this, r, c, rowCount, colCount);
+		Access::view(r, c, rowCount, colCount, rows, cols);
+		return View<T, Access>(data + (size_t)r*ld + c, ld, rowCount, colCount);
 	}
+
+	//distance between rows, at least cols (see MatrixAllocation)
+	int getStride() const { return ld; }
+	int getRows() const { return rows; }
+	int getCols() const { return cols; }
+	T* getData() { return data; }
+	//false for a matrix over an external buffer
+	bool ownsData() const { return owner; }
 private:
-	int rows, cols;
+	int rows, cols, ld;
 	T* data;
+	bool owner;
+
+	void allocate(const MatrixAllocation& allocation);
+	void release() {
+		if (owner)
+			alignedDelete(data, (size_t)rows*ld);
+		forget();
+	}
+	//leave an empty matrix that owns nothing (after a move)
+	void forget() {
+		rows = cols = ld = 0;
+		data = nullptr;
+		owner = false;
+	}
+
+	//columns a fused pass handles at a time, so its inputs are still in L1
+	//when the later outputs of the same pass read them
+	static const int fuseChunk = 256;
+
+	//left and right, where given, are prepared transforms of a and b
+	static void multiplyStep(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		int m, int k, int n, T alpha, T beta, int level, T* scratch, const StrassenConfig& config,
+		const StrassenTransform<T>* left = nullptr, const StrassenTransform<T>* right = nullptr);
+	static void strassenStep(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		int m, int k, int n, T alpha, T beta, int level, T* scratch, const StrassenConfig& config,
+		const StrassenTransform<T>* left, const StrassenTransform<T>* right);
+	static void leanStep(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		int m, int k, int n, T alpha, T beta, int level, T* scratch, const StrassenConfig& config);
+	static bool blockStep(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		int m, int k, int n, T alpha, T beta, int level, T* scratch, const StrassenConfig& config);
+	static void splitStep(ThreadPool& pool, bool parallel, View<T, Access>* a, View<T, Access>* b,
+		View<T, Access>* c, const int* m, const int* k, const int* n, T alpha, T beta, int level,
+		T* scratch, const StrassenConfig& config, const StrassenTransform<T>* const* left,
+		const StrassenTransform<T>* const* right);
+	static void leaf(ThreadPool& pool, bool parallel, View<T, Access>& a, View<T, Access>& b,
+		View<T, Access>& c, int m, int k, int n, T alpha, T beta, const T* packed);
+	static void combine(ThreadPool& pool, View<T, Access>& dst, View<T, Access>& x, int sy,
+		View<T, Access>& y);
+	static void combineRows(ThreadPool& pool, View<T, Access>& dst, View<T, Access>* const* terms,
+		const int* signs, int count);
+	static void fusedCombine(ThreadPool& pool, const Combination<T, Access>* list, int count);
+	static void formSums(ThreadPool& pool, StrassenSchedule schedule, bool aSide,
+		View<T, Access>& x11, View<T, Access>& x12, View<T, Access>& x21, View<T, Access>& x22,
+		View<T, Access>* s);
+	static void scale(ThreadPool& pool, View<T, Access>& dst, T factor);
+	static void assign(ThreadPool& pool, View<T, Access>& dst, View<T, Access>* src, int rows,
+		int cols, T alpha, T beta);
+	static void peel(ThreadPool& pool, View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+		int m, int k, int n, T alpha, T beta);
+	static void checkShapes(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c);
+	//rows or columns per task of a parallel leaf
+	static const int leafGrain = 64;
+	//rows per task so that a task of a pass touches at least this many elements
+	static const int passGrain = 16384;
 
 	// We declare the copy constructor and operator= to be private
 	// to prevent their use in code. If you wish to use these, move
@@ -122,203 +594,1041 @@ private:
 	// I strongly suggest that you avoid using these, since copies are
 	// inefficient. In particular, when passing Matrix objects as 
 	// parameters to functions you should always try to pass them
-	// using reference parameters
-	Matrix(const Matrix<T>& other) : rows(other.rows), cols(other.cols) {
-		data = new T[rows*cols];
-		for (int i = 0; i < rows*cols; i++)
-			data[i] = other.data[i];
+	// using reference parameters, and return them by value (moving a
+	// Matrix only hands over its buffer)
+	Matrix(const Matrix<T, Access>& other) : rows(other.rows), cols(other.cols) {
+		allocate(matrixAllocationDefaults());
+		for (int i = 0; i < rows; i++)
+			for (int j = 0; j < cols; j++)
+				data[(size_t)i*ld + j] = other.data[(size_t)i*other.ld + j];
 	}
 
-	Matrix<T>& operator=(const Matrix<T>& other) {
-		if (data)
-			delete[] data;
+	Matrix<T, Access>& operator=(const Matrix<T, Access>& other) {
+		if (this == &other)
+			return *this;
+		release();
 		rows = other.rows;
 		cols = other.cols;
-		data = new T[rows*cols];
-		for (int i = 0; i < rows*cols; i++)
-			data[i] = other.data[i];
+		allocate(matrixAllocationDefaults());
+		for (int i = 0; i < rows; i++)
+			for (int j = 0; j < cols; j++)
+				data[(size_t)i*ld + j] = other.data[(size_t)i*other.ld + j];
 		return *this;
 	}
 };
-template <typename T>
-void Matrix<T>::Multiplication(View<T>& a, View<T>& b, View<T>& c, const int size) {
+
+//aligned storage with the leading dimension of the policy; the rows are
+//value initialized in the same row chunks the passes of P_Strassen use, so
+//under first touch placement their pages land on the node of the thread
+//that initialized them
+template <typename T, typename Access>
+void Matrix<T, Access>::allocate(const MatrixAllocation& allocation) {
+	ld = matrixStride<T>(cols, allocation);
+	const size_t count = (size_t)rows*ld;
+	data = static_cast<T*>(alignedAllocate(count * sizeof(T), allocation.alignment));
+	owner = true;
+	T* base = data;
+	const size_t stride = ld;
+	auto touch = [base, stride](int lo, int hi) {
+		for (size_t e = (size_t)lo*stride; e < (size_t)hi*stride; e++)
+			new (base + e) T();
+	};
+	if (!allocation.firstTouch) {
+		touch(0, rows);
+		return;
+	}
+	ThreadPool& pool = allocation.pool ? *allocation.pool : ThreadPool::global();
+	const int grain = ld > 0 && passGrain / ld > 1 ? passGrain / ld : 1;
+	pool.parallelFor(0, rows, grain, touch);
+}
+
+// c = a * b for an m x k view a and a k x n view b, with the shape taken
+// from the views. Throws DimensionMismatch if they do not fit together.
+template <typename T, typename Access>
+void multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c) {
+	Matrix<T, Access>::Multiply(a, b, c, strassenDefaults());
+}
+
+template <typename T, typename Access>
+void multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	const StrassenConfig& config) {
+	Matrix<T, Access>::Multiply(a, b, c, config);
+}
+
+// c = alpha * a * b + beta * c, accumulated in place. c is not read when
+// beta == 0, and beta == 1 adds the product straight into c.
+template <typename T, typename Access>
+void multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	typename std::common_type<T>::type alpha, typename std::common_type<T>::type beta) {
+	Matrix<T, Access>::Multiply(a, b, c, alpha, beta, strassenDefaults());
+}
+
+template <typename T, typename Access>
+void multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	typename std::common_type<T>::type alpha, typename std::common_type<T>::type beta,
+	const StrassenConfig& config) {
+	Matrix<T, Access>::Multiply(a, b, c, alpha, beta, config);
+}
+
+template <typename T, typename Access>
+void Matrix<T, Access>::Multiplication(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	const int size) {
+	Multiplication(a, b, c, size, T(1), T(0));
+}
+
+//c = alpha * a * b + beta * c; c is only read when beta != 0
+template <typename T, typename Access>
+void Matrix<T, Access>::Multiplication(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	const int size, T alpha, T beta) {
 	for (int i = 0; i < size; i++) {
 		for (int j = 0; j < size; j++) {
-			c(i, j) = 0;
+			T sum = 0;
 			for (int k = 0; k < size; k++) {
-				c(i, j) = c(i, j) + a(i, k) * b(k, j);
+				sum = sum + a(i, k) * b(k, j);
 			}
+			if (beta == T(0))
+				c(i, j) = alpha * sum;
+			else if (beta == T(1))
+				c(i, j) = c(i, j) + alpha * sum;
+			else
+				c(i, j) = alpha * sum + beta * c(i, j);
 		}
 	}
 }
 
-template <typename T>
-void Matrix<T>::P_Strassen(View<T>& a, View<T>& b, View<T>& c, const int size, int level) {
-	//base case for recursion
-	if (size == 1) {
-		c(0, 0) = a(0, 0) * b(0, 0);
+//cache blocked multiplication, the kernel P_Strassen uses at its leaves
+//(block sizes are set through gemmBlocking() in Gemm.h)
+template <typename T, typename Access>
+void Matrix<T, Access>::BlockedMultiplication(View<T, Access>& a, View<T, Access>& b,
+	View<T, Access>& c, const int size) {
+	Access::view(0, 0, size, size, a.getRows(), a.getCols());
+	Access::view(0, 0, size, size, b.getRows(), b.getCols());
+	Access::view(0, 0, size, size, c.getRows(), c.getCols());
+	gemmBlocked(size, size, size, a.getData(), a.getStride(), b.getData(), b.getStride(),
+		c.getData(), c.getStride());
+}
+
+template <typename T, typename Access>
+void Matrix<T, Access>::P_Strassen(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	const int size, int level) {
+	P_Strassen(a, b, c, size, level, strassenDefaults());
+}
+
+template <typename T, typename Access>
+void Matrix<T, Access>::P_Strassen(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	const int size, int level, StrassenWorkspace<T>& workspace) {
+	P_Strassen(a, b, c, size, level, workspace, strassenDefaults());
+}
+
+template <typename T, typename Access>
+void Matrix<T, Access>::P_Strassen(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	const int size, int level, const StrassenConfig& config) {
+	const StrassenConfig resolved = resolveStrassenConfig<T>(config);
+	StrassenWorkspace<T> workspace(size, level, resolved);
+	multiplyStep(a, b, c, size, size, size, T(1), T(0), level, workspace.get(), resolved);
+}
+
+template <typename T, typename Access>
+void Matrix<T, Access>::P_Strassen(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	const int size, int level, StrassenWorkspace<T>& workspace, const StrassenConfig& config) {
+	const StrassenConfig resolved = resolveStrassenConfig<T>(config);
+	size_t required = StrassenWorkspace<T>::scratchElements(size, level, resolved);
+	if (workspace.size() < required)
+		throw WorkspaceTooSmall(required * sizeof(T), workspace.bytes());
+	multiplyStep(a, b, c, size, size, size, T(1), T(0), level, workspace.get(), resolved);
+}
+
+//c = a * b for an m x k matrix a and a k x n matrix b, where m, k and n are
+//taken from the views; long dimensions are halved until the blocks are
+//close enough to square for Strassen steps
+template <typename T, typename Access>
+void Matrix<T, Access>::Multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	const StrassenConfig& config) {
+	Multiply(a, b, c, T(1), T(0), config);
+}
+
+template <typename T, typename Access>
+void Matrix<T, Access>::Multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	StrassenWorkspace<T>& workspace, const StrassenConfig& config) {
+	Multiply(a, b, c, T(1), T(0), workspace, config);
+}
+
+//c = alpha * a * b + beta * c in place: beta == 0 writes c without reading
+//it, beta == 1 adds into it at the leaves and in the last pass of each
+//Strassen step, and other values of beta cost one scaling pass over c
+template <typename T, typename Access>
+void Matrix<T, Access>::Multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	T alpha, T beta, const StrassenConfig& config) {
+	checkShapes(a, b, c);
+	const StrassenConfig resolved = resolveStrassenConfig<T>(config);
+	StrassenWorkspace<T> workspace(a.getRows(), a.getCols(), b.getCols(), resolved);
+	multiplyStep(a, b, c, a.getRows(), a.getCols(), b.getCols(), alpha, beta, 0, workspace.get(),
+		resolved);
+}
+
+template <typename T, typename Access>
+void Matrix<T, Access>::Multiply(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	T alpha, T beta, StrassenWorkspace<T>& workspace, const StrassenConfig& config) {
+	checkShapes(a, b, c);
+	const int m = a.getRows(), k = a.getCols(), n = b.getCols();
+	const StrassenConfig resolved = resolveStrassenConfig<T>(config);
+	size_t required = StrassenWorkspace<T>::scratchElements(m, k, n, 0, resolved);
+	if (workspace.size() < required)
+		throw WorkspaceTooSmall(required * sizeof(T), workspace.bytes());
+	multiplyStep(a, b, c, m, k, n, alpha, beta, 0, workspace.get(), resolved);
+}
+
+template <typename T, typename Access>
+void Matrix<T, Access>::checkShapes(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c) {
+	if (b.getRows() != a.getCols())
+		throw DimensionMismatch(a.getCols(), b.getRows());
+	if (c.getRows() != a.getRows())
+		throw DimensionMismatch(a.getRows(), c.getRows());
+	if (c.getCols() != b.getCols())
+		throw DimensionMismatch(b.getCols(), c.getCols());
+}
+
+//one call of the recursion behind P_Strassen and Multiply:
+//c = alpha * a * b + beta * c for an m x k block a and a k x n block b, in
+//the way StrassenWorkspace::plan says
+template <typename T, typename Access>
+void Matrix<T, Access>::multiplyStep(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	int m, int k, int n, T alpha, T beta, int level, T* scratch, const StrassenConfig& config,
+	const StrassenTransform<T>* left, const StrassenTransform<T>* right) {
+	ThreadPool& pool = config.pool ? *config.pool : ThreadPool::global();
+	const bool parallel = level < config.parallelDepth;
+	//transforms handed on to parts that keep all of a or b; split halves of
+	//a prepared block get its children
+	const StrassenTransform<T>* whole[2][2] = { { left, left }, { right, right } };
+	//operands with known structure (see MatrixStructure): a zero block
+	//leaves beta * c, an identity one makes c a copy of the other operand
+	if (a.getStructure() || b.getStructure()) {
+		if (a.knownZero(m, k) || b.knownZero(k, n)) {
+			assign(pool, c, nullptr, m, n, alpha, beta);
+			return;
+		}
+		if (m == k && a.knownIdentity(m)) {
+			assign(pool, c, &b, m, n, alpha, beta);
+			return;
+		}
+		if (k == n && b.knownIdentity(k)) {
+			assign(pool, c, &a, m, n, alpha, beta);
+			return;
+		}
+	}
+	switch (StrassenWorkspace<T>::plan(m, k, n, level, config)) {
+	case StepLeaf: {
+		MATRIX_TRACE_FLOPS(span, "leaf", level, 2.0 * m * k * n);
+		const bool packed = right != nullptr && right->step == StepLeaf && right->rows == k &&
+			right->cols == n && right->packed != nullptr && right->packing == gemmPacking<T>();
+		//the lean schedule runs its products one at a time, so its leaves
+		//always spread over the pool. Below the parallel depth a leaf also
+		//spreads when threads of its own core group are idle: 7^depth
+		//products do not divide evenly among 2^k threads, and the last ones
+		//to finish then split their leaves instead of leaving the rest of
+		//the group waiting. Idle threads steal inside their group first, so
+		//the pieces stay under the group's cache; a stale count only costs
+		//a split that was not needed, or one that was missed
+		const bool spread = parallel || config.schedule == StrassenLean ||
+			pool.idleThreads(pool.currentGroup()) > 0;
+		leaf(pool, spread, a, b, c, m, k, n, alpha, beta, packed ? right->packed : nullptr);
+		break;
+	}
+	case StepSplitM: {
+		const int top = m / 2;
+		View<T, Access> as[2] = { a.makeView(0, 0, top, k), a.makeView(top, 0, m - top, k) };
+		View<T, Access> bs[2] = { b, b };
+		View<T, Access> cs[2] = { c.makeView(0, 0, top, n), c.makeView(top, 0, m - top, n) };
+		const int ms[2] = { top, m - top }, ks[2] = { k, k }, ns[2] = { n, n };
+		const StrassenTransform<T>* halves[2] = { strassenPart(left, StepSplitM, m, k, 0),
+			strassenPart(left, StepSplitM, m, k, 1) };
+		splitStep(pool, parallel, as, bs, cs, ms, ks, ns, alpha, beta, level, scratch, config,
+			halves, whole[1]);
+		break;
+	}
+	case StepSplitN: {
+		const int half = n / 2;
+		View<T, Access> as[2] = { a, a };
+		View<T, Access> bs[2] = { b.makeView(0, 0, k, half), b.makeView(0, half, k, n - half) };
+		View<T, Access> cs[2] = { c.makeView(0, 0, m, half), c.makeView(0, half, m, n - half) };
+		const int ms[2] = { m, m }, ks[2] = { k, k }, ns[2] = { half, n - half };
+		const StrassenTransform<T>* halves[2] = { strassenPart(right, StepSplitN, k, n, 0),
+			strassenPart(right, StepSplitN, k, n, 1) };
+		splitStep(pool, parallel, as, bs, cs, ms, ks, ns, alpha, beta, level, scratch, config,
+			whole[0], halves);
+		break;
+	}
+	case StepSplitK: {
+		//the first half of the inner dimension applies beta, the second one
+		//accumulates onto it
+		const int front = k / 2;
+		View<T, Access> a1 = a.makeView(0, 0, m, front), a2 = a.makeView(0, front, m, k - front);
+		View<T, Access> b1 = b.makeView(0, 0, front, n), b2 = b.makeView(front, 0, k - front, n);
+		multiplyStep(a1, b1, c, m, front, n, alpha, beta, level, scratch, config,
+			strassenPart(left, StepSplitK, m, k, 0), strassenPart(right, StepSplitK, k, n, 0));
+		multiplyStep(a2, b2, c, m, k - front, n, alpha, T(1), level, scratch, config,
+			strassenPart(left, StepSplitK, m, k, 1), strassenPart(right, StepSplitK, k, n, 1));
+		break;
+	}
+	case StepPeel: {
+		//deal with dimensions that are not even: multiply the leading even
+		//blocks and add the peeled rows and columns in afterwards
+		const int me = m - m % 2, ke = k - k % 2, ne = n - n % 2;
+		View<T, Access> a11 = a.makeView(0, 0, me, ke);
+		View<T, Access> b11 = b.makeView(0, 0, ke, ne);
+		View<T, Access> c11 = c.makeView(0, 0, me, ne);
+		multiplyStep(a11, b11, c11, me, ke, ne, alpha, beta, level, scratch, config, left, right);
+		peel(pool, a, b, c, m, k, n, alpha, beta);
+		break;
+	}
+	default: {
+		MATRIX_TRACE_SPAN(span, "strassen", level);
+		if ((a.getStructure() || b.getStructure()) &&
+			blockStep(a, b, c, m, k, n, alpha, beta, level, scratch, config))
+			break;
+		if (config.schedule == StrassenLean)
+			leanStep(a, b, c, m, k, n, alpha, beta, level, scratch, config);
+		else
+			strassenStep(a, b, c, m, k, n, alpha, beta, level, scratch, config, left, right);
+	}
+	}
+}
+
+//the two halves of a split block: above the parallel depth they run as
+//parallel tasks in scratch regions side by side, below it one after another
+//in the same region. Splits keep the level, so a long dimension halved many
+//times would fan out into a task per piece; once the pool has a task queued
+//for every thread the halves run one after another as well, which the
+//side by side layout has room for
+template <typename T, typename Access>
+void Matrix<T, Access>::splitStep(ThreadPool& pool, bool parallel, View<T, Access>* a,
+	View<T, Access>* b, View<T, Access>* c, const int* m, const int* k, const int* n, T alpha,
+	T beta, int level, T* scratch, const StrassenConfig& config,
+	const StrassenTransform<T>* const* left, const StrassenTransform<T>* const* right) {
+	if (!parallel || pool.queuedTasks() >= pool.size()) {
+		multiplyStep(a[0], b[0], c[0], m[0], k[0], n[0], alpha, beta, level, scratch, config,
+			left[0], right[0]);
+		multiplyStep(a[1], b[1], c[1], m[1], k[1], n[1], alpha, beta, level, scratch, config,
+			left[1], right[1]);
 		return;
 	}
-	//deal with cases if row length is not 2^n
-	if (size % 2 != 0) {
-		Multiplication(a, b, c, size);
+	const size_t first = StrassenWorkspace<T>::scratchElements(m[0], k[0], n[0], level, config);
+	const size_t second = StrassenWorkspace<T>::scratchElements(m[1], k[1], n[1], level, config);
+	T* region = scratch + (first > second ? first : second);
+	TaskGroup halves;
+	pool.submit(halves, [a, b, c, m, k, n, alpha, beta, level, region, &config, left, right]() {
+		multiplyStep(a[1], b[1], c[1], m[1], k[1], n[1], alpha, beta, level, region, config,
+			left[1], right[1]);
+	});
+	try {
+		multiplyStep(a[0], b[0], c[0], m[0], k[0], n[0], alpha, beta, level, scratch, config,
+			left[0], right[0]);
+	}
+	catch (...) {
+		pool.wait(halves);
+		throw;
+	}
+	pool.wait(halves);
+}
+
+//leaf kernel; above the parallel depth the rows or the columns of c,
+//whichever there are more of, are split into tasks. packed, if given, is
+//b packed whole by gemmPackPanels
+template <typename T, typename Access>
+void Matrix<T, Access>::leaf(ThreadPool& pool, bool parallel, View<T, Access>& a,
+	View<T, Access>& b, View<T, Access>& c, int m, int k, int n, T alpha, T beta,
+	const T* packed) {
+	Access::view(0, 0, m, k, a.getRows(), a.getCols());
+	Access::view(0, 0, k, n, b.getRows(), b.getCols());
+	Access::view(0, 0, m, n, c.getRows(), c.getCols());
+	const T* pa = a.getData();
+	const T* pb = b.getData();
+	T* pc = c.getData();
+	const size_t lda = a.getStride(), ldb = b.getStride(), ldc = c.getStride();
+	if (packed) {
+		//the columns of a task start on a sliver of the packed panels
+		const int nr = gemmPacking<T>().nr;
+		if (!parallel || (m < 2 * leafGrain && n < 2 * leafGrain))
+			gemmBlockedPacked(m, n, k, alpha, pa, lda, packed, n, 0, beta, pc, ldc);
+		else if (m >= n) {
+			pool.parallelFor(0, m, leafGrain, [&](int lo, int hi) {
+				gemmBlockedPacked(hi - lo, n, k, alpha, pa + lo * lda, lda, packed, n, 0, beta,
+					pc + lo * ldc, ldc);
+			});
+		}
+		else {
+			pool.parallelFor(0, (n + nr - 1) / nr, (leafGrain + nr - 1) / nr, [&](int lo, int hi) {
+				const int first = lo * nr, last = hi * nr < n ? hi * nr : n;
+				gemmBlockedPacked(m, last - first, k, alpha, pa, lda, packed, n, first, beta,
+					pc + first, ldc);
+			});
+		}
 		return;
 	}
-	//limit the number of execution thread
-	if (level > 1) {
-		Multiplication(a, b, c, size);
+	if (!parallel || (m < 2 * leafGrain && n < 2 * leafGrain)) {
+		gemmBlocked(m, n, k, alpha, pa, lda, pb, ldb, beta, pc, ldc);
 		return;
 	}
-	int i, j;
+	if (m >= n) {
+		pool.parallelFor(0, m, leafGrain, [&](int lo, int hi) {
+			gemmBlocked(hi - lo, n, k, alpha, pa + lo * lda, lda, pb, ldb, beta, pc + lo * ldc, ldc);
+		});
+	}
+	else {
+		pool.parallelFor(0, n, leafGrain, [&](int lo, int hi) {
+			gemmBlocked(m, hi - lo, k, alpha, pa, lda, pb + lo, ldb, beta, pc + lo, ldc);
+		});
+	}
+}
+
+//one Strassen step on an m x k by k x n block with m, k and n even; alpha
+//is applied by the sub-products and beta by the passes that form c. With
+//a prepared transform of a or b the sums of that side are read from it
+//instead of being formed
+template <typename T, typename Access>
+void Matrix<T, Access>::strassenStep(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	int m, int k, int n, T alpha, T beta, int level, T* scratch, const StrassenConfig& config,
+	const StrassenTransform<T>* left, const StrassenTransform<T>* right) {
+	int i;
+	const int mh = m / 2, kh = k / 2, nh = n / 2;
 
 	//generate submatrices of a,b,c
-	View<T> a11 = a.makeView(0, 0, size / 2, size / 2);
-	View<T> a12 = a.makeView(0, size / 2, size / 2, size / 2);
-	View<T> a21 = a.makeView(size / 2, 0, size / 2, size / 2);
-	View<T> a22 = a.makeView(size / 2, size / 2, size / 2, size / 2);
-	View<T> b11 = b.makeView(0, 0, size / 2, size / 2);
-	View<T> b12 = b.makeView(0, size / 2, size / 2, size / 2);
-	View<T> b21 = b.makeView(size / 2, 0, size / 2, size / 2);
-	View<T> b22 = b.makeView(size / 2, size / 2, size / 2, size / 2);
-	View<T> c11 = c.makeView(0, 0, size / 2, size / 2);
-	View<T> c12 = c.makeView(0, size / 2, size / 2, size / 2);
-	View<T> c21 = c.makeView(size / 2, 0, size / 2, size / 2);
-	View<T> c22 = c.makeView(size / 2, size / 2, size / 2, size / 2);
-
-	//generate matrices s1~s10, p1~p7 for Strassen's algorithm
-	std::vector<View<T>> s, p; 
-	Matrix<T> s1(size / 2, size / 2);	s.push_back(s1.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> s2(size / 2, size / 2);	s.push_back(s2.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> s3(size / 2, size / 2);	s.push_back(s3.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> s4(size / 2, size / 2);	s.push_back(s4.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> s5(size / 2, size / 2);	s.push_back(s5.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> s6(size / 2, size / 2);	s.push_back(s6.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> s7(size / 2, size / 2);	s.push_back(s7.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> s8(size / 2, size / 2);	s.push_back(s8.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> s9(size / 2, size / 2);	s.push_back(s9.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> s10(size / 2, size / 2);	s.push_back(s10.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> p1(size / 2, size / 2);	p.push_back(p1.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> p2(size / 2, size / 2);	p.push_back(p2.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> p3(size / 2, size / 2);	p.push_back(p3.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> p4(size / 2, size / 2);	p.push_back(p4.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> p5(size / 2, size / 2);	p.push_back(p5.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> p6(size / 2, size / 2);	p.push_back(p6.makeView(0, 0, size / 2, size / 2));
-	Matrix<T> p7(size / 2, size / 2);	p.push_back(p7.makeView(0, 0, size / 2, size / 2));
-
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[0](i, j) = b12(i, j) - b22(i, j);
+	View<T, Access> a11 = a.makeView(0, 0, mh, kh);
+	View<T, Access> a12 = a.makeView(0, kh, mh, kh);
+	View<T, Access> a21 = a.makeView(mh, 0, mh, kh);
+	View<T, Access> a22 = a.makeView(mh, kh, mh, kh);
+	View<T, Access> b11 = b.makeView(0, 0, kh, nh);
+	View<T, Access> b12 = b.makeView(0, nh, kh, nh);
+	View<T, Access> b21 = b.makeView(kh, 0, kh, nh);
+	View<T, Access> b22 = b.makeView(kh, nh, kh, nh);
+	View<T, Access> c11 = c.makeView(0, 0, mh, nh);
+	View<T, Access> c12 = c.makeView(0, nh, mh, nh);
+	View<T, Access> c21 = c.makeView(mh, 0, mh, nh);
+	View<T, Access> c22 = c.makeView(mh, nh, mh, nh);
+
+	//carve matrices s1~s10, p1~p7 for Strassen's algorithm out of the
+	//workspace; which s are sums of A quadrants (mh x kh) and which of B
+	//quadrants (kh x nh) depends on the schedule
+	static const bool aSide[2][10] = {
+		{ false, true, true, false, true, false, true, false, true, false },
+		{ true, true, true, true, false, false, false, false, true, false }
+	};
+	const bool winograd = config.schedule == StrassenWinograd;
+	const bool preparedA = left != nullptr && left->step == StepStrassen && left->rows == m &&
+		left->cols == k && left->winograd == winograd;
+	const bool preparedB = right != nullptr && right->step == StepStrassen && right->rows == k &&
+		right->cols == n && right->winograd == winograd;
+	const size_t aQuarter = (size_t)mh * kh, bQuarter = (size_t)kh * nh, cQuarter = (size_t)mh * nh;
+	T* aNext = preparedA ? left->sums : scratch;
+	T* bNext = preparedB ? right->sums : scratch + StrassenWorkspace<T>::aTemporaries * aQuarter;
+	T* pNext = scratch + StrassenWorkspace<T>::aTemporaries * aQuarter +
+		StrassenWorkspace<T>::bTemporaries * bQuarter;
+	T* next = pNext + StrassenWorkspace<T>::products * cQuarter;
+	const size_t branch = StrassenWorkspace<T>::scratchElements(mh, kh, nh, level + 1, config);
+	View<T, Access> s[10], p[7];
+	for (i = 0; i < 10; i++) {
+		if (aSide[winograd][i]) {
+			s[i] = View<T, Access>(aNext, kh, mh, kh);
+			aNext += aQuarter;
 		}
-	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[1](i, j) = a11(i, j) + a12(i, j);
+		else {
+			s[i] = View<T, Access>(bNext, nh, kh, nh);
+			bNext += bQuarter;
 		}
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[2](i, j) = a21(i, j) + a22(i, j);
-		}
+	for (i = 0; i < 7; i++)
+		p[i] = View<T, Access>(pNext + i * cQuarter, nh, mh, nh);
+
+	ThreadPool& pool = config.pool ? *config.pool : ThreadPool::global();
+	//operands of the seven sub-products, and their prepared transforms
+	View<T, Access>* lhs[7];
+	View<T, Access>* rhs[7];
+	const StrassenTransform<T>* below[2][7] = {};
+	MATRIX_TRACE_SPAN(operands, "operands", level);
+	for (i = 0; i < 7; i++) {
+		below[0][i] = preparedA ? left->children[i] : nullptr;
+		below[1][i] = preparedB ? right->children[i] : nullptr;
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[3](i, j) = b21(i, j) - b11(i, j);
+	if (!preparedA)
+		formSums(pool, config.schedule, true, a11, a12, a21, a22, s);
+	if (!preparedB)
+		formSums(pool, config.schedule, false, b11, b12, b21, b22, s);
+	if (winograd) {
+		//s[0..3] = S1..S4, s[4..7] = T1..T4
+		View<T, Access>* l[7] = { &a11, &a12, &s[3], &a22, &s[0], &s[1], &s[2] };
+		View<T, Access>* r[7] = { &b11, &b21, &b22, &s[7], &s[4], &s[5], &s[6] };
+		for (i = 0; i < 7; i++) {
+			lhs[i] = l[i];
+			rhs[i] = r[i];
 		}
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[4](i, j) = a11(i, j) + a22(i, j);
+	else {
+		View<T, Access>* l[7] = { &a11, &s[1], &s[2], &a22, &s[4], &s[6], &s[8] };
+		View<T, Access>* r[7] = { &s[0], &b22, &b11, &s[3], &s[5], &s[7], &s[9] };
+		for (i = 0; i < 7; i++) {
+			lhs[i] = l[i];
+			rhs[i] = r[i];
 		}
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[5](i, j) = b11(i, j) + b22(i, j);
-		}
+
+	MATRIX_TRACE_END(operands);
+	MATRIX_TRACE_SPAN(products, "products", level);
+	if (level >= config.parallelDepth) {
+		//below the parallel depth the products run in this thread, one after
+		//another in the same scratch region
+		for (i = 0; i < 7; i++)
+			multiplyStep(*lhs[i], *rhs[i], p[i], mh, kh, nh, alpha, T(0), level + 1, next, config,
+				below[0][i], below[1][i]);
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[6](i, j) = a12(i, j) - a22(i, j);
+	else {
+		//the seven sub-products are independent tasks; this thread runs the
+		//last one itself and then helps with the rest while it waits. On a
+		//pool of several core groups the first Strassen step hands them to
+		//the groups by capacity, so every product and the levels below it
+		//run under one cache, and product i lands in the same group on every
+		//call (its scratch region then stays on that group's NUMA node)
+		TaskGroup products;
+		int owner[7];
+		const bool grouped = level == 0 && pool.groups() > 1;
+		if (grouped)
+			pool.distribute(7, owner);
+		for (i = 0; i < 6; i++) {
+			View<T, Access>* l = lhs[i];
+			View<T, Access>* r = rhs[i];
+			View<T, Access>* product = &p[i];
+			const StrassenTransform<T>* lt = below[0][i];
+			const StrassenTransform<T>* rt = below[1][i];
+			T* region = next + i * branch;
+			std::function<void()> task = [l, r, product, mh, kh, nh, alpha, level, region, &config,
+				lt, rt]() {
+				multiplyStep(*l, *r, *product, mh, kh, nh, alpha, T(0), level + 1, region, config,
+					lt, rt);
+			};
+			if (grouped)
+				pool.submit(products, std::move(task), owner[i]);
+			else
+				pool.submit(products, std::move(task));
 		}
-	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[7](i, j) = b21(i, j) + b22(i, j);
+		try {
+			multiplyStep(*lhs[6], *rhs[6], p[6], mh, kh, nh, alpha, T(0), level + 1,
+				next + 6 * branch, config, below[0][6], below[1][6]);
+		}
+		catch (...) {
+			pool.wait(products);
+			throw;
 		}
+		pool.wait(products);
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[8](i, j) = a11(i, j) - a21(i, j);
+
+	MATRIX_TRACE_END(products);
+	MATRIX_TRACE_SPAN(combination, "combine", level);
+
+	//U2 = P1 + P6 and U3 = U2 + P7 are kept in place of P6 and P7
+	const Combination<T, Access> winogradC[] = {
+		{ &c11, 2, { &p[0], &p[1] }, { 1, 1 } },
+		{ &p[5], 2, { &p[0], &p[5] }, { 1, 1 } },
+		{ &p[6], 2, { &p[5], &p[6] }, { 1, 1 } },
+		{ &c12, 3, { &p[5], &p[4], &p[2] }, { 1, 1, 1 } },
+		{ &c21, 2, { &p[6], &p[3] }, { 1, -1 } },
+		{ &c22, 2, { &p[6], &p[4] }, { 1, 1 } }
+	};
+	const Combination<T, Access> strassenC[] = {
+		{ &c11, 4, { &p[4], &p[3], &p[1], &p[5] }, { 1, 1, -1, 1 } },
+		{ &c12, 2, { &p[0], &p[1] }, { 1, 1 } },
+		{ &c21, 2, { &p[2], &p[3] }, { 1, 1 } },
+		{ &c22, 4, { &p[4], &p[0], &p[2], &p[6] }, { 1, 1, -1, -1 } }
+	};
+	//a beta other than 0 or 1 scales c up front, after which the quadrants
+	//of c accumulate: c11 = c11 + p5 + p4 - p2 + p6 and so on
+	if (beta != T(0) && beta != T(1))
+		scale(pool, c, beta);
+	const int outputs = winograd ? 6 : 4;
+	Combination<T, Access> formC[6];
+	for (i = 0; i < outputs; i++) {
+		formC[i] = winograd ? winogradC[i] : strassenC[i];
+		if (beta != T(0) && formC[i].dst != &p[5] && formC[i].dst != &p[6]) {
+			for (int t = formC[i].count; t > 0; t--) {
+				formC[i].terms[t] = formC[i].terms[t - 1];
+				formC[i].signs[t] = formC[i].signs[t - 1];
+			}
+			formC[i].terms[0] = formC[i].dst;
+			formC[i].signs[0] = 1;
+			formC[i].count++;
 		}
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			s[9](i, j) = b11(i, j) + b12(i, j);
+	if (config.schedule == StrassenClassic) {
+		for (i = 0; i < outputs; i++)
+			combineRows(pool, *formC[i].dst, formC[i].terms, formC[i].signs, formC[i].count);
+	}
+	else
+		fusedCombine(pool, formC, outputs);
+}
+
+//one Strassen step in the StrassenLean schedule: Winograd's products run
+//one after another with a scratch X of one A quadrant, Y of one B quadrant
+//and Z of one C quadrant, and go into c as soon as they are known,
+//products added to a quadrant of c by the kernel itself (beta = 1):
+//   Z = P1, c11 = Z, c11 += P2
+//   X = A21 + A22 - A11, Y = B22 - B12 + B11, Z += P6 = X Y
+//   c12 = Z, X = A12 - X, c12 += P3 = X B22
+//   Y = Y - B21, c21 = -P4 = -A22 Y
+//   X = A11 - A21, Y = B22 - B12, Z += P7 = X Y, c21 += Z, c22 = Z
+//   X = A21 + A22, Y = B12 - B11, Z = P5 = X Y, c12 += Z, c22 += Z
+//where "=" into c keeps beta * c when beta is not 0
+template <typename T, typename Access>
+void Matrix<T, Access>::leanStep(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	int m, int k, int n, T alpha, T beta, int level, T* scratch, const StrassenConfig& config) {
+	const int mh = m / 2, kh = k / 2, nh = n / 2;
+	View<T, Access> a11 = a.makeView(0, 0, mh, kh);
+	View<T, Access> a12 = a.makeView(0, kh, mh, kh);
+	View<T, Access> a21 = a.makeView(mh, 0, mh, kh);
+	View<T, Access> a22 = a.makeView(mh, kh, mh, kh);
+	View<T, Access> b11 = b.makeView(0, 0, kh, nh);
+	View<T, Access> b12 = b.makeView(0, nh, kh, nh);
+	View<T, Access> b21 = b.makeView(kh, 0, kh, nh);
+	View<T, Access> b22 = b.makeView(kh, nh, kh, nh);
+	View<T, Access> c11 = c.makeView(0, 0, mh, nh);
+	View<T, Access> c12 = c.makeView(0, nh, mh, nh);
+	View<T, Access> c21 = c.makeView(mh, 0, mh, nh);
+	View<T, Access> c22 = c.makeView(mh, nh, mh, nh);
+	const size_t aQuarter = (size_t)mh * kh, bQuarter = (size_t)kh * nh, cQuarter = (size_t)mh * nh;
+	View<T, Access> x(scratch, kh, mh, kh);
+	View<T, Access> y(scratch + aQuarter, nh, kh, nh);
+	View<T, Access> z(scratch + aQuarter + bQuarter, nh, mh, nh);
+	T* next = scratch + aQuarter + bQuarter + cQuarter;
+
+	ThreadPool& pool = config.pool ? *config.pool : ThreadPool::global();
+	if (beta != T(0) && beta != T(1))
+		scale(pool, c, beta);
+	//the first write to a quadrant of c replaces it when beta is 0 and adds
+	//to it otherwise
+	const T onto = beta == T(0) ? T(0) : T(1);
+	auto form = [&pool](View<T, Access>& dst, View<T, Access>* t0, int s0, View<T, Access>* t1,
+		int s1, View<T, Access>* t2, int s2) {
+		View<T, Access>* terms[3] = { t0, t1, t2 };
+		const int signs[3] = { s0, s1, s2 };
+		combineRows(pool, dst, terms, signs, t2 ? 3 : t1 ? 2 : 1);
+	};
+	auto start = [&](View<T, Access>& dst) {
+		if (onto == T(0))
+			form(dst, &z, 1, nullptr, 0, nullptr, 0);
+		else
+			form(dst, &dst, 1, &z, 1, nullptr, 0);
+	};
+	auto product = [&](View<T, Access>& l, View<T, Access>& r, View<T, Access>& p, T factor, T into) {
+		multiplyStep(l, r, p, mh, kh, nh, factor, into, level + 1, next, config);
+	};
+
+	product(a11, b11, z, alpha, T(0));
+	start(c11);
+	product(a12, b21, c11, alpha, T(1));
+	form(x, &a21, 1, &a22, 1, &a11, -1);
+	form(y, &b22, 1, &b12, -1, &b11, 1);
+	product(x, y, z, alpha, T(1));
+	start(c12);
+	form(x, &a12, 1, &x, -1, nullptr, 0);
+	product(x, b22, c12, alpha, T(1));
+	form(y, &y, 1, &b21, -1, nullptr, 0);
+	product(a22, y, c21, T(0) - alpha, onto);
+	form(x, &a11, 1, &a21, -1, nullptr, 0);
+	form(y, &b22, 1, &b12, -1, nullptr, 0);
+	product(x, y, z, alpha, T(1));
+	form(c21, &c21, 1, &z, 1, nullptr, 0);
+	start(c22);
+	form(x, &a21, 1, &a22, 1, nullptr, 0);
+	form(y, &b12, 1, &b11, -1, nullptr, 0);
+	product(x, y, z, alpha, T(0));
+	form(c12, &c12, 1, &z, 1, nullptr, 0);
+	form(c22, &c22, 1, &z, 1, nullptr, 0);
+}
+
+//in place of a Strassen step on an m x k by k x n block with m, k and n
+//even, when zero quadrants of a or b leave fewer than seven of the eight
+//products of the classical 2 x 2 block scheme:
+//   c_ij = alpha * (a_i1 * b_1j + a_i2 * b_2j) + beta * c_ij
+//The first product applies beta and the second adds to it, so a zero one
+//costs no more than a pass over c_ij (see multiplyStep). There are no
+//temporaries: above the parallel depth the quadrants of c run as tasks in
+//the child regions of the step's scratch, otherwise one after another in
+//the first. Returns false, having done nothing, when no product is zero
+//or only one is
+template <typename T, typename Access>
+bool Matrix<T, Access>::blockStep(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	int m, int k, int n, T alpha, T beta, int level, T* scratch, const StrassenConfig& config) {
+	const int mh = m / 2, kh = k / 2, nh = n / 2;
+	View<T, Access> as[2][2] = { { a.makeView(0, 0, mh, kh), a.makeView(0, kh, mh, kh) },
+		{ a.makeView(mh, 0, mh, kh), a.makeView(mh, kh, mh, kh) } };
+	View<T, Access> bs[2][2] = { { b.makeView(0, 0, kh, nh), b.makeView(0, nh, kh, nh) },
+		{ b.makeView(kh, 0, kh, nh), b.makeView(kh, nh, kh, nh) } };
+	View<T, Access> cs[2][2] = { { c.makeView(0, 0, mh, nh), c.makeView(0, nh, mh, nh) },
+		{ c.makeView(mh, 0, mh, nh), c.makeView(mh, nh, mh, nh) } };
+	int products = 0;
+	for (int i = 0; i < 2; i++)
+		for (int j = 0; j < 2; j++)
+			for (int p = 0; p < 2; p++)
+				if (!as[i][p].knownZero(mh, kh) && !bs[p][j].knownZero(kh, nh))
+					products++;
+	if (products >= StrassenWorkspace<T>::products)
+		return false;
+	MATRIX_TRACE_FLOPS(span, "block", level, 2.0 * products * mh * kh * nh);
+
+	ThreadPool& pool = config.pool ? *config.pool : ThreadPool::global();
+	auto quadrant = [&as, &bs, &cs, mh, kh, nh, alpha, beta, level, &config](int q, T* region) {
+		const int i = q / 2, j = q % 2;
+		multiplyStep(as[i][0], bs[0][j], cs[i][j], mh, kh, nh, alpha, beta, level + 1, region,
+			config);
+		multiplyStep(as[i][1], bs[1][j], cs[i][j], mh, kh, nh, alpha, T(1), level + 1, region,
+			config);
+	};
+	if (level >= config.parallelDepth || config.schedule == StrassenLean) {
+		for (int q = 0; q < 4; q++)
+			quadrant(q, scratch);
+		return true;
+	}
+	const size_t branch = StrassenWorkspace<T>::scratchElements(mh, kh, nh, level + 1, config);
+	TaskGroup quadrants;
+	for (int q = 1; q < 4; q++) {
+		T* region = scratch + q * branch;
+		pool.submit(quadrants, [&quadrant, q, region]() { quadrant(q, region); });
+	}
+	try {
+		quadrant(0, scratch);
+	}
+	catch (...) {
+		pool.wait(quadrants);
+		throw;
+	}
+	pool.wait(quadrants);
+	return true;
+}
+
+//the operand sums of one Strassen step on the quadrants x11..x22 of a
+//(aSide) or of b, into the s of strassenStep
+template <typename T, typename Access>
+void Matrix<T, Access>::formSums(ThreadPool& pool, StrassenSchedule schedule, bool aSide,
+	View<T, Access>& x11, View<T, Access>& x12, View<T, Access>& x21, View<T, Access>& x22,
+	View<T, Access>* s) {
+	if (schedule == StrassenWinograd) {
+		const Combination<T, Access> formA[] = {
+			{ &s[0], 2, { &x21, &x22 }, { 1, 1 } },
+			{ &s[1], 2, { &s[0], &x11 }, { 1, -1 } },
+			{ &s[2], 2, { &x11, &x21 }, { 1, -1 } },
+			{ &s[3], 2, { &x12, &s[1] }, { 1, -1 } }
+		};
+		const Combination<T, Access> formB[] = {
+			{ &s[4], 2, { &x12, &x11 }, { 1, -1 } },
+			{ &s[5], 2, { &x22, &s[4] }, { 1, -1 } },
+			{ &s[6], 2, { &x22, &x12 }, { 1, -1 } },
+			{ &s[7], 2, { &s[5], &x21 }, { 1, -1 } }
+		};
+		fusedCombine(pool, aSide ? formA : formB, 4);
+	}
+	else if (schedule == StrassenClassic) {
+		if (aSide) {
+			combine(pool, s[1], x11, +1, x12);
+			combine(pool, s[2], x21, +1, x22);
+			combine(pool, s[4], x11, +1, x22);
+			combine(pool, s[6], x12, -1, x22);
+			combine(pool, s[8], x11, -1, x21);
+		}
+		else {
+			combine(pool, s[0], x12, -1, x22);
+			combine(pool, s[3], x21, -1, x11);
+			combine(pool, s[5], x11, +1, x22);
+			combine(pool, s[7], x21, +1, x22);
+			combine(pool, s[9], x11, +1, x12);
 		}
 	}
-#pragma omp parallel sections
-	{
-#pragma omp section
-		P_Strassen(a11, s[0], p[0], size / 2, level + 1);
-#pragma omp section
-		P_Strassen(s[1], b22, p[1], size / 2, level + 1);
-#pragma omp section
-		P_Strassen(s[2], b11, p[2], size / 2, level + 1);
-#pragma omp section
-		P_Strassen(a22, s[3], p[3], size / 2, level + 1);
-#pragma omp section
-		P_Strassen(s[4], s[5], p[4], size / 2, level + 1);
-#pragma omp section
-		P_Strassen(s[6], s[7], p[5], size / 2, level + 1);
-#pragma omp section
-		P_Strassen(s[8], s[9], p[6], size / 2, level + 1);
-	}
-
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			c11(i, j) = p[4](i, j) + p[3](i, j) - p[1](i, j) + p[5](i, j);
+	else {
+		const Combination<T, Access> formA[] = {
+			{ &s[1], 2, { &x11, &x12 }, { 1, 1 } },
+			{ &s[2], 2, { &x21, &x22 }, { 1, 1 } },
+			{ &s[4], 2, { &x11, &x22 }, { 1, 1 } },
+			{ &s[6], 2, { &x12, &x22 }, { 1, -1 } },
+			{ &s[8], 2, { &x11, &x21 }, { 1, -1 } }
+		};
+		const Combination<T, Access> formB[] = {
+			{ &s[0], 2, { &x12, &x22 }, { 1, -1 } },
+			{ &s[3], 2, { &x21, &x11 }, { 1, -1 } },
+			{ &s[5], 2, { &x11, &x22 }, { 1, 1 } },
+			{ &s[7], 2, { &x21, &x22 }, { 1, 1 } },
+			{ &s[9], 2, { &x11, &x12 }, { 1, 1 } }
+		};
+		fusedCombine(pool, aSide ? formA : formB, 5);
+	}
+}
+
+//dst = x + sy * y, with sy = +1 or -1
+template <typename T, typename Access>
+void Matrix<T, Access>::combine(ThreadPool& pool, View<T, Access>& dst, View<T, Access>& x,
+	int sy, View<T, Access>& y) {
+	View<T, Access>* terms[2] = { &x, &y };
+	const int signs[2] = { 1, sy };
+	combineRows(pool, dst, terms, signs, 2);
+}
+
+//one pass over dst, a row at a time through the SIMD kernels in Simd.h
+template <typename T, typename Access>
+void Matrix<T, Access>::combineRows(ThreadPool& pool, View<T, Access>& dst,
+	View<T, Access>* const* terms, const int* signs, int count) {
+	const int rows = dst.getRows();
+	const int cols = dst.getCols();
+	for (int t = 0; t < count; t++)
+		Access::view(0, 0, rows, cols, terms[t]->getRows(), terms[t]->getCols());
+	const int grain = cols > 0 && passGrain / cols > 1 ? passGrain / cols : 1;
+	pool.parallelFor(0, rows, grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			const T* src[5];
+			for (int t = 0; t < count; t++)
+				src[t] = terms[t]->getRow(i);
+			simdCombine((size_t)cols, dst.getRow(i), src, signs, count);
 		}
+	});
+}
+
+//evaluate a list of combinations over the same rows x cols area in one
+//pass: every chunk of a row is loaded once for all the outputs, and later
+//outputs may use earlier ones of the same list as terms
+template <typename T, typename Access>
+void Matrix<T, Access>::fusedCombine(ThreadPool& pool, const Combination<T, Access>* list,
+	int count) {
+	const int rows = list[0].dst->getRows();
+	const int cols = list[0].dst->getCols();
+	for (int k = 0; k < count; k++) {
+		Access::view(0, 0, rows, cols, list[k].dst->getRows(), list[k].dst->getCols());
+		for (int t = 0; t < list[k].count; t++)
+			Access::view(0, 0, rows, cols, list[k].terms[t]->getRows(), list[k].terms[t]->getCols());
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			c12(i, j) = p[0](i, j) + p[1](i, j);
+	const int grain = cols > 0 && passGrain / cols > 1 ? passGrain / cols : 1;
+	pool.parallelFor(0, rows, grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			for (int col = 0; col < cols; col += fuseChunk) {
+				const int length = cols - col < fuseChunk ? cols - col : fuseChunk;
+				for (int k = 0; k < count; k++) {
+					const T* src[5];
+					for (int t = 0; t < list[k].count; t++)
+						src[t] = list[k].terms[t]->getRow(i) + col;
+					simdCombine((size_t)length, list[k].dst->getRow(i) + col, src, list[k].signs,
+						list[k].count);
+				}
+			}
+		}
+	});
+}
+
+//dst = factor * dst
+template <typename T, typename Access>
+void Matrix<T, Access>::scale(ThreadPool& pool, View<T, Access>& dst, T factor) {
+	const int rows = dst.getRows();
+	const int cols = dst.getCols();
+	const int grain = cols > 0 && passGrain / cols > 1 ? passGrain / cols : 1;
+	pool.parallelFor(0, rows, grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			T* row = dst.getRow(i);
+			for (int j = 0; j < cols; j++)
+				row[j] *= factor;
 		}
+	});
+}
+
+//dst = alpha * src + beta * dst on the rows x cols block at the start of
+//dst, or dst = beta * dst without src; beta == 0 does not read dst
+template <typename T, typename Access>
+void Matrix<T, Access>::assign(ThreadPool& pool, View<T, Access>& dst, View<T, Access>* src,
+	int rows, int cols, T alpha, T beta) {
+	if (!src && beta == T(1))
+		return;
+	Access::view(0, 0, rows, cols, dst.getRows(), dst.getCols());
+	if (src)
+		Access::view(0, 0, rows, cols, src->getRows(), src->getCols());
+	const int grain = cols > 0 && passGrain / cols > 1 ? passGrain / cols : 1;
+	pool.parallelFor(0, rows, grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			T* row = dst.getRow(i);
+			const T* from = src ? src->getRow(i) : nullptr;
+			int j;
+			if (!from) {
+				for (j = 0; j < cols; j++)
+					row[j] = beta == T(0) ? T(0) : beta * row[j];
+			}
+			else if (beta == T(0)) {
+				for (j = 0; j < cols; j++)
+					row[j] = alpha * from[j];
+			}
+			else {
+				for (j = 0; j < cols; j++)
+					row[j] = alpha * from[j] + beta * row[j];
+			}
+		}
+	});
+}
+
+//finish a product with an odd dimension after c11 = a11 * b11 on the
+//leading even blocks, me x ke and ke x ne with me = m - m % 2 and so on
+//(a12, b12, c12 are the last column when k or n is odd, a21, b21, c21 the
+//last row when m or k is odd):
+//   c11 += a12 * b21 (rank one update)
+//   c12 = a11 * b12 + a12 * b22
+//   c21 = a21 * b11 + a22 * b21, c22 = a21 * b12 + a22 * b22
+//with the products scaled by alpha, and beta applied to c12, c21 and c22
+template <typename T, typename Access>
+void Matrix<T, Access>::peel(ThreadPool& pool, View<T, Access>& a, View<T, Access>& b,
+	View<T, Access>& c, int m, int k, int n, T alpha, T beta) {
+	const int me = m - m % 2, ke = k - k % 2, ne = n - n % 2;
+	Access::view(0, 0, m, k, a.getRows(), a.getCols());
+	Access::view(0, 0, k, n, b.getRows(), b.getCols());
+	Access::view(0, 0, m, n, c.getRows(), c.getCols());
+	const int grain = passGrain / k > 1 ? passGrain / k : 1;
+	if (k != ke || n != ne) {
+		pool.parallelFor(0, me, grain, [&](int lo, int hi) {
+			for (int i = lo; i < hi; i++) {
+				const T* ai = a.getRow(i);
+				T* ci = c.getRow(i);
+				if (k != ke) {
+					const T aik = alpha * ai[ke];
+					const T* bk = b.getRow(ke);
+					for (int j = 0; j < ne; j++)
+						ci[j] += aik * bk[j];
+				}
+				if (n != ne) {
+					T sum = T(0);
+					for (int p = 0; p < k; p++)
+						sum += ai[p] * b.getRow(p)[ne];
+					ci[ne] = beta == T(0) ? alpha * sum : alpha * sum + beta * ci[ne];
+				}
+			}
+		});
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			c21(i, j) = p[2](i, j) + p[3](i, j);
+	if (m == me)
+		return;
+	//the last row of c is the last row of a times b, accumulated a row of b
+	//at a time; split by columns
+	pool.parallelFor(0, n, grain, [&](int lo, int hi) {
+		const T* am = a.getRow(me);
+		T* cm = c.getRow(me);
+		for (int j = lo; j < hi; j++)
+			cm[j] = beta == T(0) ? T(0) : beta * cm[j];
+		for (int p = 0; p < k; p++) {
+			const T amp = alpha * am[p];
+			const T* bp = b.getRow(p);
+			for (int j = lo; j < hi; j++)
+				cm[j] += amp * bp[j];
 		}
+	});
+}
+
+//value of an environment variable, false if it is not set
+inline bool readEnvironment(const char* name, std::string& value) {
+#ifdef _MSC_VER
+	char* buffer = nullptr;
+	size_t length = 0;
+	if (_dupenv_s(&buffer, &length, name) != 0 || buffer == nullptr)
+		return false;
+	value = buffer;
+	free(buffer);
+	return true;
+#else
+	const char* buffer = getenv(name);
+	if (buffer == nullptr)
+		return false;
+	value = buffer;
+	return true;
+#endif
+}
+
+//file the tuned crossovers are cached in, STRASSEN_TUNING_FILE if set
+inline std::string strassenTuningFile() {
+	std::string file;
+	if (!readEnvironment("STRASSEN_TUNING_FILE", file))
+		file = "strassen_tuning.txt";
+	return file;
+}
+
+//key of a tuning entry: element type and the SIMD level the kernels use
+template <typename T>
+std::string strassenTuningKey() {
+	static const char* levels[] = { "scalar", "sse", "avx2", "avx512", "neon" };
+	std::ostringstream key;
+	key << (std::is_floating_point<T>::value ? 'f' : std::is_signed<T>::value ? 'i' : 'u')
+		<< sizeof(T) * 8 << "-" << levels[simdLevel()];
+	return key.str();
+}
+
+//time one call of f in seconds, best of a few runs
+template <typename F>
+double bestTime(const F& f, int runs) {
+	double best = 0;
+	for (int run = 0; run < runs; run++) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		f();
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (run == 0 || elapsed < best)
+			best = elapsed;
 	}
-#pragma omp parallel for
-	for (i = 0; i < size / 2; i++) {
-#pragma omp parallel for
-		for (j = 0; j < size / 2; j++) {
-			c22(i, j) = p[4](i, j) + p[0](i, j) - p[2](i, j) - p[6](i, j);
+	return best;
+}
+
+// Measure, on one thread, the smallest power of two size at which a single
+// Strassen step (with blocked leaves) is faster than the blocked kernel.
+template <typename T>
+int calibrateStrassenCrossover() {
+	const int largest = 1024;
+	ThreadPool serial(1);
+	StrassenConfig step = strassenDefaults();
+	step.pool = &serial;
+	step.crossover = 2;
+	step.parallelDepth = 0;
+	step.maxDepth = 1;
+	for (int n = 64; n <= largest; n *= 2) {
+		Matrix<T, UncheckedAccess> a(n, n), b(n, n), c(n, n);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				a(i, j) = T((i + 2 * j) % 7 - 3);
+				b(i, j) = T((2 * i + j) % 5 - 2);
+			}
 		}
+		View<T, UncheckedAccess> va = a.makeView(0, 0, n, n);
+		View<T, UncheckedAccess> vb = b.makeView(0, 0, n, n);
+		View<T, UncheckedAccess> vc = c.makeView(0, 0, n, n);
+		StrassenWorkspace<T> workspace(n, 0, step);
+		const int runs = n <= 256 ? 5 : 3;
+		double leaf = bestTime([&]() {
+			Matrix<T, UncheckedAccess>::BlockedMultiplication(va, vb, vc, n);
+		}, runs);
+		double strassen = bestTime([&]() {
+			Matrix<T, UncheckedAccess>::P_Strassen(va, vb, vc, n, 0, workspace, step);
+		}, runs);
+		if (strassen < leaf)
+			return n;
+	}
+	//no win up to the largest size tried, assume the next one
+	return 2 * largest;
+}
+
+// Crossover for T: the entry in the tuning file if there is one, otherwise
+// calibrated once per process and appended to the file.
+template <typename T>
+int strassenCrossoverLookup() {
+	const std::string key = strassenTuningKey<T>();
+	const std::string file = strassenTuningFile();
+	std::ifstream in(file.c_str());
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		std::string entry;
+		int crossover = 0;
+		if (fields >> entry >> crossover && entry == key && crossover > 0)
+			return crossover;
 	}
+	in.close();
+	const int crossover = calibrateStrassenCrossover<T>();
+	std::ofstream out(file.c_str(), std::ios::app);
+	out << key << " " << crossover << "\n";
+	return crossover;
+}
+
+template <typename T>
+int strassenCrossover() {
+	static const int crossover = strassenCrossoverLookup<T>();
+	return crossover;
 }
\ No newline at end of file
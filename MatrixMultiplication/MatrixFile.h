@@ -0,0 +1,416 @@
+#pragma once
+#include <algorithm>
+#include <exception>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "Allocation.h"
+#include "Matrix.h"
+#include "Morton.h"
+
+// Binary matrix files: a fixed header (dimensions, element type, layout)
+// followed by the raw elements. Files are written and read in large
+// chunks by the threads of a pool, each chunk with one positioned read or
+// write, optionally bypassing the page cache.
+
+class MatrixFileError : public std::exception {
+public:
+	MatrixFileError(const char* r, int e) noexcept
+		: reason(r), error(e) {}
+	virtual const char* what() const noexcept
+	{
+		return reason;
+	}
+
+	//errno, or GetLastError() on Windows; 0 for format errors
+	int getError() { return error; }
+private:
+	const char* reason;
+	int error;
+};
+
+// Order of the elements in the payload of a matrix file.
+enum MatrixFileLayout {
+	FileRowMajor,		// rows one after another
+	FileTiled,			// tile x tile blocks in row major block order, edge blocks zero padded
+	FileMortonTiled		// the same blocks in Z (Morton) order
+};
+
+struct MatrixFileOptions {
+	MatrixFileLayout layout;	// layout saveMatrix writes; loading takes it from the file
+	int tile;					// block size of the tiled layouts
+	bool directIO;				// bypass the page cache where the file system allows it
+	ThreadPool* pool;			// nullptr means ThreadPool::global()
+};
+
+// Options used by saveMatrix and loadMatrix when none are given.
+inline MatrixFileOptions& matrixFileDefaults() {
+	static MatrixFileOptions options = { FileRowMajor, 256, false, nullptr };
+	return options;
+}
+
+// The header, stored at the start of the file in the writer's native byte
+// order; byteOrder records that order, and readers on a machine with the
+// other order reject the file. The payload starts at payloadOffset, a
+// multiple of matrixFileAlignment, so it can be read and written with
+// direct I/O. A FileTiled payload has exactly the layout of TiledMatrix,
+// so such a file can also be mapped with
+// TiledMatrix(path, rows, cols, tile, false, payloadOffset).
+struct MatrixFileHeader {
+	char magic[8];			// "PSMATRIX"
+	uint32_t version;		// 1
+	uint32_t byteOrder;		// 0x01020304 as the writer stored it
+	char kind;				// 'i', 'u' or 'f', as in strassenTuningKey
+	char reserved[3];
+	uint32_t elementSize;	// bytes per element
+	uint32_t layout;		// MatrixFileLayout
+	uint32_t tile;			// block size of the tiled layouts, 0 for FileRowMajor
+	int64_t rows, cols;
+	uint64_t payloadOffset;
+	uint64_t payloadBytes;
+};
+
+// header size on disk and alignment of direct I/O transfers
+const size_t matrixFileAlignment = 4096;
+// bytes per chunk of a parallel read or write
+const size_t matrixFileChunk = 8 << 20;
+
+// Maps the payload of a matrix file to matrix coordinates, a run of
+// consecutive elements at a time.
+class MatrixFileOrder {
+public:
+	explicit MatrixFileOrder(const MatrixFileHeader& header)
+		: rows(header.rows), cols(header.cols), tile(header.tile),
+		layout((MatrixFileLayout)header.layout) {
+		if (layout == FileRowMajor) {
+			tileCols = 0;
+			return;
+		}
+		const int64_t tileRows = (rows + tile - 1) / tile;
+		tileCols = (cols + tile - 1) / tile;
+		if (layout == FileMortonTiled) {
+			std::vector<std::pair<uint64_t, int64_t>> keys;
+			for (int64_t ti = 0; ti < tileRows; ti++)
+				for (int64_t tj = 0; tj < tileCols; tj++)
+					keys.push_back(std::make_pair(mortonCode((uint32_t)ti, (uint32_t)tj), ti * tileCols + tj));
+			std::sort(keys.begin(), keys.end());
+			for (size_t b = 0; b < keys.size(); b++)
+				order.push_back(keys[b].second);
+		}
+	}
+
+	static uint64_t payloadElements(int64_t rows, int64_t cols, MatrixFileLayout layout, int64_t tile) {
+		if (layout == FileRowMajor)
+			return (uint64_t)rows * cols;
+		return (uint64_t)((rows + tile - 1) / tile) * ((cols + tile - 1) / tile) * tile * tile;
+	}
+
+	// Length of the run of payload elements that starts at element e; it
+	// lies in row row from column col on, or is padding if row < 0.
+	int64_t run(uint64_t e, int64_t& row, int64_t& col) const {
+		if (layout == FileRowMajor) {
+			row = (int64_t)(e / cols);
+			col = (int64_t)(e % cols);
+			return cols - col;
+		}
+		const uint64_t area = (uint64_t)tile * tile;
+		const uint64_t block = e / area;
+		const int64_t inner = (int64_t)(e % area);
+		const int64_t position = layout == FileMortonTiled ? order[block] : (int64_t)block;
+		const int64_t tc = inner % tile;
+		row = position / tileCols * tile + inner / tile;
+		col = position % tileCols * tile + tc;
+		if (row >= rows || col >= cols) {
+			row = -1;
+			return tile - tc;
+		}
+		return std::min(tile - tc, cols - col);
+	}
+private:
+	int64_t rows, cols, tile, tileCols;
+	MatrixFileLayout layout;
+	std::vector<int64_t> order;
+};
+
+// A file for positioned reads and writes from many threads at once.
+class ChunkedFile {
+public:
+	// With direct, transfers must be whole multiples of matrixFileAlignment
+	// at aligned offsets from aligned buffers; if the file system does not
+	// support direct I/O the file is opened normally.
+	ChunkedFile(const std::string& path, bool write, bool direct) {
+#ifdef _WIN32
+		const DWORD access = write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+		const DWORD disposition = write ? CREATE_ALWAYS : OPEN_EXISTING;
+		handle = INVALID_HANDLE_VALUE;
+		if (direct)
+			handle = CreateFileA(path.c_str(), access, FILE_SHARE_READ, nullptr, disposition,
+				FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, nullptr);
+		if (handle == INVALID_HANDLE_VALUE)
+			handle = CreateFileA(path.c_str(), access, FILE_SHARE_READ, nullptr, disposition,
+				FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (handle == INVALID_HANDLE_VALUE)
+			throw MatrixFileError("Cannot open matrix file", (int)GetLastError());
+#else
+		const int flags = write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY;
+		descriptor = -1;
+#ifdef O_DIRECT
+		if (direct)
+			descriptor = open(path.c_str(), flags | O_DIRECT, 0644);
+#endif
+		if (descriptor < 0)
+			descriptor = open(path.c_str(), flags, 0644);
+		if (descriptor < 0)
+			throw MatrixFileError("Cannot open matrix file", errno);
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+		if (direct)
+			fcntl(descriptor, F_NOCACHE, 1);
+#endif
+#endif
+	}
+	~ChunkedFile() {
+#ifdef _WIN32
+		CloseHandle(handle);
+#else
+		close(descriptor);
+#endif
+	}
+
+	// Read up to bytes at offset; returns how many were read (fewer only at
+	// the end of the file).
+	size_t readAt(uint64_t offset, char* buffer, size_t bytes) {
+		size_t done = 0;
+		while (done < bytes) {
+#ifdef _WIN32
+			OVERLAPPED position = {};
+			position.Offset = (DWORD)(offset + done);
+			position.OffsetHigh = (DWORD)((offset + done) >> 32);
+			DWORD count = 0;
+			if (!ReadFile(handle, buffer + done, (DWORD)(bytes - done), &count, &position)) {
+				if (GetLastError() == ERROR_HANDLE_EOF)
+					break;
+				throw MatrixFileError("Matrix file read failed", (int)GetLastError());
+			}
+#else
+			const ssize_t count = pread(descriptor, buffer + done, bytes - done, (off_t)(offset + done));
+			if (count < 0) {
+				if (errno == EINTR)
+					continue;
+				throw MatrixFileError("Matrix file read failed", errno);
+			}
+#endif
+			if (count == 0)
+				break;
+			done += (size_t)count;
+		}
+		return done;
+	}
+
+	void writeAt(uint64_t offset, const char* buffer, size_t bytes) {
+		size_t done = 0;
+		while (done < bytes) {
+#ifdef _WIN32
+			OVERLAPPED position = {};
+			position.Offset = (DWORD)(offset + done);
+			position.OffsetHigh = (DWORD)((offset + done) >> 32);
+			DWORD count = 0;
+			if (!WriteFile(handle, buffer + done, (DWORD)(bytes - done), &count, &position))
+				throw MatrixFileError("Matrix file write failed", (int)GetLastError());
+#else
+			const ssize_t count = pwrite(descriptor, buffer + done, bytes - done, (off_t)(offset + done));
+			if (count < 0) {
+				if (errno == EINTR)
+					continue;
+				throw MatrixFileError("Matrix file write failed", errno);
+			}
+#endif
+			done += (size_t)count;
+		}
+	}
+
+	// Cut the file to size bytes (after padded direct writes).
+	void truncate(uint64_t size) {
+#ifdef _WIN32
+		FILE_END_OF_FILE_INFO end;
+		end.EndOfFile.QuadPart = (LONGLONG)size;
+		if (!SetFileInformationByHandle(handle, FileEndOfFileInfo, &end, sizeof(end)))
+			throw MatrixFileError("Matrix file write failed", (int)GetLastError());
+#else
+		if (ftruncate(descriptor, (off_t)size) != 0)
+			throw MatrixFileError("Matrix file write failed", errno);
+#endif
+	}
+private:
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	int descriptor;
+#endif
+
+	ChunkedFile(const ChunkedFile& other);
+	ChunkedFile& operator=(const ChunkedFile& other);
+};
+
+template <typename T>
+char matrixFileKind() {
+	return std::is_floating_point<T>::value ? 'f' : std::is_signed<T>::value ? 'i' : 'u';
+}
+
+inline size_t roundUpToAlignment(size_t bytes) {
+	return (bytes + matrixFileAlignment - 1) / matrixFileAlignment * matrixFileAlignment;
+}
+
+inline MatrixFileHeader readMatrixHeader(ChunkedFile& file) {
+	AlignedBuffer buffer(matrixFileAlignment, matrixFileAlignment);
+	if (file.readAt(0, buffer.data(), matrixFileAlignment) < sizeof(MatrixFileHeader))
+		throw MatrixFileError("Not a matrix file", 0);
+	MatrixFileHeader header;
+	memcpy(&header, buffer.data(), sizeof(header));
+	if (memcmp(header.magic, "PSMATRIX", 8) != 0 || header.version != 1)
+		throw MatrixFileError("Not a matrix file", 0);
+	if (header.byteOrder != 0x01020304)
+		throw MatrixFileError("Matrix file has the wrong byte order", 0);
+	if (header.layout > FileMortonTiled || (header.layout != FileRowMajor && header.tile == 0) ||
+		header.rows < 0 || header.cols < 0)
+		throw MatrixFileError("Corrupt matrix file header", 0);
+	return header;
+}
+
+// The header of the matrix file at path.
+inline MatrixFileHeader readMatrixHeader(const std::string& path) {
+	ChunkedFile file(path, false, false);
+	return readMatrixHeader(file);
+}
+
+// Write m to path in the layout of options, in parallel chunks. Throws
+// MatrixFileError for a tiled layout with a tile size below 1.
+template <typename T, typename Access>
+void saveMatrix(const std::string& path, View<T, Access>& m,
+	const MatrixFileOptions& options = matrixFileDefaults()) {
+	if (options.layout != FileRowMajor && options.tile <= 0)
+		throw MatrixFileError("Matrix file tile size must be positive", 0);
+	MatrixFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "PSMATRIX", 8);
+	header.version = 1;
+	header.byteOrder = 0x01020304;
+	header.kind = matrixFileKind<T>();
+	header.elementSize = sizeof(T);
+	header.layout = options.layout;
+	header.tile = options.layout == FileRowMajor ? 0 : options.tile;
+	header.rows = m.getRows();
+	header.cols = m.getCols();
+	header.payloadOffset = matrixFileAlignment;
+	const uint64_t elements = MatrixFileOrder::payloadElements(header.rows, header.cols,
+		options.layout, header.tile);
+	header.payloadBytes = elements * sizeof(T);
+
+	ChunkedFile file(path, true, options.directIO);
+	{
+		AlignedBuffer buffer(matrixFileAlignment, matrixFileAlignment);
+		memset(buffer.data(), 0, matrixFileAlignment);
+		memcpy(buffer.data(), &header, sizeof(header));
+		file.writeAt(0, buffer.data(), matrixFileAlignment);
+	}
+	const MatrixFileOrder order(header);
+	const uint64_t chunkElements = matrixFileChunk / sizeof(T);
+	const int chunks = (int)((elements + chunkElements - 1) / chunkElements);
+	ThreadPool& pool = options.pool ? *options.pool : ThreadPool::global();
+	pool.parallelFor(0, chunks, 1, [&](int lo, int hi) {
+		AlignedBuffer buffer(matrixFileChunk, matrixFileAlignment);
+		T* values = reinterpret_cast<T*>(buffer.data());
+		for (int chunk = lo; chunk < hi; chunk++) {
+			const uint64_t begin = chunk * chunkElements;
+			const uint64_t count = std::min(chunkElements, elements - begin);
+			for (uint64_t e = begin; e < begin + count; ) {
+				int64_t row, col;
+				const int64_t length = std::min<int64_t>(order.run(e, row, col), begin + count - e);
+				T* out = values + (e - begin);
+				if (row < 0)
+					std::fill(out, out + length, T(0));
+				else
+					std::copy(m.getRow((int)row) + col, m.getRow((int)row) + col + length, out);
+				e += length;
+			}
+			const size_t bytes = (size_t)count * sizeof(T);
+			file.writeAt(header.payloadOffset + begin * sizeof(T), buffer.data(),
+				options.directIO ? roundUpToAlignment(bytes) : bytes);
+		}
+	});
+	if (options.directIO)
+		file.truncate(header.payloadOffset + header.payloadBytes);
+}
+
+// Read the matrix file at path into m, which must have its dimensions.
+// Throws MatrixFileError if the file does not hold elements of type T.
+template <typename T, typename Access>
+void loadMatrix(const std::string& path, View<T, Access>& m,
+	const MatrixFileOptions& options = matrixFileDefaults()) {
+	ChunkedFile file(path, false, options.directIO);
+	const MatrixFileHeader header = readMatrixHeader(file);
+	if (header.kind != matrixFileKind<T>() || header.elementSize != sizeof(T))
+		throw MatrixFileError("Matrix file element type does not match", 0);
+	if (header.rows != m.getRows())
+		throw DimensionMismatch((int)header.rows, m.getRows());
+	if (header.cols != m.getCols())
+		throw DimensionMismatch((int)header.cols, m.getCols());
+	const uint64_t elements = header.payloadBytes / sizeof(T);
+	if (elements != MatrixFileOrder::payloadElements(header.rows, header.cols,
+		(MatrixFileLayout)header.layout, header.tile))
+		throw MatrixFileError("Corrupt matrix file header", 0);
+	const MatrixFileOrder order(header);
+	const uint64_t chunkElements = matrixFileChunk / sizeof(T);
+	const int chunks = (int)((elements + chunkElements - 1) / chunkElements);
+	ThreadPool& pool = options.pool ? *options.pool : ThreadPool::global();
+	pool.parallelFor(0, chunks, 1, [&](int lo, int hi) {
+		AlignedBuffer buffer(matrixFileChunk, matrixFileAlignment);
+		const T* values = reinterpret_cast<const T*>(buffer.data());
+		for (int chunk = lo; chunk < hi; chunk++) {
+			const uint64_t begin = chunk * chunkElements;
+			const uint64_t count = std::min(chunkElements, elements - begin);
+			const size_t bytes = (size_t)count * sizeof(T);
+			const size_t request = options.directIO ? roundUpToAlignment(bytes) : bytes;
+			if (file.readAt(header.payloadOffset + begin * sizeof(T), buffer.data(), request) < bytes)
+				throw MatrixFileError("Matrix file is truncated", 0);
+			for (uint64_t e = begin; e < begin + count; ) {
+				int64_t row, col;
+				const int64_t length = std::min<int64_t>(order.run(e, row, col), begin + count - e);
+				if (row >= 0) {
+					const T* in = values + (e - begin);
+					std::copy(in, in + length, m.getRow((int)row) + col);
+				}
+				e += length;
+			}
+		}
+	});
+}
+
+// The matrix in the file at path, in a new Matrix.
+template <typename T, typename Access = DefaultAccess>
+Matrix<T, Access> loadMatrix(const std::string& path,
+	const MatrixFileOptions& options = matrixFileDefaults()) {
+	const MatrixFileHeader header = readMatrixHeader(path);
+	MatrixAllocation allocation = matrixAllocationDefaults();
+	allocation.pool = options.pool;
+	Matrix<T, Access> m((int)header.rows, (int)header.cols, allocation);
+	View<T, Access> all = m.makeView(0, 0, m.getRows(), m.getCols());
+	loadMatrix(path, all, options);
+	return m;
+}
@@ -0,0 +1,401 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <limits>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+#include "Allocation.h"
+#include "Gemm.h"
+#include "Matrix.h"
+#include "ThreadPool.h"
+
+// Products of matrices stored in a narrow type (int8, int16, half or
+// bfloat16) accumulated in a wider one (int32, int64, float or double).
+// The inputs stay narrow in memory, so the leaf kernel reads a half or a
+// quarter of the bytes, and are widened only while its panels are packed;
+// the Strassen sums and products live in the wide type. The depth of the
+// recursion is chosen from the largest entries of the inputs, so that for
+// integers no intermediate value can overflow the accumulator and for
+// floating point the error bound stays under a tolerance.
+
+// IEEE 754 binary16, a storage type: values convert to float for arithmetic.
+struct Half {
+	uint16_t bits;
+
+	Half() : bits(0) {}
+	Half(float value) : bits(fromFloat(value)) {}
+	operator float() const { return toFloat(bits); }
+
+	//round to nearest even, with overflow to infinity and subnormals
+	static uint16_t fromFloat(float value) {
+		uint32_t x;
+		memcpy(&x, &value, sizeof(x));
+		const uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+		x &= 0x7fffffff;
+		if (x >= 0x7f800000)
+			return sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0);
+		if (x >= 0x477ff000)
+			return sign | 0x7c00;
+		if (x < 0x38800000) {
+			//below 2^-14: a multiple of 2^-24, or zero below 2^-25
+			if (x <= 0x33000000)
+				return sign;
+			const uint32_t mantissa = (x & 0x7fffff) | 0x800000;
+			const int shift = 126 - (int)(x >> 23);
+			uint32_t result = mantissa >> shift;
+			const uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+			if (rest > halfway || (rest == halfway && (result & 1)))
+				result++;
+			return sign | (uint16_t)result;
+		}
+		uint32_t result = (x >> 13) - (112u << 10);
+		const uint32_t rest = x & 0x1fff;
+		if (rest > 0x1000 || (rest == 0x1000 && (result & 1)))
+			result++;
+		return sign | (uint16_t)result;
+	}
+
+	static float toFloat(uint16_t h) {
+		const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+		const uint32_t exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+		uint32_t x;
+		if (exponent == 0x1f)
+			x = sign | 0x7f800000 | (mantissa << 13);
+		else if (exponent != 0)
+			x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+		else {
+			const float value = (float)mantissa * 5.9604644775390625e-8f;
+			return sign ? -value : value;
+		}
+		float value;
+		memcpy(&value, &x, sizeof(value));
+		return value;
+	}
+};
+
+// bfloat16: the upper half of a float, the same range with an 8 bit mantissa.
+struct BFloat16 {
+	uint16_t bits;
+
+	BFloat16() : bits(0) {}
+	BFloat16(float value) : bits(fromFloat(value)) {}
+	operator float() const {
+		const uint32_t x = (uint32_t)bits << 16;
+		float value;
+		memcpy(&value, &x, sizeof(value));
+		return value;
+	}
+
+	//round to nearest even; NaNs stay quiet NaNs
+	static uint16_t fromFloat(float value) {
+		uint32_t x;
+		memcpy(&x, &value, sizeof(x));
+		if ((x & 0x7fffffff) > 0x7f800000)
+			return (uint16_t)((x >> 16) | 0x40);
+		x += 0x7fff + ((x >> 16) & 1);
+		return (uint16_t)(x >> 16);
+	}
+};
+
+// Type multiplyMixed accumulates a storage type in when none is given.
+// int16 products overflow int32 after a few terms, so they go to int64.
+template <typename S> struct MixedAccumulator;
+template <> struct MixedAccumulator<int8_t> { typedef int type; };
+template <> struct MixedAccumulator<uint8_t> { typedef int type; };
+template <> struct MixedAccumulator<int16_t> { typedef long long type; };
+template <> struct MixedAccumulator<int> { typedef long long type; };
+template <> struct MixedAccumulator<Half> { typedef float type; };
+template <> struct MixedAccumulator<BFloat16> { typedef float type; };
+template <> struct MixedAccumulator<float> { typedef double type; };
+
+class AccumulatorOverflow : public std::exception {
+public:
+	AccumulatorOverflow(double b, double l) noexcept
+		: bound(b), limit(l) {}
+	virtual const char* what() const noexcept
+	{
+		return "Product can overflow the accumulator type";
+	}
+
+	double getBound() { return bound; }
+	double getLimit() { return limit; }
+private:
+	double bound, limit;
+};
+
+// Largest relative error (see mixedStrassenDepth) multiplyMixed accepts
+// from the Strassen levels when it accumulates in floating point.
+inline double& mixedPrecisionTolerance() {
+	static double tolerance = 1e-3;
+	return tolerance;
+}
+
+// Largest absolute value in the view, as a double.
+template <typename S, typename Access>
+double mixedMagnitude(View<S, Access>& a, ThreadPool& pool) {
+	std::vector<double> rows(a.getRows() > 0 ? a.getRows() : 1, 0.0);
+	const int cols = a.getCols();
+	const int grain = cols > 0 && 16384 / cols > 1 ? 16384 / cols : 1;
+	pool.parallelFor(0, a.getRows(), grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			const S* row = a.getRow(i);
+			double largest = 0;
+			for (int j = 0; j < cols; j++)
+				largest = std::max(largest, std::fabs((double)(float)row[j]));
+			rows[i] = largest;
+		}
+	});
+	return *std::max_element(rows.begin(), rows.end());
+}
+
+// Strassen levels (at most limit) an inner dimension k can take when the
+// entries of the operands are at most maxA and maxB. The recursion of
+// multiplyMixed forms two term sums, so at depth L its operands are below
+// 2^L maxA and 2^L maxB and no partial sum exceeds 2^(L + 2) k maxA maxB;
+// for an integer Acc that has to fit, and if even the plain product
+// k maxA maxB does not AccumulatorOverflow is thrown. For floating point
+// the bound on the error of L levels (Higham, with n0 = k / 2^L)
+//   (12^L (n0^2 + 5 n0) - 5 k) u maxA maxB
+// divided by the largest possible entry k maxA maxB must stay below
+// tolerance; L = 0 is the bound of the ordinary product, k u.
+template <typename Acc>
+int mixedStrassenDepth(int k, double maxA, double maxB, double tolerance, int limit) {
+	const double product = (double)k * maxA * maxB;
+	int depth = 0;
+	if (std::is_integral<Acc>::value) {
+		const double largest = (double)std::numeric_limits<Acc>::max();
+		if (product >= largest)
+			throw AccumulatorOverflow(product, largest);
+		while (depth < limit && std::ldexp(product, depth + 3) < largest)
+			depth++;
+		return depth;
+	}
+	const double u = std::numeric_limits<Acc>::epsilon() / 2;
+	while (depth < limit) {
+		const double n0 = std::ldexp((double)k, -(depth + 1));
+		const double bound = std::pow(12.0, depth + 1) * (n0 * n0 + 5 * n0) - 5.0 * k;
+		if (bound * u / k > tolerance)
+			break;
+		depth++;
+	}
+	return depth;
+}
+
+// Scratch elements of the mixed recursion for depth levels on m x k by k x n:
+// one A side sum, one B side sum and one product per level.
+inline size_t mixedScratchElements(int m, int k, int n, int depth) {
+	size_t total = 0;
+	while (depth > 0 && m >= 2 && k >= 2 && n >= 2) {
+		m /= 2;
+		k /= 2;
+		n /= 2;
+		total += (size_t)m * k + (size_t)k * n + (size_t)m * n;
+		depth--;
+	}
+	return total;
+}
+
+//c = (accumulate ? c : 0) + a * b with the blocked kernel, the rows (or
+//columns) of c split over the pool
+template <typename Acc, typename SA, typename SB>
+void mixedLeaf(ThreadPool& pool, int m, int k, int n, const SA* a, size_t lda, const SB* b,
+	size_t ldb, Acc* c, size_t ldc, bool accumulate) {
+	const Acc beta = accumulate ? Acc(1) : Acc(0);
+	const int grain = 64;
+	if (pool.size() == 1 || (m < 2 * grain && n < 2 * grain))
+		gemmBlocked(m, n, k, Acc(1), a, lda, b, ldb, beta, c, ldc);
+	else if (m >= n) {
+		pool.parallelFor(0, m, grain, [&](int lo, int hi) {
+			gemmBlocked(hi - lo, n, k, Acc(1), a + lo * lda, lda, b, ldb, beta, c + lo * ldc, ldc);
+		});
+	}
+	else {
+		pool.parallelFor(0, n, grain, [&](int lo, int hi) {
+			gemmBlocked(m, hi - lo, k, Acc(1), a, lda, b + lo, ldb, beta, c + lo, ldc);
+		});
+	}
+}
+
+//dst = x + sign * y, widened to Acc
+template <typename Acc, typename S>
+void mixedSum(ThreadPool& pool, int rows, int cols, const S* x, size_t ldx, int sign, const S* y,
+	size_t ldy, Acc* dst, size_t ldd) {
+	const int grain = cols > 0 && 16384 / cols > 1 ? 16384 / cols : 1;
+	pool.parallelFor(0, rows, grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			const S* xi = x + i * ldx;
+			const S* yi = y + i * ldy;
+			Acc* di = dst + i * ldd;
+			if (sign > 0)
+				for (int j = 0; j < cols; j++)
+					di[j] = Acc(xi[j]) + Acc(yi[j]);
+			else
+				for (int j = 0; j < cols; j++)
+					di[j] = Acc(xi[j]) - Acc(yi[j]);
+		}
+	});
+}
+
+//c = sign * p, or c += sign * p when add is set
+template <typename Acc>
+void mixedAdd(ThreadPool& pool, int rows, int cols, const Acc* p, size_t ldp, int sign, Acc* c,
+	size_t ldc, bool add) {
+	const int grain = cols > 0 && 16384 / cols > 1 ? 16384 / cols : 1;
+	pool.parallelFor(0, rows, grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			const Acc* pi = p + i * ldp;
+			Acc* ci = c + i * ldc;
+			if (!add)
+				for (int j = 0; j < cols; j++)
+					ci[j] = sign > 0 ? pi[j] : -pi[j];
+			else if (sign > 0)
+				for (int j = 0; j < cols; j++)
+					ci[j] += pi[j];
+			else
+				for (int j = 0; j < cols; j++)
+					ci[j] -= pi[j];
+		}
+	});
+}
+
+//c = (accumulate ? c : 0) + a * b with depth Strassen levels in Strassen's
+//original formulas (two term sums, so the operands grow by at most 2 per
+//level). An operand that is a quadrant of the input keeps its narrow type
+//down to the leaves; the sums are formed in Acc. The seven products run
+//one after another, each spread over the pool, and odd rows, columns and
+//inner indices are handled by the leaf kernel around the even block.
+template <typename Acc, typename SA, typename SB>
+void mixedStep(ThreadPool& pool, int m, int k, int n, const SA* a, size_t lda, const SB* b,
+	size_t ldb, Acc* c, size_t ldc, bool accumulate, int depth, Acc* scratch) {
+	if (depth == 0 || m < 2 || k < 2 || n < 2) {
+		mixedLeaf(pool, m, k, n, a, lda, b, ldb, c, ldc, accumulate);
+		return;
+	}
+	const int mh = m / 2, kh = k / 2, nh = n / 2;
+	Acc* sa = scratch;
+	Acc* sb = sa + (size_t)mh * kh;
+	Acc* p = sb + (size_t)kh * nh;
+	Acc* child = p + (size_t)mh * nh;
+	const SA* a11 = a;
+	const SA* a12 = a + kh;
+	const SA* a21 = a + mh * lda;
+	const SA* a22 = a21 + kh;
+	const SB* b11 = b;
+	const SB* b12 = b + nh;
+	const SB* b21 = b + kh * ldb;
+	const SB* b22 = b21 + nh;
+	Acc* c11 = c;
+	Acc* c12 = c + nh;
+	Acc* c21 = c + mh * ldc;
+	Acc* c22 = c21 + nh;
+	const bool add = accumulate;
+
+	//p1 = (a11 + a22)(b11 + b22): c11 = p1, c22 = p1
+	mixedSum(pool, mh, kh, a11, lda, 1, a22, lda, sa, kh);
+	mixedSum(pool, kh, nh, b11, ldb, 1, b22, ldb, sb, nh);
+	mixedStep(pool, mh, kh, nh, (const Acc*)sa, kh, (const Acc*)sb, nh, p, nh, false, depth - 1, child);
+	mixedAdd(pool, mh, nh, p, nh, 1, c11, ldc, add);
+	mixedAdd(pool, mh, nh, p, nh, 1, c22, ldc, add);
+	//p2 = (a21 + a22) b11: c21 = p2, c22 -= p2
+	mixedSum(pool, mh, kh, a21, lda, 1, a22, lda, sa, kh);
+	mixedStep(pool, mh, kh, nh, (const Acc*)sa, kh, b11, ldb, p, nh, false, depth - 1, child);
+	mixedAdd(pool, mh, nh, p, nh, 1, c21, ldc, add);
+	mixedAdd(pool, mh, nh, p, nh, -1, c22, ldc, true);
+	//p3 = a11 (b12 - b22): c12 = p3, c22 += p3
+	mixedSum(pool, kh, nh, b12, ldb, -1, b22, ldb, sb, nh);
+	mixedStep(pool, mh, kh, nh, a11, lda, (const Acc*)sb, nh, p, nh, false, depth - 1, child);
+	mixedAdd(pool, mh, nh, p, nh, 1, c12, ldc, add);
+	mixedAdd(pool, mh, nh, p, nh, 1, c22, ldc, true);
+	//p4 = a22 (b21 - b11): c11 += p4, c21 += p4
+	mixedSum(pool, kh, nh, b21, ldb, -1, b11, ldb, sb, nh);
+	mixedStep(pool, mh, kh, nh, a22, lda, (const Acc*)sb, nh, p, nh, false, depth - 1, child);
+	mixedAdd(pool, mh, nh, p, nh, 1, c11, ldc, true);
+	mixedAdd(pool, mh, nh, p, nh, 1, c21, ldc, true);
+	//p5 = (a11 + a12) b22: c11 -= p5, c12 += p5
+	mixedSum(pool, mh, kh, a11, lda, 1, a12, lda, sa, kh);
+	mixedStep(pool, mh, kh, nh, (const Acc*)sa, kh, b22, ldb, p, nh, false, depth - 1, child);
+	mixedAdd(pool, mh, nh, p, nh, -1, c11, ldc, true);
+	mixedAdd(pool, mh, nh, p, nh, 1, c12, ldc, true);
+	//p6 = (a21 - a11)(b11 + b12): c22 += p6
+	mixedSum(pool, mh, kh, a21, lda, -1, a11, lda, sa, kh);
+	mixedSum(pool, kh, nh, b11, ldb, 1, b12, ldb, sb, nh);
+	mixedStep(pool, mh, kh, nh, (const Acc*)sa, kh, (const Acc*)sb, nh, p, nh, false, depth - 1, child);
+	mixedAdd(pool, mh, nh, p, nh, 1, c22, ldc, true);
+	//p7 = (a12 - a22)(b21 + b22): c11 += p7
+	mixedSum(pool, mh, kh, a12, lda, -1, a22, lda, sa, kh);
+	mixedSum(pool, kh, nh, b21, ldb, 1, b22, ldb, sb, nh);
+	mixedStep(pool, mh, kh, nh, (const Acc*)sa, kh, (const Acc*)sb, nh, p, nh, false, depth - 1, child);
+	mixedAdd(pool, mh, nh, p, nh, 1, c11, ldc, true);
+
+	//rims of odd sizes: a rank one update of the even block for an odd
+	//inner dimension, then the last column and the last row of c
+	const int me = 2 * mh, ke = 2 * kh, ne = 2 * nh;
+	if (k > ke)
+		mixedLeaf(pool, me, 1, ne, a + ke, lda, b + ke * ldb, ldb, c, ldc, true);
+	if (n > ne)
+		mixedLeaf(pool, me, k, n - ne, a, lda, b + ne, ldb, c + ne, ldc, accumulate);
+	if (m > me)
+		mixedLeaf(pool, m - me, k, n, a + me * lda, lda, b, ldb, c + me * ldc, ldc, accumulate);
+}
+
+// c = a * b for a and b stored in S and c in the wider Acc. The number of
+// Strassen levels is the smallest of what config allows (its crossover,
+// tuned for Acc when 0, and maxDepth) and what mixedStrassenDepth allows
+// for the largest entries of a and b, which are found with one pass over
+// each; floating point accumulation uses tolerance. Returns the number of
+// levels used. Throws DimensionMismatch if the shapes do not fit, and
+// AccumulatorOverflow if even the ordinary product could overflow an
+// integer Acc.
+template <typename S, typename Acc, typename Access>
+int multiplyMixed(View<S, Access>& a, View<S, Access>& b, View<Acc, Access>& c,
+	const StrassenConfig& config = strassenDefaults(),
+	double tolerance = mixedPrecisionTolerance()) {
+	if (b.getRows() != a.getCols())
+		throw DimensionMismatch(a.getCols(), b.getRows());
+	if (c.getRows() != a.getRows())
+		throw DimensionMismatch(a.getRows(), c.getRows());
+	if (c.getCols() != b.getCols())
+		throw DimensionMismatch(b.getCols(), c.getCols());
+	const int m = a.getRows(), k = a.getCols(), n = b.getCols();
+	const StrassenConfig resolved = resolveStrassenConfig<Acc>(config);
+	ThreadPool& pool = resolved.pool ? *resolved.pool : ThreadPool::global();
+
+	//levels the shape allows: halve while every side is still above the crossover
+	int shapeDepth = 0;
+	for (int mi = m, ki = k, ni = n; std::min(mi, std::min(ki, ni)) >= resolved.crossover &&
+		(resolved.maxDepth < 0 || shapeDepth < resolved.maxDepth); shapeDepth++) {
+		mi /= 2;
+		ki /= 2;
+		ni /= 2;
+	}
+	const double maxA = mixedMagnitude(a, pool), maxB = mixedMagnitude(b, pool);
+	const int depth = mixedStrassenDepth<Acc>(k, maxA, maxB, tolerance, shapeDepth);
+
+	const size_t elements = mixedScratchElements(m, k, n, depth);
+	Acc* scratch = elements ? alignedNew<Acc>(elements, matrixAllocationDefaults().alignment) : nullptr;
+	try {
+		mixedStep(pool, m, k, n, (const S*)a.getData(), a.getStride(), (const S*)b.getData(),
+			b.getStride(), c.getData(), c.getStride(), false, depth, scratch);
+	}
+	catch (...) {
+		alignedDelete(scratch, elements);
+		throw;
+	}
+	alignedDelete(scratch, elements);
+	return depth;
+}
+
+// The same with the accumulator of MixedAccumulator<S>, written into a new matrix.
+template <typename S, typename Access>
+Matrix<typename MixedAccumulator<S>::type, Access> multiplyMixed(View<S, Access>& a,
+	View<S, Access>& b, const StrassenConfig& config = strassenDefaults()) {
+	typedef typename MixedAccumulator<S>::type Acc;
+	Matrix<Acc, Access> c(a.getRows(), b.getCols());
+	View<Acc, Access> view = c.makeView(0, 0, a.getRows(), b.getCols());
+	multiplyMixed(a, b, view, config);
+	return c;
+}
@@ -0,0 +1,490 @@
+#pragma once
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include "Allocation.h"
+#include "Gemm.h"
+#include "Matrix.h"
+#include "Simd.h"
+#include "ThreadPool.h"
+
+// Matrices in recursive Z (Morton) order. The matrix is padded with zeros
+// to a square of side tile * 2^levels and cut into tile x tile blocks, each
+// stored row major; the blocks follow each other in Z order, so at every
+// level of the recursion the four quadrants of the matrix (or of one of its
+// quadrants) are four consecutive equal blocks of memory, in the order 11,
+// 12, 21, 22. Strassen over this layout forms its sums with flat vector
+// passes and needs no views or strides.
+
+// The bits of x moved to the even bit positions of the result.
+inline uint64_t spreadBits(uint32_t x) {
+	uint64_t v = x;
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+	v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+	v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+	v = (v | (v << 2)) & 0x3333333333333333ull;
+	v = (v | (v << 1)) & 0x5555555555555555ull;
+	return v;
+}
+
+// Inverse of spreadBits: the even bits of v.
+inline uint32_t compactBits(uint64_t v) {
+	v &= 0x5555555555555555ull;
+	v = (v | (v >> 1)) & 0x3333333333333333ull;
+	v = (v | (v >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+	v = (v | (v >> 4)) & 0x00FF00FF00FF00FFull;
+	v = (v | (v >> 8)) & 0x0000FFFF0000FFFFull;
+	v = (v | (v >> 16)) & 0x00000000FFFFFFFFull;
+	return (uint32_t)v;
+}
+
+// Z order key of block (ti, tj): the bits of ti and tj interleaved, ti in
+// the odd positions, so the row half of a quadrant comes first.
+inline uint64_t mortonCode(uint32_t ti, uint32_t tj) {
+	return (spreadBits(ti) << 1) | spreadBits(tj);
+}
+
+template <typename T, typename Access = DefaultAccess>
+class MortonMatrix {
+public:
+	// A zero rows x cols matrix in tile x tile blocks. Throws
+	// DimensionMismatch if blockSize is below 1.
+	MortonMatrix(int r, int c, int blockSize = 64,
+		const MatrixAllocation& allocation = matrixAllocationDefaults())
+		: rows(r), cols(c), tile(blockSize) {
+		allocate(0, allocation);
+	}
+	// The same padded to a side of at least minSide, so that the operands of
+	// a product with very different dimensions share one padded square.
+	MortonMatrix(int r, int c, int blockSize, int minSide,
+		const MatrixAllocation& allocation = matrixAllocationDefaults())
+		: rows(r), cols(c), tile(blockSize) {
+		allocate(minSide, allocation);
+	}
+	MortonMatrix(MortonMatrix<T, Access>&& other) noexcept : rows(other.rows), cols(other.cols),
+		tile(other.tile), side(other.side), data(other.data) {
+		other.forget();
+	}
+	MortonMatrix<T, Access>& operator=(MortonMatrix<T, Access>&& other) noexcept {
+		if (this != &other) {
+			release();
+			rows = other.rows;
+			cols = other.cols;
+			tile = other.tile;
+			side = other.side;
+			data = other.data;
+			other.forget();
+		}
+		return *this;
+	}
+	~MortonMatrix() { release(); }
+
+	T& operator()(int row, int col) {
+		Access::element(row, col, rows, cols);
+		return tileData(row / tile, col / tile)[(size_t)(row % tile) * tile + col % tile];
+	}
+
+	int getRows() const { return rows; }
+	int getCols() const { return cols; }
+	int getTile() const { return tile; }
+	//padded size, tile * 2^levels
+	int getSide() const { return side; }
+	T* getData() { return data; }
+	T* tileData(int ti, int tj) {
+		return data + (size_t)mortonCode(ti, tj) * tile * tile;
+	}
+
+	// Copy a row major matrix with the same dimensions in, in parallel.
+	void fromRowMajor(View<T, Access>& source, ThreadPool& pool = ThreadPool::global()) {
+		checkDimensions(source);
+		forEachTile(pool, [&](int ti, int tj, T* block) {
+			for (int r = 0; r < tile; r++) {
+				const int row = ti * tile + r;
+				T* out = block + (size_t)r * tile;
+				int length = 0;
+				if (row < rows) {
+					length = std::max(0, std::min(tile, cols - tj * tile));
+					const T* in = source.getRow(row) + tj * tile;
+					std::copy(in, in + length, out);
+				}
+				std::fill(out + length, out + tile, T(0));
+			}
+		});
+	}
+
+	// Copy the matrix out to a row major view of the same dimensions.
+	void toRowMajor(View<T, Access>& target, ThreadPool& pool = ThreadPool::global()) {
+		checkDimensions(target);
+		forEachTile(pool, [&](int ti, int tj, T* block) {
+			const int length = std::max(0, std::min(tile, cols - tj * tile));
+			for (int r = 0; r < tile && ti * tile + r < rows; r++) {
+				const T* in = block + (size_t)r * tile;
+				std::copy(in, in + length, target.getRow(ti * tile + r) + tj * tile);
+			}
+		});
+	}
+private:
+	int rows, cols, tile, side;
+	T* data;
+
+	void allocate(int minSide, const MatrixAllocation& allocation) {
+		if (tile <= 0)
+			throw DimensionMismatch(1, tile);
+		side = tile;
+		while (side < rows || side < cols || side < minSide)
+			side *= 2;
+		data = static_cast<T*>(alignedAllocate((size_t)side * side * sizeof(T), allocation.alignment));
+		//zero the padding, and first touch the blocks on the threads that
+		//will work on them
+		const size_t area = (size_t)tile * tile;
+		if (!allocation.firstTouch) {
+			for (size_t i = 0; i < area * (side / tile) * (side / tile); i++)
+				new (data + i) T(0);
+			return;
+		}
+		ThreadPool& pool = allocation.pool ? *allocation.pool : ThreadPool::global();
+		forEachTile(pool, [area](int, int, T* block) {
+			for (size_t i = 0; i < area; i++)
+				new (block + i) T(0);
+		});
+	}
+	void release() {
+		if (data != nullptr) {
+			if (!std::is_trivially_destructible<T>::value) {
+				for (size_t i = 0; i < (size_t)side * side; i++)
+					data[i].~T();
+			}
+			alignedFree(data);
+		}
+		forget();
+	}
+	void forget() {
+		rows = cols = side = 0;
+		data = nullptr;
+	}
+
+	void checkDimensions(View<T, Access>& other) {
+		if (other.getRows() != rows)
+			throw DimensionMismatch(rows, other.getRows());
+		if (other.getCols() != cols)
+			throw DimensionMismatch(cols, other.getCols());
+	}
+
+	//body(ti, tj, block) for every block, in storage order
+	template <typename F>
+	void forEachTile(ThreadPool& pool, const F& body) {
+		const int tiles = (side / tile) * (side / tile);
+		pool.parallelFor(0, tiles, 1, [&](int lo, int hi) {
+			for (int index = lo; index < hi; index++)
+				body((int)compactBits((uint64_t)index >> 1), (int)compactBits((uint64_t)index),
+					data + (size_t)index * tile * tile);
+		});
+	}
+
+	MortonMatrix(const MortonMatrix<T, Access>& other);
+	MortonMatrix<T, Access>& operator=(const MortonMatrix<T, Access>& other);
+};
+
+//dst = signs[0] * terms[0] + ... over one flat block
+template <typename T>
+struct MortonCombination {
+	T* dst;
+	int count;
+	const T* terms[5];
+	int signs[5];
+};
+
+//elements of every operand a pass hands to one task, and the piece of
+//them it combines for all outputs at a time so the inputs stay in L1
+const size_t mortonPassGrain = 16384;
+const size_t mortonFuseChunk = 256;
+
+//evaluate a list of combinations of length elements in one pass; later
+//outputs may use earlier ones as terms
+template <typename T>
+void mortonCombine(ThreadPool& pool, const MortonCombination<T>* list, int count, size_t length) {
+	const int chunks = (int)((length + mortonPassGrain - 1) / mortonPassGrain);
+	pool.parallelFor(0, chunks, 1, [&](int lo, int hi) {
+		const size_t end = std::min(length, (size_t)hi * mortonPassGrain);
+		for (size_t at = (size_t)lo * mortonPassGrain; at < end; at += mortonFuseChunk) {
+			const size_t piece = std::min(mortonFuseChunk, end - at);
+			for (int k = 0; k < count; k++) {
+				const T* src[5];
+				for (int t = 0; t < list[k].count; t++)
+					src[t] = list[k].terms[t] + at;
+				simdCombine(piece, list[k].dst + at, src, list[k].signs, list[k].count);
+			}
+		}
+	});
+}
+
+//whether a block of side side is multiplied by the leaf kernel; config
+//must be resolved
+inline bool mortonLeaf(int side, int tile, int level, const StrassenConfig& config) {
+	const int cutoff = config.crossover > 2 ? config.crossover : 2;
+	return side <= tile || side < cutoff || (config.maxDepth >= 0 && level >= config.maxDepth);
+}
+
+//scratch for one product of side x side blocks from this level down
+inline size_t mortonScratchElements(int side, int tile, int level, const StrassenConfig& config) {
+	if (mortonLeaf(side, tile, level, config))
+		return 0;
+	const size_t quarter = (size_t)(side / 2) * (side / 2);
+	if (config.schedule == StrassenLean)
+		return 3 * StrassenWorkspace<int>::leanTemporaries * quarter +
+			mortonScratchElements(side / 2, tile, level + 1, config);
+	const size_t branches = level < config.parallelDepth ? StrassenWorkspace<int>::products : 1;
+	return (StrassenWorkspace<int>::aTemporaries + StrassenWorkspace<int>::bTemporaries +
+		StrassenWorkspace<int>::products) * quarter +
+		branches * mortonScratchElements(side / 2, tile, level + 1, config);
+}
+
+//c = a * b for side x side Morton blocks with the blocked kernel, one
+//block of c (all of its inner products) at a time
+template <typename T>
+void mortonLeafMultiply(ThreadPool& pool, bool parallel, const T* a, const T* b, T* c, int side,
+	int tile) {
+	const int perSide = side / tile;
+	const size_t area = (size_t)tile * tile;
+	auto body = [&](int lo, int hi) {
+		for (int index = lo; index < hi; index++) {
+			const uint32_t i = compactBits((uint64_t)index >> 1), j = compactBits((uint64_t)index);
+			for (int p = 0; p < perSide; p++)
+				gemmBlocked(tile, tile, tile, T(1), a + mortonCode(i, p) * area, tile,
+					b + mortonCode(p, j) * area, tile, p == 0 ? T(0) : T(1), c + (size_t)index * area, tile);
+		}
+	};
+	if (parallel)
+		pool.parallelFor(0, perSide * perSide, 1, body);
+	else
+		body(0, perSide * perSide);
+}
+
+template <typename T>
+void mortonStep(ThreadPool& pool, const T* a, const T* b, T* c, int side, int tile, int level,
+	T* scratch, const StrassenConfig& config);
+
+//one level of Winograd's variant for StrassenLean: the seven products one
+//after another into the temporary z, next to the operand sums x and y,
+//collected into the quadrants of c
+template <typename T>
+void mortonLeanStep(ThreadPool& pool, const T* a, const T* b, T* c, int side, int tile, int level,
+	T* scratch, const StrassenConfig& config) {
+	const int half = side / 2;
+	const size_t q = (size_t)half * half;
+	const T *a11 = a, *a12 = a + q, *a21 = a + 2 * q, *a22 = a + 3 * q;
+	const T *b11 = b, *b12 = b + q, *b21 = b + 2 * q, *b22 = b + 3 * q;
+	T *c11 = c, *c12 = c + q, *c21 = c + 2 * q, *c22 = c + 3 * q;
+	T *x = scratch, *y = scratch + q, *z = scratch + 2 * q;
+	T* next = scratch + 3 * q;
+	auto product = [&](const T* l, const T* r) {
+		mortonStep(pool, l, r, z, half, tile, level + 1, next, config);
+	};
+	auto form = [&pool, q](const MortonCombination<T>* list, int count) {
+		mortonCombine(pool, list, count, q);
+	};
+
+	//P1 = a11 b11 starts c11 and U2 in c12
+	product(a11, b11);
+	const MortonCombination<T> p1[] = { { c11, 1, { z }, { 1 } }, { c12, 1, { z }, { 1 } } };
+	form(p1, 2);
+	//U1 = P1 + P2
+	product(a12, b21);
+	const MortonCombination<T> p2[] = { { c11, 2, { c11, z }, { 1, 1 } } };
+	form(p2, 1);
+	//U2 = P1 + P6 with S2 = a21 + a22 - a11 and T2 = b22 - b12 + b11
+	const MortonCombination<T> s2[] = {
+		{ x, 3, { a21, a22, a11 }, { 1, 1, -1 } },
+		{ y, 3, { b22, b12, b11 }, { 1, -1, 1 } }
+	};
+	form(s2, 2);
+	product(x, y);
+	const MortonCombination<T> p6[] = { { c12, 2, { c12, z }, { 1, 1 } } };
+	form(p6, 1);
+	//U2 - P4 with T4 = T2 - b21
+	const MortonCombination<T> t4[] = { { y, 2, { y, b21 }, { 1, -1 } } };
+	form(t4, 1);
+	product(a22, y);
+	const MortonCombination<T> p4[] = { { c21, 2, { c12, z }, { 1, -1 } } };
+	form(p4, 1);
+	//U6 = U3 - P4 and U3 = U2 + P7 with S3 = a11 - a21 and T3 = b22 - b12
+	const MortonCombination<T> s3[] = {
+		{ x, 2, { a11, a21 }, { 1, -1 } },
+		{ y, 2, { b22, b12 }, { 1, -1 } }
+	};
+	form(s3, 2);
+	product(x, y);
+	const MortonCombination<T> p7[] = {
+		{ c21, 2, { c21, z }, { 1, 1 } },
+		{ c22, 2, { c12, z }, { 1, 1 } }
+	};
+	form(p7, 2);
+	//U4 = U2 + P5 and U7 = U3 + P5 with S1 = a21 + a22 and T1 = b12 - b11
+	const MortonCombination<T> s1[] = {
+		{ x, 2, { a21, a22 }, { 1, 1 } },
+		{ y, 2, { b12, b11 }, { 1, -1 } }
+	};
+	form(s1, 2);
+	product(x, y);
+	const MortonCombination<T> p5[] = {
+		{ c12, 2, { c12, z }, { 1, 1 } },
+		{ c22, 2, { c22, z }, { 1, 1 } }
+	};
+	form(p5, 2);
+	//U5 = U4 + P3 with S4 = a12 - S2 = a12 + a11 - S1
+	const MortonCombination<T> s4[] = { { x, 3, { a12, a11, x }, { 1, 1, -1 } } };
+	form(s4, 1);
+	product(x, b22);
+	const MortonCombination<T> p3[] = { { c12, 2, { c12, z }, { 1, 1 } } };
+	form(p3, 1);
+}
+
+//one level of Strassen on side x side Morton blocks: the quadrants are
+//a, a + q, a + 2q and a + 3q for q = (side / 2)^2
+template <typename T>
+void mortonStep(ThreadPool& pool, const T* a, const T* b, T* c, int side, int tile, int level,
+	T* scratch, const StrassenConfig& config) {
+	const bool parallel = level < config.parallelDepth;
+	if (mortonLeaf(side, tile, level, config)) {
+		//the lean schedule runs its products one at a time, so its leaves
+		//always spread over the pool
+		mortonLeafMultiply(pool, parallel || config.schedule == StrassenLean, a, b, c, side, tile);
+		return;
+	}
+	if (config.schedule == StrassenLean) {
+		mortonLeanStep(pool, a, b, c, side, tile, level, scratch, config);
+		return;
+	}
+	int i;
+	const int half = side / 2;
+	const size_t q = (size_t)half * half;
+	const T *a11 = a, *a12 = a + q, *a21 = a + 2 * q, *a22 = a + 3 * q;
+	const T *b11 = b, *b12 = b + q, *b21 = b + 2 * q, *b22 = b + 3 * q;
+	T *c11 = c, *c12 = c + q, *c21 = c + 2 * q, *c22 = c + 3 * q;
+	T* s[10];
+	T* p[7];
+	for (i = 0; i < 10; i++)
+		s[i] = scratch + i * q;
+	for (i = 0; i < 7; i++)
+		p[i] = scratch + (10 + i) * q;
+	T* next = scratch + 17 * q;
+	const size_t branch = mortonScratchElements(half, tile, level + 1, config);
+
+	const T* left[7];
+	const T* right[7];
+	if (config.schedule == StrassenWinograd) {
+		//s[0..3] = S1..S4, s[4..7] = T1..T4
+		const MortonCombination<T> form[] = {
+			{ s[0], 2, { a21, a22 }, { 1, 1 } },
+			{ s[1], 2, { s[0], a11 }, { 1, -1 } },
+			{ s[2], 2, { a11, a21 }, { 1, -1 } },
+			{ s[3], 2, { a12, s[1] }, { 1, -1 } },
+			{ s[4], 2, { b12, b11 }, { 1, -1 } },
+			{ s[5], 2, { b22, s[4] }, { 1, -1 } },
+			{ s[6], 2, { b22, b12 }, { 1, -1 } },
+			{ s[7], 2, { s[5], b21 }, { 1, -1 } }
+		};
+		mortonCombine(pool, form, 8, q);
+		const T* l[7] = { a11, a12, s[3], a22, s[0], s[1], s[2] };
+		const T* r[7] = { b11, b21, b22, s[7], s[4], s[5], s[6] };
+		std::copy(l, l + 7, left);
+		std::copy(r, r + 7, right);
+	}
+	else {
+		const MortonCombination<T> form[] = {
+			{ s[0], 2, { b12, b22 }, { 1, -1 } },
+			{ s[1], 2, { a11, a12 }, { 1, 1 } },
+			{ s[2], 2, { a21, a22 }, { 1, 1 } },
+			{ s[3], 2, { b21, b11 }, { 1, -1 } },
+			{ s[4], 2, { a11, a22 }, { 1, 1 } },
+			{ s[5], 2, { b11, b22 }, { 1, 1 } },
+			{ s[6], 2, { a12, a22 }, { 1, -1 } },
+			{ s[7], 2, { b21, b22 }, { 1, 1 } },
+			{ s[8], 2, { a11, a21 }, { 1, -1 } },
+			{ s[9], 2, { b11, b12 }, { 1, 1 } }
+		};
+		mortonCombine(pool, form, 10, q);
+		const T* l[7] = { a11, s[1], s[2], a22, s[4], s[6], s[8] };
+		const T* r[7] = { s[0], b22, b11, s[3], s[5], s[7], s[9] };
+		std::copy(l, l + 7, left);
+		std::copy(r, r + 7, right);
+	}
+
+	if (!parallel) {
+		for (i = 0; i < 7; i++)
+			mortonStep(pool, left[i], right[i], p[i], half, tile, level + 1, next, config);
+	}
+	else {
+		TaskGroup products;
+		for (i = 0; i < 6; i++) {
+			const T* l = left[i];
+			const T* r = right[i];
+			T* product = p[i];
+			T* region = next + i * branch;
+			pool.submit(products, [&pool, l, r, product, half, tile, level, region, &config]() {
+				mortonStep(pool, l, r, product, half, tile, level + 1, region, config);
+			});
+		}
+		try {
+			mortonStep(pool, left[6], right[6], p[6], half, tile, level + 1, next + 6 * branch, config);
+		}
+		catch (...) {
+			pool.wait(products);
+			throw;
+		}
+		pool.wait(products);
+	}
+
+	if (config.schedule == StrassenWinograd) {
+		//U2 = P1 + P6 and U3 = U2 + P7 are kept in place of P6 and P7
+		const MortonCombination<T> form[] = {
+			{ c11, 2, { p[0], p[1] }, { 1, 1 } },
+			{ p[5], 2, { p[0], p[5] }, { 1, 1 } },
+			{ p[6], 2, { p[5], p[6] }, { 1, 1 } },
+			{ c12, 3, { p[5], p[4], p[2] }, { 1, 1, 1 } },
+			{ c21, 2, { p[6], p[3] }, { 1, -1 } },
+			{ c22, 2, { p[6], p[4] }, { 1, 1 } }
+		};
+		mortonCombine(pool, form, 6, q);
+	}
+	else {
+		const MortonCombination<T> form[] = {
+			{ c11, 4, { p[4], p[3], p[1], p[5] }, { 1, 1, -1, 1 } },
+			{ c12, 2, { p[0], p[1] }, { 1, 1 } },
+			{ c21, 2, { p[2], p[3] }, { 1, 1 } },
+			{ c22, 4, { p[4], p[0], p[2], p[6] }, { 1, 1, -1, -1 } }
+		};
+		mortonCombine(pool, form, 4, q);
+	}
+}
+
+// c = a * b for Morton matrices with the same tile size and padded side,
+// by Strassen on the contiguous quadrants in the schedule of config
+// (StrassenClassic and StrassenFused take the same path here, as the
+// passes are fused anyway). The padding is zero, so it takes part in the
+// product without changing it.
+template <typename T, typename Access>
+void multiply(MortonMatrix<T, Access>& a, MortonMatrix<T, Access>& b, MortonMatrix<T, Access>& c,
+	const StrassenConfig& config = strassenDefaults()) {
+	if (b.getRows() != a.getCols())
+		throw DimensionMismatch(a.getCols(), b.getRows());
+	if (c.getRows() != a.getRows())
+		throw DimensionMismatch(a.getRows(), c.getRows());
+	if (c.getCols() != b.getCols())
+		throw DimensionMismatch(b.getCols(), c.getCols());
+	if (b.getTile() != a.getTile())
+		throw DimensionMismatch(a.getTile(), b.getTile());
+	if (c.getTile() != a.getTile())
+		throw DimensionMismatch(a.getTile(), c.getTile());
+	//the recursion runs over whole padded squares, so they must agree
+	if (b.getSide() != a.getSide())
+		throw DimensionMismatch(a.getSide(), b.getSide());
+	if (c.getSide() != a.getSide())
+		throw DimensionMismatch(a.getSide(), c.getSide());
+	const StrassenConfig resolved = resolveStrassenConfig<T>(config);
+	ThreadPool& pool = resolved.pool ? *resolved.pool : ThreadPool::global();
+	const size_t elements = mortonScratchElements(a.getSide(), a.getTile(), 0, resolved);
+	AlignedBuffer scratch((elements > 0 ? elements : 1) * sizeof(T), matrixAllocationDefaults().alignment);
+	mortonStep(pool, a.getData(), b.getData(), c.getData(), a.getSide(), a.getTile(), 0,
+		reinterpret_cast<T*>(scratch.data()), resolved);
+}
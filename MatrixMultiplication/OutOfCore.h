@@ -0,0 +1,185 @@
+#pragma once
+#include <algorithm>
+#include <stddef.h>
+#include <string>
+#include "MappedFile.h"
+#include "Matrix.h"
+
+// Matrices larger than RAM. A TiledMatrix lives in a memory mapped file in
+// a tiled layout: the matrix is cut into tile x tile blocks (the last row
+// and column of tiles are zero padded to full size), each block is stored
+// contiguously in row major order, and the blocks follow each other in row
+// major order, so one tile is one sequential read. multiplyOutOfCore
+// streams tiles through a few in-core buffers.
+
+template <typename T, typename Access = DefaultAccess>
+class TiledMatrix {
+public:
+	// Map (or with create, create) the file at path for a rows x cols matrix
+	// cut into tile x tile blocks, which start offset bytes into the file.
+	TiledMatrix(const std::string& path, int r, int c, int blockSize, bool create,
+		size_t start = 0)
+		: rows(r), cols(c), tile(blockSize), tileRows((r + blockSize - 1) / blockSize),
+		tileCols((c + blockSize - 1) / blockSize), offset(start),
+		file(path, start + (size_t)tileRows * tileCols * blockSize * blockSize * sizeof(T), create) {}
+
+	int getRows() const { return rows; }
+	int getCols() const { return cols; }
+	int getTile() const { return tile; }
+	int getTileRows() const { return tileRows; }
+	int getTileCols() const { return tileCols; }
+
+	T* tileData(int ti, int tj) {
+		Access::element(ti, tj, tileRows, tileCols);
+		return reinterpret_cast<T*>(file.data() + offset) + tileIndex(ti, tj) * tile * tile;
+	}
+	View<T, Access> tileView(int ti, int tj) {
+		return View<T, Access>(tileData(ti, tj), tile, tile, tile);
+	}
+
+	T& operator()(int row, int col) {
+		Access::element(row, col, rows, cols);
+		return tileData(row / tile, col / tile)[(size_t)(row % tile) * tile + col % tile];
+	}
+
+	// Start reading tile (ti, tj) in the background.
+	void prefetch(int ti, int tj) {
+		const size_t bytes = (size_t)tile * tile * sizeof(T);
+		file.willNeed(offset + tileIndex(ti, tj) * bytes, bytes);
+	}
+	void flush() { file.flush(); }
+private:
+	int rows, cols, tile;
+	int tileRows, tileCols;
+	size_t offset;
+	MappedFile file;
+
+	size_t tileIndex(int ti, int tj) const { return (size_t)ti * tileCols + tj; }
+
+	TiledMatrix(const TiledMatrix<T, Access>& other);
+	TiledMatrix<T, Access>& operator=(const TiledMatrix<T, Access>& other);
+};
+
+// Largest tile size the search in outOfCoreTile goes up to, so a budget
+// of SIZE_MAX (no limit) neither wraps the byte count nor the tile size.
+const int outOfCoreMaxTile = 1 << 15;
+
+// Largest tile size (a multiple of 64, at most outOfCoreMaxTile) whose
+// in-core working set for multiplyOutOfCore fits in memoryBytes: double
+// buffered A and B tiles, two C tiles and the Strassen workspace of one
+// tile product.
+template <typename T>
+int outOfCoreTile(size_t memoryBytes, const StrassenConfig& config) {
+	const StrassenConfig resolved = resolveStrassenConfig<T>(config);
+	int best = 64;
+	for (int t = 128; t <= outOfCoreMaxTile; t += 64) {
+		const size_t bytes = 6 * (size_t)t * t * sizeof(T) +
+			StrassenWorkspace<T>::requiredBytes(t, t, t, resolved);
+		if (bytes > memoryBytes)
+			break;
+		best = t;
+	}
+	return best;
+}
+
+// c = a * b for tiled file backed matrices with the same tile size. Each
+// tile of c is the sum over p of a(i, p) * b(p, j), computed in core with
+// Matrix::Multiply and accumulated with beta = 1. While one tile product
+// runs, a separate I/O thread copies the operands of the next one in from
+// the mapping (and writes the previous tile of c back), and the operating
+// system is told to read ahead the operands of the one after that.
+template <typename T, typename Access>
+void multiplyOutOfCore(TiledMatrix<T, Access>& a, TiledMatrix<T, Access>& b,
+	TiledMatrix<T, Access>& c, const StrassenConfig& config) {
+	if (b.getRows() != a.getCols())
+		throw DimensionMismatch(a.getCols(), b.getRows());
+	if (c.getRows() != a.getRows())
+		throw DimensionMismatch(a.getRows(), c.getRows());
+	if (c.getCols() != b.getCols())
+		throw DimensionMismatch(b.getCols(), c.getCols());
+	if (b.getTile() != a.getTile())
+		throw DimensionMismatch(a.getTile(), b.getTile());
+	if (c.getTile() != a.getTile())
+		throw DimensionMismatch(a.getTile(), c.getTile());
+	const int t = a.getTile();
+	const int tm = a.getTileRows(), tk = a.getTileCols(), tn = b.getTileCols();
+	const long steps = (long)tm * tn * tk;
+	if (steps == 0)
+		return;
+	const StrassenConfig resolved = resolveStrassenConfig<T>(config);
+	MatrixAllocation inCore = matrixAllocationDefaults();
+	inCore.pool = resolved.pool;
+	Matrix<T, Access> a0(t, t, inCore), a1(t, t, inCore), b0(t, t, inCore), b1(t, t, inCore);
+	Matrix<T, Access> c0(t, t, inCore), c1(t, t, inCore);
+	Matrix<T, Access>* aTile[2] = { &a0, &a1 };
+	Matrix<T, Access>* bTile[2] = { &b0, &b1 };
+	Matrix<T, Access>* cTile[2] = { &c0, &c1 };
+	StrassenWorkspace<T> workspace(t, t, t, resolved);
+
+	//step s multiplies a(i, p) by b(p, j), p running fastest
+	auto decode = [tn, tk](long s, int& i, int& j, int& p) {
+		p = (int)(s % tk);
+		j = (int)(s / tk % tn);
+		i = (int)(s / tk / tn);
+	};
+	auto copyIn = [t](const T* tile, Matrix<T, Access>& buffer) {
+		for (int r = 0; r < t; r++)
+			std::copy(tile + (size_t)r * t, tile + (size_t)(r + 1) * t,
+				buffer.getData() + (size_t)r * buffer.getStride());
+	};
+	auto copyOut = [t](Matrix<T, Access>& buffer, T* tile) {
+		for (int r = 0; r < t; r++) {
+			const T* row = buffer.getData() + (size_t)r * buffer.getStride();
+			std::copy(row, row + t, tile + (size_t)r * t);
+		}
+	};
+	auto load = [&](long s) {
+		int i, j, p;
+		decode(s, i, j, p);
+		copyIn(a.tileData(i, p), *aTile[s % 2]);
+		copyIn(b.tileData(p, j), *bTile[s % 2]);
+		if (s + 1 < steps) {
+			decode(s + 1, i, j, p);
+			a.prefetch(i, p);
+			b.prefetch(p, j);
+		}
+	};
+
+	//one worker does the copies; the calling thread only joins in when it
+	//has to wait for them
+	ThreadPool io(2);
+	TaskGroup transfers;
+	int slot = 0;
+	int done = -1, doneI = 0, doneJ = 0;
+	load(0);
+	for (long s = 0; s < steps; s++) {
+		int i, j, p;
+		decode(s, i, j, p);
+		if (s + 1 < steps)
+			io.submit(transfers, [&load, s]() { load(s + 1); });
+		if (done >= 0) {
+			Matrix<T, Access>* finished = cTile[done];
+			T* target = c.tileData(doneI, doneJ);
+			io.submit(transfers, [&copyOut, finished, target]() { copyOut(*finished, target); });
+			done = -1;
+		}
+		View<T, Access> va = aTile[s % 2]->makeView(0, 0, t, t);
+		View<T, Access> vb = bTile[s % 2]->makeView(0, 0, t, t);
+		View<T, Access> vc = cTile[slot]->makeView(0, 0, t, t);
+		try {
+			Matrix<T, Access>::Multiply(va, vb, vc, T(1), p == 0 ? T(0) : T(1), workspace, resolved);
+		}
+		catch (...) {
+			io.wait(transfers);
+			throw;
+		}
+		io.wait(transfers);
+		if (p == tk - 1) {
+			done = slot;
+			doneI = i;
+			doneJ = j;
+			slot ^= 1;
+		}
+	}
+	copyOut(*cTile[done], c.tileData(doneI, doneJ));
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <cmath>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include "Allocation.h"
+#include "Matrix.h"
+#include "ThreadPool.h"
+
+// Random matrices from a counter based generator (Philox4x32-10, Salmon et
+// al., "Parallel random numbers: as easy as 1, 2, 3"). Element (i, j) is a
+// pure function of the seed and of (i, j): one Philox block of the counter
+// (j, i, stream, 0) under the seed as key. So a matrix comes out the same
+// whatever the number of threads and the order they run in, any block of
+// it can be generated on its own (give the position of its first element),
+// and there is no generator state to share between threads.
+
+// The ten Philox4x32 rounds: counter in, four random words out.
+inline void philox4x32(const uint32_t counter[4], uint64_t key, uint32_t out[4]) {
+	uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+	for (int round = 0; round < 10; round++) {
+		const uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+		const uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+		const uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		const uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c1 = (uint32_t)p1;
+		c3 = (uint32_t)p0;
+		c0 = n0;
+		c2 = n2;
+		k0 += 0x9E3779B9u;
+		k1 += 0xBB67AE85u;
+	}
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+// 53 random bits as a double in [0, 1).
+inline double randomUnit(uint32_t high, uint32_t low) {
+	return (double)((((uint64_t)high << 32) | low) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+enum RandomKind {
+	RandomUniform,	// [a, b) for floating point, the integers a..b inclusive for integer types
+	RandomNormal	// mean a, standard deviation b (rounded to the nearest integer for integer types)
+};
+
+struct RandomDistribution {
+	RandomKind kind;
+	double a, b;
+};
+
+inline RandomDistribution uniformDistribution(double low, double high) {
+	RandomDistribution distribution = { RandomUniform, low, high };
+	return distribution;
+}
+
+inline RandomDistribution normalDistribution(double mean, double deviation) {
+	RandomDistribution distribution = { RandomNormal, mean, deviation };
+	return distribution;
+}
+
+// Element (row, col) of the matrix with the given seed and stream.
+template <typename T>
+T randomElement(const RandomDistribution& distribution, uint64_t seed, uint32_t stream,
+	uint32_t row, uint32_t col) {
+	const uint32_t counter[4] = { col, row, stream, 0 };
+	uint32_t words[4];
+	philox4x32(counter, seed, words);
+	double value;
+	if (distribution.kind == RandomNormal) {
+		//Box-Muller; the first uniform is moved to (0, 1] so its log is finite
+		const double u = 1.0 - randomUnit(words[0], words[1]);
+		const double v = randomUnit(words[2], words[3]);
+		value = distribution.a + distribution.b * std::sqrt(-2.0 * std::log(u)) *
+			std::cos(6.283185307179586 * v);
+		if (std::is_integral<T>::value)
+			value = std::floor(value + 0.5);
+		return T(value);
+	}
+	const double u = randomUnit(words[0], words[1]);
+	if (std::is_integral<T>::value) {
+		//ranges up to 2^53 values; the floor of u * range is uniform to
+		//within range / 2^53
+		const double range = std::floor(distribution.b) - std::ceil(distribution.a) + 1;
+		return T(std::ceil(distribution.a) + std::floor(u * range));
+	}
+	value = distribution.a + (distribution.b - distribution.a) * u;
+	//rounding (in particular to a type narrower than double) can land on b
+	//itself, which is excluded; such a draw is taken as a instead
+	const T result = T(value);
+	return (double)result < distribution.b ? result : T(distribution.a);
+}
+
+// Fill view with random elements, in parallel row chunks on pool. firstRow
+// and firstCol place the view inside a larger random matrix: the elements
+// are the same ones that matrix has there. stream tells apart matrices
+// drawn with the same seed (for example a and b of one product).
+template <typename T, typename Access>
+void fillRandom(View<T, Access>& view, const RandomDistribution& distribution, uint64_t seed,
+	uint32_t stream = 0, ThreadPool& pool = ThreadPool::global(), int firstRow = 0, int firstCol = 0) {
+	const int rows = view.getRows(), cols = view.getCols();
+	const int grain = cols > 0 && 16384 / cols > 1 ? 16384 / cols : 1;
+	pool.parallelFor(0, rows, grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			T* row = view.getRow(i);
+			for (int j = 0; j < cols; j++)
+				row[j] = randomElement<T>(distribution, seed, stream, (uint32_t)(firstRow + i),
+					(uint32_t)(firstCol + j));
+		}
+	});
+}
+
+// A new rows x cols random matrix. Its pages are first touched by the
+// threads of pool in the same row chunks the generator then writes (and
+// P_Strassen later reads), so on a NUMA system they sit on their nodes.
+template <typename T, typename Access = DefaultAccess>
+Matrix<T, Access> randomMatrix(int rows, int cols, const RandomDistribution& distribution,
+	uint64_t seed, uint32_t stream = 0, ThreadPool& pool = ThreadPool::global()) {
+	MatrixAllocation allocation = matrixAllocationDefaults();
+	allocation.firstTouch = true;
+	allocation.pool = &pool;
+	Matrix<T, Access> matrix(rows, cols, allocation);
+	View<T, Access> view = matrix.makeView(0, 0, rows, cols);
+	fillRandom(view, distribution, seed, stream, pool);
+	return matrix;
+}
@@ -0,0 +1,395 @@
+#pragma once
+#include <stddef.h>
+
+// Vectorized kernels for the Strassen linear combinations and the leaf
+// GEMM micro-kernel, for int, float and double. One binary carries an
+// SSE4.1, AVX2 and AVX-512 version (NEON on AArch64), and the best one the
+// CPU supports is picked at run time. The kernel bodies are written once in
+// SimdKernels.inl against a small Vec<T> wrapper per instruction set.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+enum SimdLevel {
+	SimdScalar,
+	SimdSSE,	// SSE4.1
+	SimdAVX2,	// AVX2 + FMA
+	SimdAVX512,	// AVX-512F
+	SimdNEON
+};
+
+inline SimdLevel detectSimdLevel() {
+#if defined(SIMD_X86) && defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	const int maxLeaf = info[0];
+	__cpuid(info, 1);
+	const bool sse41 = (info[2] >> 19) & 1;
+	const bool fma = (info[2] >> 12) & 1;
+	const bool osxsave = (info[2] >> 27) & 1;
+	const bool avx = (info[2] >> 28) & 1;
+	bool avx2 = false, avx512 = false;
+	if (maxLeaf >= 7) {
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] >> 5) & 1;
+		avx512 = (info[1] >> 16) & 1;
+	}
+	//the OS has to save the ymm / zmm state as well
+	const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	if (avx512 && (xcr0 & 0xe6) == 0xe6)
+		return SimdAVX512;
+	if (avx2 && fma && avx && (xcr0 & 0x6) == 0x6)
+		return SimdAVX2;
+	if (sse41)
+		return SimdSSE;
+	return SimdScalar;
+#elif defined(SIMD_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SimdAVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return SimdAVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return SimdSSE;
+	return SimdScalar;
+#elif defined(SIMD_NEON)
+	return SimdNEON;
+#else
+	return SimdScalar;
+#endif
+}
+
+inline int& simdLevelStorage() {
+	static int level = detectSimdLevel();
+	return level;
+}
+
+inline SimdLevel simdLevel() {
+	return (SimdLevel)simdLevelStorage();
+}
+
+// Restrict the kernels to a lower instruction set, e.g. to compare them.
+// Returns false (and changes nothing) if the CPU does not support level.
+// Call before starting any multiplication.
+inline bool setSimdLevel(SimdLevel level) {
+	const SimdLevel detected = detectSimdLevel();
+	if (level != SimdScalar && ((level == SimdNEON) != (detected == SimdNEON) || level > detected))
+		return false;
+	simdLevelStorage() = level;
+	return true;
+}
+
+#if defined(SIMD_X86)
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("sse4.1"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#endif
+namespace simd_sse {
+template <typename T> struct Vec;
+template <> struct Vec<float> {
+	typedef __m128 type;
+	static const int lanes = 4;
+	static type zero() { return _mm_setzero_ps(); }
+	static type set1(float x) { return _mm_set1_ps(x); }
+	static type load(const float* p) { return _mm_loadu_ps(p); }
+	static void store(float* p, type v) { _mm_storeu_ps(p, v); }
+	static type add(type a, type b) { return _mm_add_ps(a, b); }
+	static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+};
+template <> struct Vec<double> {
+	typedef __m128d type;
+	static const int lanes = 2;
+	static type zero() { return _mm_setzero_pd(); }
+	static type set1(double x) { return _mm_set1_pd(x); }
+	static type load(const double* p) { return _mm_loadu_pd(p); }
+	static void store(double* p, type v) { _mm_storeu_pd(p, v); }
+	static type add(type a, type b) { return _mm_add_pd(a, b); }
+	static type sub(type a, type b) { return _mm_sub_pd(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+};
+template <> struct Vec<int> {
+	typedef __m128i type;
+	static const int lanes = 4;
+	static type zero() { return _mm_setzero_si128(); }
+	static type set1(int x) { return _mm_set1_epi32(x); }
+	static type load(const int* p) { return _mm_loadu_si128((const __m128i*)p); }
+	static void store(int* p, type v) { _mm_storeu_si128((__m128i*)p, v); }
+	static type add(type a, type b) { return _mm_add_epi32(a, b); }
+	static type sub(type a, type b) { return _mm_sub_epi32(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm_add_epi32(_mm_mullo_epi32(a, b), c); }
+};
+const int microRows = 6;
+const int microVectors = 2;
+#include "SimdKernels.inl"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace simd_avx2 {
+template <typename T> struct Vec;
+template <> struct Vec<float> {
+	typedef __m256 type;
+	static const int lanes = 8;
+	static type zero() { return _mm256_setzero_ps(); }
+	static type set1(float x) { return _mm256_set1_ps(x); }
+	static type load(const float* p) { return _mm256_loadu_ps(p); }
+	static void store(float* p, type v) { _mm256_storeu_ps(p, v); }
+	static type add(type a, type b) { return _mm256_add_ps(a, b); }
+	static type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm256_fmadd_ps(a, b, c); }
+};
+template <> struct Vec<double> {
+	typedef __m256d type;
+	static const int lanes = 4;
+	static type zero() { return _mm256_setzero_pd(); }
+	static type set1(double x) { return _mm256_set1_pd(x); }
+	static type load(const double* p) { return _mm256_loadu_pd(p); }
+	static void store(double* p, type v) { _mm256_storeu_pd(p, v); }
+	static type add(type a, type b) { return _mm256_add_pd(a, b); }
+	static type sub(type a, type b) { return _mm256_sub_pd(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm256_fmadd_pd(a, b, c); }
+};
+template <> struct Vec<int> {
+	typedef __m256i type;
+	static const int lanes = 8;
+	static type zero() { return _mm256_setzero_si256(); }
+	static type set1(int x) { return _mm256_set1_epi32(x); }
+	static type load(const int* p) { return _mm256_loadu_si256((const __m256i*)p); }
+	static void store(int* p, type v) { _mm256_storeu_si256((__m256i*)p, v); }
+	static type add(type a, type b) { return _mm256_add_epi32(a, b); }
+	static type sub(type a, type b) { return _mm256_sub_epi32(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm256_add_epi32(_mm256_mullo_epi32(a, b), c); }
+};
+const int microRows = 6;
+const int microVectors = 2;
+#include "SimdKernels.inl"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+namespace simd_avx512 {
+template <typename T> struct Vec;
+template <> struct Vec<float> {
+	typedef __m512 type;
+	static const int lanes = 16;
+	static type zero() { return _mm512_setzero_ps(); }
+	static type set1(float x) { return _mm512_set1_ps(x); }
+	static type load(const float* p) { return _mm512_loadu_ps(p); }
+	static void store(float* p, type v) { _mm512_storeu_ps(p, v); }
+	static type add(type a, type b) { return _mm512_add_ps(a, b); }
+	static type sub(type a, type b) { return _mm512_sub_ps(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm512_fmadd_ps(a, b, c); }
+};
+template <> struct Vec<double> {
+	typedef __m512d type;
+	static const int lanes = 8;
+	static type zero() { return _mm512_setzero_pd(); }
+	static type set1(double x) { return _mm512_set1_pd(x); }
+	static type load(const double* p) { return _mm512_loadu_pd(p); }
+	static void store(double* p, type v) { _mm512_storeu_pd(p, v); }
+	static type add(type a, type b) { return _mm512_add_pd(a, b); }
+	static type sub(type a, type b) { return _mm512_sub_pd(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm512_fmadd_pd(a, b, c); }
+};
+template <> struct Vec<int> {
+	typedef __m512i type;
+	static const int lanes = 16;
+	static type zero() { return _mm512_setzero_si512(); }
+	static type set1(int x) { return _mm512_set1_epi32(x); }
+	static type load(const int* p) { return _mm512_loadu_si512((const void*)p); }
+	static void store(int* p, type v) { _mm512_storeu_si512((void*)p, v); }
+	static type add(type a, type b) { return _mm512_add_epi32(a, b); }
+	static type sub(type a, type b) { return _mm512_sub_epi32(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm512_add_epi32(_mm512_mullo_epi32(a, b), c); }
+};
+//32 vector registers, so a taller block fits
+const int microRows = 12;
+const int microVectors = 2;
+#include "SimdKernels.inl"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#elif defined(SIMD_NEON)
+
+namespace simd_neon {
+template <typename T> struct Vec;
+template <> struct Vec<float> {
+	typedef float32x4_t type;
+	static const int lanes = 4;
+	static type zero() { return vdupq_n_f32(0.0f); }
+	static type set1(float x) { return vdupq_n_f32(x); }
+	static type load(const float* p) { return vld1q_f32(p); }
+	static void store(float* p, type v) { vst1q_f32(p, v); }
+	static type add(type a, type b) { return vaddq_f32(a, b); }
+	static type sub(type a, type b) { return vsubq_f32(a, b); }
+	static type fmadd(type a, type b, type c) { return vfmaq_f32(c, a, b); }
+};
+template <> struct Vec<double> {
+	typedef float64x2_t type;
+	static const int lanes = 2;
+	static type zero() { return vdupq_n_f64(0.0); }
+	static type set1(double x) { return vdupq_n_f64(x); }
+	static type load(const double* p) { return vld1q_f64(p); }
+	static void store(double* p, type v) { vst1q_f64(p, v); }
+	static type add(type a, type b) { return vaddq_f64(a, b); }
+	static type sub(type a, type b) { return vsubq_f64(a, b); }
+	static type fmadd(type a, type b, type c) { return vfmaq_f64(c, a, b); }
+};
+template <> struct Vec<int> {
+	typedef int32x4_t type;
+	static const int lanes = 4;
+	static type zero() { return vdupq_n_s32(0); }
+	static type set1(int x) { return vdupq_n_s32(x); }
+	static type load(const int* p) { return vld1q_s32(p); }
+	static void store(int* p, type v) { vst1q_s32(p, v); }
+	static type add(type a, type b) { return vaddq_s32(a, b); }
+	static type sub(type a, type b) { return vsubq_s32(a, b); }
+	static type fmadd(type a, type b, type c) { return vmlaq_s32(c, a, b); }
+};
+//32 vector registers
+const int microRows = 8;
+const int microVectors = 3;
+#include "SimdKernels.inl"
+}
+
+#endif
+
+// A GEMM micro-kernel together with its register block; see GemmKernel<T>
+// in Gemm.h for the contract of run.
+template <typename T>
+struct SimdMicroKernel {
+	int mr, nr;
+	void (*run)(int kc, const T* a, const T* b, T* c, size_t ldc, int m, int n, bool accumulate);
+};
+
+template <typename T>
+bool simdSelectMicroKernel(SimdMicroKernel<T>& kernel) {
+	switch (simdLevel()) {
+#if defined(SIMD_X86)
+	case SimdAVX512:
+		kernel.mr = simd_avx512::microRows;
+		kernel.nr = simd_avx512::microVectors * simd_avx512::Vec<T>::lanes;
+		kernel.run = &simd_avx512::micro<T>;
+		return true;
+	case SimdAVX2:
+		kernel.mr = simd_avx2::microRows;
+		kernel.nr = simd_avx2::microVectors * simd_avx2::Vec<T>::lanes;
+		kernel.run = &simd_avx2::micro<T>;
+		return true;
+	case SimdSSE:
+		kernel.mr = simd_sse::microRows;
+		kernel.nr = simd_sse::microVectors * simd_sse::Vec<T>::lanes;
+		kernel.run = &simd_sse::micro<T>;
+		return true;
+#elif defined(SIMD_NEON)
+	case SimdNEON:
+		kernel.mr = simd_neon::microRows;
+		kernel.nr = simd_neon::microVectors * simd_neon::Vec<T>::lanes;
+		kernel.run = &simd_neon::micro<T>;
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+template <typename T>
+bool simdSelectCombine(size_t n, T* dst, const T* const* src, const int* sign, int count) {
+	switch (simdLevel()) {
+#if defined(SIMD_X86)
+	case SimdAVX512:
+		simd_avx512::combine(n, dst, src, sign, count);
+		return true;
+	case SimdAVX2:
+		simd_avx2::combine(n, dst, src, sign, count);
+		return true;
+	case SimdSSE:
+		simd_sse::combine(n, dst, src, sign, count);
+		return true;
+#elif defined(SIMD_NEON)
+	case SimdNEON:
+		simd_neon::combine(n, dst, src, sign, count);
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+// Replace kernel by the vector micro-kernel for the current SIMD level.
+// Returns false, leaving kernel untouched, if there is none for T.
+template <typename T>
+inline bool simdMicroKernel(SimdMicroKernel<T>&) { return false; }
+template <>
+inline bool simdMicroKernel<int>(SimdMicroKernel<int>& kernel) { return simdSelectMicroKernel(kernel); }
+template <>
+inline bool simdMicroKernel<float>(SimdMicroKernel<float>& kernel) { return simdSelectMicroKernel(kernel); }
+template <>
+inline bool simdMicroKernel<double>(SimdMicroKernel<double>& kernel) { return simdSelectMicroKernel(kernel); }
+
+// dst[0..n) = sign[0] * src[0] + ... + sign[count - 1] * src[count - 1],
+// with signs +1 or -1. Used for the Strassen operand and result passes.
+template <typename T>
+inline void scalarCombine(size_t n, T* dst, const T* const* src, const int* sign, int count) {
+	for (size_t j = 0; j < n; j++) {
+		T acc = sign[0] < 0 ? -src[0][j] : src[0][j];
+		for (int t = 1; t < count; t++)
+			acc = sign[t] < 0 ? acc - src[t][j] : acc + src[t][j];
+		dst[j] = acc;
+	}
+}
+
+template <typename T>
+inline void simdCombine(size_t n, T* dst, const T* const* src, const int* sign, int count) {
+	scalarCombine(n, dst, src, sign, count);
+}
+template <>
+inline void simdCombine<int>(size_t n, int* dst, const int* const* src, const int* sign, int count) {
+	if (!simdSelectCombine(n, dst, src, sign, count))
+		scalarCombine(n, dst, src, sign, count);
+}
+template <>
+inline void simdCombine<float>(size_t n, float* dst, const float* const* src, const int* sign, int count) {
+	if (!simdSelectCombine(n, dst, src, sign, count))
+		scalarCombine(n, dst, src, sign, count);
+}
+template <>
+inline void simdCombine<double>(size_t n, double* dst, const double* const* src, const int* sign,
+	int count) {
+	if (!simdSelectCombine(n, dst, src, sign, count))
+		scalarCombine(n, dst, src, sign, count);
+}
@@ -0,0 +1,82 @@
+// Vector kernels shared by every instruction set in Simd.h. This file is
+// included once per instruction set, inside a namespace that defines
+// Vec<T> for that set (and, on gcc/clang, inside a target region), so it
+// has no include guard and must not be included anywhere else.
+//
+// Vec<T> provides: type, lanes, zero(), set1(x), load(p), store(p, v),
+// add(a, b), sub(a, b) and fmadd(a, b, c) = a * b + c.
+
+// dst[0..n) = sign[0] * src[0] + ... + sign[count - 1] * src[count - 1]
+// (signs are +1 or -1)
+template <typename T>
+void combine(size_t n, T* dst, const T* const* src, const int* sign, int count) {
+	typedef Vec<T> V;
+	size_t j = 0;
+	for (; j + V::lanes <= n; j += V::lanes) {
+		typename V::type acc = V::load(src[0] + j);
+		if (sign[0] < 0)
+			acc = V::sub(V::zero(), acc);
+		for (int t = 1; t < count; t++) {
+			if (sign[t] < 0)
+				acc = V::sub(acc, V::load(src[t] + j));
+			else
+				acc = V::add(acc, V::load(src[t] + j));
+		}
+		V::store(dst + j, acc);
+	}
+	for (; j < n; j++) {
+		T acc = sign[0] < 0 ? -src[0][j] : src[0][j];
+		for (int t = 1; t < count; t++)
+			acc = sign[t] < 0 ? acc - src[t][j] : acc + src[t][j];
+		dst[j] = acc;
+	}
+}
+
+// Register blocked GEMM micro-kernel, microRows x (microVectors * lanes).
+// Same contract as GemmKernel<T>::micro in Gemm.h.
+template <typename T>
+void micro(int kc, const T* a, const T* b, T* c, size_t ldc, int m, int n, bool accumulate) {
+	typedef Vec<T> V;
+	const int mr = microRows;
+	const int nv = microVectors;
+	const int nr = nv * V::lanes;
+	typename V::type acc[mr][nv];
+	int i, v;
+	for (i = 0; i < mr; i++)
+		for (v = 0; v < nv; v++)
+			acc[i][v] = V::zero();
+	for (int k = 0; k < kc; k++) {
+		typename V::type bk[nv];
+		for (v = 0; v < nv; v++)
+			bk[v] = V::load(b + v * V::lanes);
+		for (i = 0; i < mr; i++) {
+			typename V::type aik = V::set1(a[i]);
+			for (v = 0; v < nv; v++)
+				acc[i][v] = V::fmadd(aik, bk[v], acc[i][v]);
+		}
+		a += mr;
+		b += nr;
+	}
+	if (m == mr && n == nr) {
+		for (i = 0; i < mr; i++) {
+			T* row = c + i * ldc;
+			for (v = 0; v < nv; v++) {
+				if (accumulate)
+					V::store(row + v * V::lanes, V::add(V::load(row + v * V::lanes), acc[i][v]));
+				else
+					V::store(row + v * V::lanes, acc[i][v]);
+			}
+		}
+		return;
+	}
+	//edge block: spill the registers and copy the valid part
+	T tile[mr * nr];
+	for (i = 0; i < mr; i++)
+		for (v = 0; v < nv; v++)
+			V::store(tile + i * nr + v * V::lanes, acc[i][v]);
+	for (i = 0; i < m; i++) {
+		T* row = c + i * ldc;
+		for (int j = 0; j < n; j++)
+			row[j] = accumulate ? row[j] + tile[i * nr + j] : tile[i * nr + j];
+	}
+}
@@ -0,0 +1,187 @@
+#pragma once
+#include <cmath>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Matrix.h"
+#include "ThreadPool.h"
+
+// A sparse matrix in compressed sparse row (CSR) storage: the nonzeros of
+// row i are values[rowStart[i]..rowStart[i + 1]), in columns
+// columns[rowStart[i]..rowStart[i + 1]). It multiplies with dense views
+// from either side (see multiply below) in time proportional to its
+// nonzeros times the other dimension, which beats the dense recursion once
+// only a few percent of the elements are nonzero. Operands stored densely
+// with zero blocks are better left dense with a MatrixStructure.
+template <typename T>
+class SparseMatrix {
+public:
+	SparseMatrix() : rows(0), cols(0), rowStart(1, 0) {}
+
+	// The elements of dense whose magnitude is above threshold.
+	template <typename Access>
+	explicit SparseMatrix(View<T, Access>& dense, double threshold = 0)
+		: rows(dense.getRows()), cols(dense.getCols()), rowStart(1, 0) {
+		rowStart.reserve(rows + 1);
+		for (int i = 0; i < rows; i++) {
+			const T* row = dense.getRow(i);
+			for (int j = 0; j < cols; j++) {
+				if (std::fabs((double)row[j]) > threshold) {
+					columns.push_back(j);
+					values.push_back(row[j]);
+				}
+			}
+			rowStart.push_back((int)values.size());
+		}
+	}
+
+	// Take over CSR arrays built elsewhere. Throws DimensionMismatch if the
+	// arrays do not fit together and BadArrayAccess for a column out of range.
+	SparseMatrix(int r, int c, std::vector<int> starts, std::vector<int> cols_,
+		std::vector<T> values_)
+		: rows(r), cols(c), rowStart(std::move(starts)), columns(std::move(cols_)),
+		values(std::move(values_)) {
+		if ((int)rowStart.size() != rows + 1)
+			throw DimensionMismatch(rows + 1, (int)rowStart.size());
+		if (columns.size() != values.size())
+			throw DimensionMismatch((int)values.size(), (int)columns.size());
+		if (rowStart[0] != 0 || rowStart[rows] != (int)values.size())
+			throw DimensionMismatch((int)values.size(), rowStart[rows]);
+		for (int i = 0; i < rows; i++) {
+			if (rowStart[i + 1] < rowStart[i])
+				throw DimensionMismatch(rowStart[i], rowStart[i + 1]);
+			for (int e = rowStart[i]; e < rowStart[i + 1]; e++)
+				if (columns[e] < 0 || columns[e] >= cols)
+					throw BadArrayAccess(i, columns[e]);
+		}
+	}
+
+	// Write the matrix out densely into view, which must be rows x cols.
+	template <typename Access>
+	void toDense(View<T, Access>& view) const {
+		if (view.getRows() != rows)
+			throw DimensionMismatch(rows, view.getRows());
+		if (view.getCols() != cols)
+			throw DimensionMismatch(cols, view.getCols());
+		for (int i = 0; i < rows; i++) {
+			T* row = view.getRow(i);
+			for (int j = 0; j < cols; j++)
+				row[j] = T(0);
+			for (int e = rowStart[i]; e < rowStart[i + 1]; e++)
+				row[columns[e]] = values[e];
+		}
+	}
+
+	int getRows() const { return rows; }
+	int getCols() const { return cols; }
+	size_t nonzeros() const { return values.size(); }
+	double density() const {
+		return rows > 0 && cols > 0 ? (double)values.size() / ((double)rows * cols) : 0.0;
+	}
+	const int* getRowStart() const { return rowStart.data(); }
+	const int* getColumns() const { return columns.data(); }
+	const T* getValues() const { return values.data(); }
+private:
+	int rows, cols;
+	std::vector<int> rowStart;
+	std::vector<int> columns;
+	std::vector<T> values;
+};
+
+// c = alpha * a * b + beta * c for a sparse m x k a and a dense k x n b,
+// row by row of c in parallel on pool: each nonzero a_ip adds alpha * a_ip
+// times row p of b. c is not read when beta == 0. Throws DimensionMismatch
+// if the shapes do not fit together.
+template <typename T, typename Access>
+void multiply(const SparseMatrix<T>& a, View<T, Access>& b, View<T, Access>& c,
+	typename std::common_type<T>::type alpha, typename std::common_type<T>::type beta,
+	ThreadPool& pool = ThreadPool::global()) {
+	if (b.getRows() != a.getCols())
+		throw DimensionMismatch(a.getCols(), b.getRows());
+	if (c.getRows() != a.getRows())
+		throw DimensionMismatch(a.getRows(), c.getRows());
+	if (c.getCols() != b.getCols())
+		throw DimensionMismatch(b.getCols(), c.getCols());
+	const int n = b.getCols();
+	const int* starts = a.getRowStart();
+	const int* columns = a.getColumns();
+	const T* values = a.getValues();
+	//rows per task so that a task does about 16384 multiply adds
+	const size_t work = (a.nonzeros() / (a.getRows() > 0 ? a.getRows() : 1) + 1) * (n > 0 ? n : 1);
+	const int grain = work < 16384 ? (int)(16384 / work) : 1;
+	pool.parallelFor(0, a.getRows(), grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			T* row = c.getRow(i);
+			int j;
+			if (beta == T(0)) {
+				for (j = 0; j < n; j++)
+					row[j] = T(0);
+			}
+			else if (beta != T(1)) {
+				for (j = 0; j < n; j++)
+					row[j] *= beta;
+			}
+			for (int e = starts[i]; e < starts[i + 1]; e++) {
+				const T factor = alpha * values[e];
+				const T* from = b.getRow(columns[e]);
+				for (j = 0; j < n; j++)
+					row[j] += factor * from[j];
+			}
+		}
+	});
+}
+
+// c = alpha * a * b + beta * c for a dense m x k a and a sparse k x n b,
+// row by row of c in parallel on pool: each element a_ip that is not zero
+// adds alpha * a_ip times the nonzeros of row p of b.
+template <typename T, typename Access>
+void multiply(View<T, Access>& a, const SparseMatrix<T>& b, View<T, Access>& c,
+	typename std::common_type<T>::type alpha, typename std::common_type<T>::type beta,
+	ThreadPool& pool = ThreadPool::global()) {
+	if (b.getRows() != a.getCols())
+		throw DimensionMismatch(a.getCols(), b.getRows());
+	if (c.getRows() != a.getRows())
+		throw DimensionMismatch(a.getRows(), c.getRows());
+	if (c.getCols() != b.getCols())
+		throw DimensionMismatch(b.getCols(), c.getCols());
+	const int k = a.getCols(), n = b.getCols();
+	const int* starts = b.getRowStart();
+	const int* columns = b.getColumns();
+	const T* values = b.getValues();
+	const size_t work = (size_t)(k > 0 ? k : 1) + b.nonzeros() + (size_t)n;
+	const int grain = work < 16384 ? (int)(16384 / work) : 1;
+	pool.parallelFor(0, a.getRows(), grain, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			const T* ai = a.getRow(i);
+			T* row = c.getRow(i);
+			int j;
+			if (beta == T(0)) {
+				for (j = 0; j < n; j++)
+					row[j] = T(0);
+			}
+			else if (beta != T(1)) {
+				for (j = 0; j < n; j++)
+					row[j] *= beta;
+			}
+			for (int p = 0; p < k; p++) {
+				if (ai[p] == T(0))
+					continue;
+				const T factor = alpha * ai[p];
+				for (int e = starts[p]; e < starts[p + 1]; e++)
+					row[columns[e]] += factor * values[e];
+			}
+		}
+	});
+}
+
+// c = a * b with a or b sparse.
+template <typename T, typename Access>
+void multiply(const SparseMatrix<T>& a, View<T, Access>& b, View<T, Access>& c) {
+	multiply(a, b, c, T(1), T(0));
+}
+
+template <typename T, typename Access>
+void multiply(View<T, Access>& a, const SparseMatrix<T>& b, View<T, Access>& c) {
+	multiply(a, b, c, T(1), T(0));
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+#include "ThreadPool.h"
+
+// Block occupancy of a matrix, for skipping work on structured operands.
+// The matrix is cut into tile x tile blocks and each is classified as zero,
+// identity (a block on the diagonal that is exactly I there) or occupied.
+// A view that carries the structure of the matrix it looks into (see
+// View::withStructure) lets the recursion behind P_Strassen and Multiply
+// answer in O(1) whether one of its blocks is zero or the identity: zero
+// operands leave beta * c, identity ones copy the other operand, and
+// Strassen steps with zero quadrants (as in block diagonal or triangular
+// operands) run only the block products that are not zero. The answers are
+// conservative: a partly covered tile counts as occupied unless it is zero.
+// The structure describes the elements at the time it was built; it is up
+// to the caller to build a new one when they change.
+class MatrixStructure {
+public:
+	template <typename T>
+	MatrixStructure(const T* data, size_t ld, int r, int c, int tileSize = 64,
+		ThreadPool& pool = ThreadPool::global())
+		: rows(r), cols(c), tile(tileSize > 0 ? tileSize : 64) {
+		tileRows = (rows + tile - 1) / tile;
+		tileCols = (cols + tile - 1) / tile;
+		std::vector<char> kind((size_t)tileRows * tileCols, 0);
+		pool.parallelFor(0, tileRows, 1, [&](int lo, int hi) {
+			for (int ti = lo; ti < hi; ti++)
+				for (int tj = 0; tj < tileCols; tj++)
+					kind[(size_t)ti * tileCols + tj] = classify(data, ld, ti, tj);
+		});
+		//summed area table of the occupied tiles, prefix counts of the
+		//identity ones along the diagonal
+		occupied.assign((size_t)(tileRows + 1) * (tileCols + 1), 0);
+		for (int ti = 0; ti < tileRows; ti++)
+			for (int tj = 0; tj < tileCols; tj++)
+				occupied[at(ti + 1, tj + 1)] = (kind[(size_t)ti * tileCols + tj] != zeroTile) +
+					occupied[at(ti, tj + 1)] + occupied[at(ti + 1, tj)] - occupied[at(ti, tj)];
+		const int diagonal = tileRows < tileCols ? tileRows : tileCols;
+		identities.assign(diagonal + 1, 0);
+		for (int t = 0; t < diagonal; t++)
+			identities[t + 1] = identities[t] + (kind[(size_t)t * tileCols + t] == identityTile);
+	}
+
+	// true if the count x width block at (row, col) is known to be all zero
+	bool zero(int row, int col, int count, int width) const {
+		if (count <= 0 || width <= 0)
+			return true;
+		return occupiedTiles(row / tile, col / tile, (row + count - 1) / tile,
+			(col + width - 1) / tile) == 0;
+	}
+
+	// true if the size x size block at (row, row) on the diagonal is known
+	// to be the identity
+	bool identity(int row, int size) const {
+		if (size <= 0)
+			return false;
+		const int first = row / tile, last = (row + size - 1) / tile;
+		if (last >= (int)identities.size() - 1)
+			return false;
+		const int diagonal = identities[last + 1] - identities[first];
+		return diagonal == last - first + 1 && occupiedTiles(first, first, last, last) == diagonal;
+	}
+
+	int getRows() const { return rows; }
+	int getCols() const { return cols; }
+	int getTile() const { return tile; }
+	// occupied tiles over all tiles
+	double density() const {
+		const size_t tiles = (size_t)tileRows * tileCols;
+		return tiles > 0 ? (double)occupied[at(tileRows, tileCols)] / tiles : 0.0;
+	}
+private:
+	enum { zeroTile, identityTile, occupiedTile };
+	int rows, cols, tile, tileRows, tileCols;
+	std::vector<int> occupied;
+	std::vector<int> identities;
+
+	size_t at(int ti, int tj) const { return (size_t)ti * (tileCols + 1) + tj; }
+
+	//occupied tiles in the tile rows first..last and columns left..right
+	int occupiedTiles(int first, int left, int last, int right) const {
+		return occupied[at(last + 1, right + 1)] - occupied[at(first, right + 1)] -
+			occupied[at(last + 1, left)] + occupied[at(first, left)];
+	}
+
+	template <typename T>
+	char classify(const T* data, size_t ld, int ti, int tj) const {
+		const int r0 = ti * tile, c0 = tj * tile;
+		const int r1 = r0 + tile < rows ? r0 + tile : rows, c1 = c0 + tile < cols ? c0 + tile : cols;
+		bool zero = true, identity = ti == tj;
+		for (int i = r0; i < r1 && (zero || identity); i++) {
+			const T* row = data + i * ld;
+			for (int j = c0; j < c1; j++) {
+				if (row[j] != T(0))
+					zero = false;
+				if (row[j] != T(i == j ? 1 : 0))
+					identity = false;
+			}
+		}
+		return zero ? (char)zeroTile : identity ? (char)identityTile : (char)occupiedTile;
+	}
+};
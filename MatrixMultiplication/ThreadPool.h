@@ -0,0 +1,442 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Topology.h"
+#include "Trace.h"
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Work stealing thread pool used to run P_Strassen as a task graph. Every
+// worker owns a deque: it pushes and pops its own tasks at the back and idle
+// workers steal from the front of the others; threads outside the pool
+// share one more deque, which they treat as their own. A thread that waits
+// for a TaskGroup runs queued tasks until the group is done, so tasks may
+// spawn and wait for subtasks at any depth without tying up threads, and
+// the recursion depth does not depend on the thread count. Every task a
+// waiting thread runs puts its frames on top of the wait; past
+// maxWaitNesting nested waits a thread only runs tasks of the group it
+// waits for, which are smaller than the task that is waiting, so the stack
+// grows with the depth of the task tree and not with the number of tasks.
+//
+// A pinned pool is also laid out by the core groups of the machine (see
+// Topology.h): its threads fill one group after another, the fastest
+// first, and an idle thread steals from the threads of its own group
+// before it steals from other groups, so the tasks a subtree spawns stay
+// under the cache the subtree works in for as long as its group keeps up.
+// submit can aim a task at a group, and distribute() says how to spread
+// equal tasks over the groups by capacity.
+
+class ThreadPool;
+
+// Waits a thread may nest while running any queued task; deeper ones only
+// run tasks of the group they wait for.
+const int maxWaitNesting = 16;
+
+// Settings of ThreadPool::global(), read when it is first used.
+struct ThreadPoolOptions {
+	int threads;	// 0 means one per hardware thread
+	bool pin;		// bind every worker to one hardware thread, by core groups
+};
+
+inline ThreadPoolOptions& threadPoolDefaults() {
+	static ThreadPoolOptions options = { 0, false };
+	return options;
+}
+
+// Counts the outstanding tasks of one fork/join step. The first exception
+// thrown by a task of the group is rethrown by ThreadPool::wait.
+class TaskGroup {
+public:
+	TaskGroup() : pending(0) {}
+
+	bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+private:
+	friend class ThreadPool;
+	std::atomic<int> pending;
+	std::mutex errorLock;
+	std::exception_ptr error;
+
+	TaskGroup(const TaskGroup& other);
+	TaskGroup& operator=(const TaskGroup& other);
+};
+
+class ThreadPool {
+public:
+	// threads is the number of threads that run tasks, counting the thread
+	// that waits; 0 means one per hardware thread. With pin, the hardware
+	// threads are taken group by group in the order of coreGroups(), and
+	// worker i is bound to hardware thread i + 1 of that order (modulo
+	// their number), leaving the first one to the thread that created the
+	// pool. An unpinned pool is one group.
+	explicit ThreadPool(int threads = 0, bool pin = false) : queued(0), stopping(false),
+		nextQueue(0) {
+		setUp(threads, pin, pin ? coreGroups() : std::vector<CoreGroup>());
+	}
+	// A pinned pool laid out by the given groups instead of those detected.
+	ThreadPool(int threads, const std::vector<CoreGroup>& layout) : queued(0), stopping(false),
+		nextQueue(0) {
+		setUp(threads, true, layout);
+	}
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleepLock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	int size() const { return (int)workers.size() + 1; }
+
+	// Core groups the threads of the pool are in, and the estimated
+	// throughput of the pool's threads in group g.
+	int groups() const { return (int)capacities.size(); }
+	double capacity(int g) const { return capacities[g]; }
+	// Group of the calling thread; threads outside the pool count as the
+	// first group, where the thread that created the pool was left.
+	int currentGroup() const {
+		const int index = currentIndex();
+		return queueGroup[index < 0 ? workers.size() : (size_t)index];
+	}
+	// Threads of core group coreGroup that are looking for work right now:
+	// asleep, or waiting for a group with nothing left to run. A hint, out
+	// of date when it returns; good for deciding whether to split work, not
+	// for anything that must be exact.
+	int idleThreads(int coreGroup) const { return idle[coreGroup].load(std::memory_order_relaxed); }
+	// Tasks queued and not started yet; a hint in the same way.
+	int queuedTasks() const { return queued.load(std::memory_order_relaxed); }
+
+	// The groups to give count tasks of equal cost so that each group gets
+	// a share in proportion to its capacity; the last task goes to the
+	// group of the calling thread, which is meant to run it itself.
+	void distribute(int count, int* groupOf) const {
+		std::vector<int> load(capacities.size(), 0);
+		if (count <= 0)
+			return;
+		groupOf[count - 1] = currentGroup();
+		load[groupOf[count - 1]]++;
+		for (int t = 0; t < count - 1; t++) {
+			int best = 0;
+			for (int g = 1; g < (int)capacities.size(); g++)
+				if ((load[g] + 1) / capacities[g] < (load[best] + 1) / capacities[best])
+					best = g;
+			groupOf[t] = best;
+			load[best]++;
+		}
+	}
+
+	void submit(TaskGroup& group, std::function<void()> task) {
+		submitTo(group, std::move(task), currentIndex());
+	}
+
+	// Queue task with one of the threads of core group coreGroup (the
+	// calling thread itself if it is in that group). The threads of the
+	// group take it before anything of other groups, others only when
+	// they run out of work.
+	void submit(TaskGroup& group, std::function<void()> task, int coreGroup) {
+		const int self = currentIndex();
+		const std::vector<int>& members = groupQueues[coreGroup];
+		int index = self;
+		if (self < 0 || queueGroup[self] != coreGroup)
+			index = members[nextQueue.fetch_add(1, std::memory_order_relaxed) % members.size()];
+		submitTo(group, std::move(task), index);
+	}
+
+	// Block until every task of group has finished, running queued tasks
+	// (of any group, or only of group when waits are nested deeply) in the
+	// meantime.
+	void wait(TaskGroup& group) {
+		const int self = currentIndex();
+		std::atomic<int>& lookingIn = idle[queueGroup[self < 0 ? workers.size() : (size_t)self]];
+		const TaskGroup* only = slot().waits >= maxWaitNesting ? &group : nullptr;
+		Nesting nesting;
+		TraceIdle trace;
+		bool looking = false;
+		while (!group.done()) {
+			if (runOne(self, only)) {
+				trace.busy();
+				if (looking)
+					lookingIn.fetch_sub(1, std::memory_order_relaxed);
+				looking = false;
+			}
+			else {
+				trace.idle();
+				if (!looking)
+					lookingIn.fetch_add(1, std::memory_order_relaxed);
+				looking = true;
+				std::this_thread::yield();
+			}
+		}
+		trace.busy();
+		if (looking)
+			lookingIn.fetch_sub(1, std::memory_order_relaxed);
+		if (group.error) {
+			std::exception_ptr error = group.error;
+			group.error = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+	// Call body(lo, hi) on disjoint subranges covering [begin, end), each at
+	// least grain long (except the last), and wait for all of them.
+	template <typename F>
+	void parallelFor(int begin, int end, int grain, const F& body) {
+		const int n = end - begin;
+		if (n <= 0)
+			return;
+		const int tasks = size() * 4;
+		int chunk = (n + tasks - 1) / tasks;
+		if (chunk < grain)
+			chunk = grain;
+		if (chunk >= n) {
+			body(begin, end);
+			return;
+		}
+		TaskGroup group;
+		int lo = begin;
+		for (; lo + chunk < end; lo += chunk) {
+			const int hi = lo + chunk;
+			submit(group, [&body, lo, hi]() { body(lo, hi); });
+		}
+		//the calling thread takes the last chunk itself
+		std::exception_ptr error;
+		try {
+			body(lo, end);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		wait(group);
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	// Pool shared by everything that is not given one explicitly. It lives
+	// until the program exits; threadPoolDefaults() sets it up.
+	static ThreadPool& global() {
+		static ThreadPool pool(threadPoolDefaults().threads, threadPoolDefaults().pin);
+		return pool;
+	}
+private:
+	struct Task {
+		Task() : group(nullptr) {}
+		Task(TaskGroup* g, std::function<void()> f) : group(g), run(std::move(f)) {}
+		TaskGroup* group;
+		std::function<void()> run;
+	};
+	struct Queue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+	// Which queue of which pool the current thread owns, and how many waits
+	// it has nested
+	struct Slot {
+		const ThreadPool* pool;
+		int index;
+		int waits;
+	};
+	struct Nesting {
+		Nesting() { slot().waits++; }
+		~Nesting() { slot().waits--; }
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+	//core group of every queue, the queues of every group and the
+	//capacity of the pool's threads in it
+	std::vector<int> queueGroup;
+	std::vector<std::vector<int>> groupQueues;
+	std::vector<double> capacities;
+	std::atomic<int> queued;
+	//threads looking for work, per core group
+	std::unique_ptr<std::atomic<int>[]> idle;
+	bool stopping;
+	std::mutex sleepLock;
+	std::condition_variable wake;
+	std::atomic<unsigned> nextQueue;
+
+	void setUp(int threads, bool pin, const std::vector<CoreGroup>& layout) {
+		if (threads <= 0)
+			threads = (int)std::thread::hardware_concurrency();
+		if (threads <= 0)
+			threads = 1;
+		//hardware threads group by group; position 0 is the creating thread,
+		//whose queue is the last one (for threads outside the pool), worker i
+		//is at position i + 1
+		std::vector<int> order, groupAt;
+		std::vector<double> speed;
+		for (size_t g = 0; pin && g < layout.size(); g++)
+			for (size_t i = 0; i < layout[g].cpus.size(); i++) {
+				order.push_back(layout[g].cpus[i]);
+				groupAt.push_back((int)g);
+				speed.push_back(layout[g].capacity / layout[g].cpus.size());
+			}
+		//groups are numbered as the positions reach them, leaving out those
+		//without a thread of the pool
+		std::vector<int> number(layout.size() + 1, -1);
+		queueGroup.assign(threads, 0);
+		for (int position = 0; position < threads; position++) {
+			const int q = position == 0 ? threads - 1 : position - 1;
+			const int g = order.empty() ? 0 : groupAt[position % order.size()];
+			if (number[g] < 0) {
+				number[g] = (int)groupQueues.size();
+				groupQueues.push_back(std::vector<int>());
+				capacities.push_back(0.0);
+			}
+			queueGroup[q] = number[g];
+			groupQueues[number[g]].push_back(q);
+			capacities[number[g]] += order.empty() ? 1.0 : speed[position % order.size()];
+		}
+		idle.reset(new std::atomic<int>[groupQueues.size()]);
+		for (size_t g = 0; g < groupQueues.size(); g++)
+			idle[g].store(0, std::memory_order_relaxed);
+		//one deque per worker plus one for threads outside the pool
+		for (int i = 0; i < threads; i++)
+			queues.push_back(std::unique_ptr<Queue>(new Queue));
+		for (int i = 0; i < threads - 1; i++) {
+			workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+			if (pin)
+				pinThread(workers.back(), order.empty() ? i + 1 : order[(i + 1) % order.size()]);
+		}
+	}
+
+	void submitTo(TaskGroup& group, std::function<void()> task, int index) {
+		group.pending.fetch_add(1, std::memory_order_relaxed);
+		if (index < 0)
+			index = (int)workers.size();
+		{
+			std::lock_guard<std::mutex> lock(queues[index]->lock);
+			queues[index]->tasks.push_back(Task(&group, std::move(task)));
+		}
+		queued.fetch_add(1, std::memory_order_release);
+		{
+			std::lock_guard<std::mutex> lock(sleepLock);
+		}
+		wake.notify_one();
+	}
+
+	//bind thread to hardware thread cpu, where the platform allows it
+	static void pinThread(std::thread& thread, int cpu) {
+		const unsigned hardware = std::thread::hardware_concurrency();
+		if (hardware == 0)
+			return;
+		cpu %= (int)hardware;
+#if defined(_WIN32)
+		if (cpu < (int)(sizeof(DWORD_PTR) * 8))
+			SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << cpu);
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+		(void)thread;
+#endif
+	}
+
+	static Slot& slot() {
+		thread_local Slot current = { nullptr, -1, 0 };
+		return current;
+	}
+	int currentIndex() const {
+		const Slot& current = slot();
+		return current.pool == this ? current.index : -1;
+	}
+
+	//take the newest (back) or oldest task of queue index, of group only
+	//unless that is nullptr
+	bool pop(int index, bool back, const TaskGroup* only, Task& task) {
+		Queue& queue = *queues[index];
+		std::lock_guard<std::mutex> lock(queue.lock);
+		const size_t count = queue.tasks.size();
+		for (size_t i = 0; i < count; i++) {
+			const size_t at = back ? count - 1 - i : i;
+			if (only && queue.tasks[at].group != only)
+				continue;
+			task = std::move(queue.tasks[at]);
+			queue.tasks.erase(queue.tasks.begin() + at);
+			return true;
+		}
+		return false;
+	}
+
+	//run one queued task (of group only, unless that is nullptr): our own
+	//newest first, else steal the oldest one of another queue, in our core
+	//group before the others; returns false if there was nothing to run
+	bool runOne(int self, const TaskGroup* only = nullptr) {
+		if (queued.load(std::memory_order_acquire) == 0)
+			return false;
+		Task task;
+		const int count = (int)queues.size();
+		//threads outside the pool own the last queue together
+		const int own = self < 0 ? count - 1 : self;
+		bool found = pop(own, true, only, task);
+		const int start = (int)(nextQueue.fetch_add(1, std::memory_order_relaxed) % count);
+		const int home = queueGroup[own];
+		for (int pass = 0; pass < 2 && !found; pass++) {
+			for (int i = 0; i < count && !found; i++) {
+				const int victim = (start + i) % count;
+				if (victim != own && (queueGroup[victim] == home) == (pass == 0))
+					found = pop(victim, false, only, task);
+			}
+		}
+		if (!found)
+			return false;
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		execute(task);
+		return true;
+	}
+
+	static void execute(Task& task) {
+		MATRIX_TRACE_SPAN(span, "task", -1);
+		try {
+			task.run();
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(task.group->errorLock);
+			if (!task.group->error)
+				task.group->error = std::current_exception();
+		}
+		task.group->pending.fetch_sub(1, std::memory_order_release);
+	}
+
+	void workerLoop(int index) {
+		slot().pool = this;
+		slot().index = index;
+		for (;;) {
+			if (runOne(index))
+				continue;
+			TraceIdle trace;
+			trace.idle();
+			idle[queueGroup[index]].fetch_add(1, std::memory_order_relaxed);
+			std::unique_lock<std::mutex> lock(sleepLock);
+			wake.wait(lock, [this]() { return stopping || queued.load() > 0; });
+			lock.unlock();
+			idle[queueGroup[index]].fetch_sub(1, std::memory_order_relaxed);
+			trace.busy();
+			if (stopping)
+				return;
+		}
+	}
+
+	ThreadPool(const ThreadPool& other);
+	ThreadPool& operator=(const ThreadPool& other);
+};
@@ -0,0 +1,180 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+// Which hardware threads share a last level cache, and how fast they are.
+// ThreadPool places its pinned workers group by group and steals inside a
+// group before it steals from another one, and P_Strassen spreads the
+// sub-products of its first Strassen step over the groups by capacity.
+// Detected from the cache descriptions in /sys on Linux and from
+// GetLogicalProcessorInformationEx on Windows (processor group 0 only, as
+// for pinning); elsewhere, or when that fails, all hardware threads form
+// one group.
+
+// Hardware threads sharing a last level cache: one L3, one CCX of a
+// chiplet part, one cluster of efficiency cores.
+struct CoreGroup {
+	std::vector<int> cpus;	// hardware thread numbers, in increasing order
+	double capacity;		// estimated throughput, 1 per full speed hardware thread
+};
+
+// Relative speed given to efficiency cores when the system only tells
+// them apart from performance cores, not how fast they are.
+const double efficiencyCoreSpeed = 0.5;
+
+//cpus of a Linux cpu list such as "0-3,8,10-11"
+inline std::vector<int> parseCpuList(const std::string& list) {
+	std::vector<int> cpus;
+	std::stringstream stream(list);
+	std::string range;
+	while (std::getline(stream, range, ',')) {
+		if (range.empty() || range[0] < '0' || range[0] > '9')
+			continue;
+		int first = 0, last = 0;
+		const size_t dash = range.find('-');
+		std::stringstream(range.substr(0, dash)) >> first;
+		if (dash == std::string::npos)
+			last = first;
+		else
+			std::stringstream(range.substr(dash + 1)) >> last;
+		for (int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+//the first line of a file, empty if it cannot be read
+inline std::string readLine(const std::string& path) {
+	std::ifstream file(path.c_str());
+	std::string line;
+	if (file)
+		std::getline(file, line);
+	return line;
+}
+
+// Detect the core groups of this machine; the fastest groups (by capacity
+// per hardware thread) come first, the others in order of their first cpu.
+inline std::vector<CoreGroup> detectCoreGroups() {
+	const int hardware = (int)std::thread::hardware_concurrency() > 0 ?
+		(int)std::thread::hardware_concurrency() : 1;
+	std::vector<CoreGroup> groups;
+	std::vector<double> speed(hardware, 1.0);
+#if defined(__linux__)
+	//the cpus sharing the highest level data or unified cache with each cpu
+	std::map<std::string, std::vector<int> > shared;
+	const std::vector<int> atoms = parseCpuList(readLine("/sys/devices/cpu_atom/cpus"));
+	for (int cpu = 0; cpu < hardware; cpu++) {
+		const std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+		std::string list;
+		int best = 0;
+		for (int index = 0;; index++) {
+			const std::string cache = base + "/cache/index" + std::to_string(index);
+			const std::string level = readLine(cache + "/level");
+			if (level.empty())
+				break;
+			if (readLine(cache + "/type") != "Instruction" && std::stoi(level) > best) {
+				best = std::stoi(level);
+				list = readLine(cache + "/shared_cpu_list");
+			}
+		}
+		if (list.empty()) {
+			shared.clear();
+			break;
+		}
+		shared[list].push_back(cpu);
+		const std::string capacity = readLine(base + "/cpu_capacity");
+		if (!capacity.empty())
+			speed[cpu] = std::stoi(capacity) / 1024.0;
+		else if (std::find(atoms.begin(), atoms.end(), cpu) != atoms.end())
+			speed[cpu] = efficiencyCoreSpeed;
+	}
+	for (std::map<std::string, std::vector<int> >::iterator i = shared.begin(); i != shared.end(); ++i) {
+		CoreGroup group = { i->second, 0.0 };
+		groups.push_back(group);
+	}
+#elif defined(_WIN32)
+	DWORD length = 0;
+	GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+	std::vector<char> buffer(length);
+	if (length > 0 && GetLogicalProcessorInformationEx(RelationAll,
+		(PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer.data(), &length)) {
+		std::vector<int> efficiency(hardware, 0);
+		int slowest = -1, fastest = -1;
+		for (DWORD offset = 0; offset < length;) {
+			const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info =
+				(const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer.data() + offset);
+			if (info->Relationship == RelationCache && info->Cache.Level == 3 &&
+				info->Cache.Type != CacheInstruction && info->Cache.GroupMask.Group == 0) {
+				CoreGroup group = { std::vector<int>(), 0.0 };
+				for (int cpu = 0; cpu < hardware && cpu < (int)(sizeof(KAFFINITY) * 8); cpu++)
+					if (info->Cache.GroupMask.Mask & ((KAFFINITY)1 << cpu))
+						group.cpus.push_back(cpu);
+				if (!group.cpus.empty())
+					groups.push_back(group);
+			}
+			else if (info->Relationship == RelationProcessorCore && info->Processor.GroupCount > 0 &&
+				info->Processor.GroupMask[0].Group == 0) {
+				const int level = info->Processor.EfficiencyClass;
+				slowest = slowest < 0 || level < slowest ? level : slowest;
+				fastest = level > fastest ? level : fastest;
+				for (int cpu = 0; cpu < hardware && cpu < (int)(sizeof(KAFFINITY) * 8); cpu++)
+					if (info->Processor.GroupMask[0].Mask & ((KAFFINITY)1 << cpu))
+						efficiency[cpu] = level;
+			}
+			offset += info->Size;
+		}
+		//efficiency classes only rank the cores: the top class runs at full
+		//speed, the others are taken as efficiency cores
+		for (int cpu = 0; cpu < hardware && slowest < fastest; cpu++)
+			if (efficiency[cpu] < fastest)
+				speed[cpu] = efficiencyCoreSpeed;
+	}
+#endif
+	//every hardware thread in exactly one group, or else one group of all
+	std::vector<int> seen(hardware, 0);
+	bool complete = !groups.empty();
+	for (size_t g = 0; g < groups.size(); g++)
+		for (size_t i = 0; i < groups[g].cpus.size(); i++) {
+			const int cpu = groups[g].cpus[i];
+			if (cpu >= hardware || seen[cpu]++)
+				complete = false;
+		}
+	for (int cpu = 0; cpu < hardware && complete; cpu++)
+		complete = seen[cpu] == 1;
+	if (!complete) {
+		CoreGroup all = { std::vector<int>(), 0.0 };
+		for (int cpu = 0; cpu < hardware; cpu++)
+			all.cpus.push_back(cpu);
+		groups.assign(1, all);
+	}
+	for (size_t g = 0; g < groups.size(); g++) {
+		std::sort(groups[g].cpus.begin(), groups[g].cpus.end());
+		for (size_t i = 0; i < groups[g].cpus.size(); i++)
+			groups[g].capacity += speed[groups[g].cpus[i]];
+	}
+	std::stable_sort(groups.begin(), groups.end(), [](const CoreGroup& x, const CoreGroup& y) {
+		const double fx = x.capacity / x.cpus.size(), fy = y.capacity / y.cpus.size();
+		return fx != fy ? fx > fy : x.cpus[0] < y.cpus[0];
+	});
+	return groups;
+}
+
+// The core groups of this machine, detected once.
+inline const std::vector<CoreGroup>& coreGroups() {
+	static const std::vector<CoreGroup> groups = detectCoreGroups();
+	return groups;
+}
@@ -0,0 +1,351 @@
+#pragma once
+
+// Optional tracing of the multiplication: timed spans per recursion level
+// (workspace allocation, operand sums, sub-products, combination passes and
+// leaf kernels with their flop counts), counters such as the bytes taken
+// from the allocator, and the busy and idle stretches of every thread of a
+// ThreadPool. Define MATRIX_TRACE to 1 to compile it in; otherwise the
+// MATRIX_TRACE_ macros expand to nothing and TraceIdle is an empty class,
+// so the hot paths carry no trace code at all. On Linux MATRIX_TRACE_PERF
+// additionally reads the cache misses and retired instructions of the
+// calling thread through perf_event_open at both ends of every span (which
+// needs perf_event_paranoid to allow it; without that the counters are
+// reported as missing).
+//
+// Every thread appends to a buffer of its own, so recording takes no locks.
+// traceReport and traceWriteChrome read all buffers and must only be called
+// while no traced work is running; traceWriteChrome writes the JSON trace
+// event format that chrome://tracing and Perfetto (ui.perfetto.dev) load.
+
+#ifndef MATRIX_TRACE
+#define MATRIX_TRACE 0
+#endif
+
+#if MATRIX_TRACE
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#if MATRIX_TRACE_PERF && defined(__linux__)
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct TraceEvent {
+	const char* name;
+	char kind;				// 'X' span, 'I' idle stretch, 'C' counter
+	int level;				// recursion level, -1 outside the recursion
+	long long begin, end;	// ns since the trace started; a counter has its time in begin
+	double value;			// flops of a span, running total of a counter
+	long long misses, instructions;	// hardware counter deltas, -1 when not read
+};
+
+// Hardware counters of one thread, opened on its first event.
+class TracePerf {
+public:
+	TracePerf() : leader(-1), second(-1) {
+#if MATRIX_TRACE_PERF && defined(__linux__)
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		leader = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (leader >= 0) {
+			attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+			second = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+		}
+#endif
+	}
+	~TracePerf() {
+#if MATRIX_TRACE_PERF && defined(__linux__)
+		if (second >= 0)
+			close(second);
+		if (leader >= 0)
+			close(leader);
+#endif
+	}
+
+	//cache misses and instructions so far, or false without counters
+	bool read(long long& misses, long long& instructions) const {
+#if MATRIX_TRACE_PERF && defined(__linux__)
+		unsigned long long values[3];
+		if (leader >= 0 && second >= 0 && ::read(leader, values, sizeof(values)) == (ssize_t)sizeof(values)) {
+			misses = (long long)values[1];
+			instructions = (long long)values[2];
+			return true;
+		}
+#endif
+		misses = instructions = -1;
+		return false;
+	}
+private:
+	int leader, second;
+
+	TracePerf(const TracePerf& other);
+	TracePerf& operator=(const TracePerf& other);
+};
+
+// Events of one thread. The buffers belong to the registry, so they outlive
+// the threads (for example the workers of a pool that has been destroyed).
+struct TraceThread {
+	int id;
+	std::vector<TraceEvent> events;
+};
+
+class TraceRegistry {
+public:
+	TraceRegistry() : epoch(std::chrono::steady_clock::now()) {}
+
+	long long now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - epoch).count();
+	}
+	TraceThread* add() {
+		std::lock_guard<std::mutex> lock(guard);
+		threads.push_back(std::unique_ptr<TraceThread>(new TraceThread));
+		threads.back()->id = (int)threads.size();
+		return threads.back().get();
+	}
+	std::mutex guard;
+	std::vector<std::unique_ptr<TraceThread>> threads;
+	std::mutex counterLock;
+	std::map<std::string, double> counters;
+private:
+	std::chrono::steady_clock::time_point epoch;
+};
+
+inline TraceRegistry& traceRegistry() {
+	static TraceRegistry registry;
+	return registry;
+}
+
+inline TraceThread& traceThread() {
+	thread_local TraceThread* current = traceRegistry().add();
+	return *current;
+}
+
+inline const TracePerf& tracePerf() {
+	thread_local TracePerf perf;
+	return perf;
+}
+
+// A timed span, recorded when it is destroyed or finished.
+class TraceSpan {
+public:
+	TraceSpan(const char* name, int level, double flops = 0) : open(true) {
+		event.name = name;
+		event.kind = 'X';
+		event.level = level;
+		event.value = flops;
+		tracePerf().read(event.misses, event.instructions);
+		event.begin = traceRegistry().now();
+	}
+	~TraceSpan() { finish(); }
+
+	void finish() {
+		if (!open)
+			return;
+		open = false;
+		event.end = traceRegistry().now();
+		long long misses, instructions;
+		if (tracePerf().read(misses, instructions)) {
+			event.misses = misses - event.misses;
+			event.instructions = instructions - event.instructions;
+		}
+		traceThread().events.push_back(event);
+	}
+private:
+	TraceEvent event;
+	bool open;
+
+	TraceSpan(const TraceSpan& other);
+	TraceSpan& operator=(const TraceSpan& other);
+};
+
+// Marks the stretches in which a thread has nothing to run: idle() at every
+// fruitless look for work, busy() once there is some again.
+class TraceIdle {
+public:
+	TraceIdle() : since(-1) {}
+	~TraceIdle() { busy(); }
+
+	void idle() {
+		if (since < 0)
+			since = traceRegistry().now();
+	}
+	void busy() {
+		if (since < 0)
+			return;
+		const TraceEvent event = { "idle", 'I', -1, since, traceRegistry().now(), 0, -1, -1 };
+		traceThread().events.push_back(event);
+		since = -1;
+	}
+private:
+	long long since;
+};
+
+// Add delta to the counter name and record its new value.
+inline void traceCount(const char* name, double delta) {
+	TraceRegistry& registry = traceRegistry();
+	double total;
+	{
+		std::lock_guard<std::mutex> lock(registry.counterLock);
+		total = registry.counters[name] += delta;
+	}
+	const TraceEvent event = { name, 'C', -1, registry.now(), 0, total, -1, -1 };
+	traceThread().events.push_back(event);
+}
+
+// Drop everything recorded so far.
+inline void traceReset() {
+	TraceRegistry& registry = traceRegistry();
+	std::lock_guard<std::mutex> lock(registry.guard);
+	for (size_t i = 0; i < registry.threads.size(); i++)
+		registry.threads[i]->events.clear();
+	std::lock_guard<std::mutex> counters(registry.counterLock);
+	registry.counters.clear();
+}
+
+// Totals per span name and level (with the GFLOP/s of spans that count
+// flops), the busy share of every thread between its first and its last
+// event, and the final value of every counter.
+inline void traceReport(std::ostream& out) {
+	struct Total {
+		Total() : count(0), ns(0), flops(0), misses(-1), instructions(-1) {}
+		long long count, ns;
+		double flops;
+		long long misses, instructions;	// -1 while no span had counters
+	};
+	TraceRegistry& registry = traceRegistry();
+	std::lock_guard<std::mutex> lock(registry.guard);
+	std::map<std::pair<int, std::string>, Total> totals;
+	out << std::fixed << std::setprecision(3);
+	out << "thread   busy %     busy ms   lifetime ms\n";
+	for (size_t t = 0; t < registry.threads.size(); t++) {
+		const std::vector<TraceEvent>& events = registry.threads[t]->events;
+		long long first = -1, last = -1, idle = 0;
+		for (size_t i = 0; i < events.size(); i++) {
+			const TraceEvent& e = events[i];
+			if (e.kind == 'C')
+				continue;
+			if (first < 0 || e.begin < first)
+				first = e.begin;
+			if (e.end > last)
+				last = e.end;
+			if (e.kind == 'I') {
+				idle += e.end - e.begin;
+				continue;
+			}
+			Total& total = totals[std::make_pair(e.level, std::string(e.name))];
+			total.count++;
+			total.ns += e.end - e.begin;
+			total.flops += e.value;
+			if (e.misses >= 0) {
+				total.misses = (total.misses < 0 ? 0 : total.misses) + e.misses;
+				total.instructions = (total.instructions < 0 ? 0 : total.instructions) + e.instructions;
+			}
+		}
+		if (first < 0)
+			continue;
+		const long long lifetime = last - first;
+		out << std::setw(6) << registry.threads[t]->id << std::setw(9)
+			<< (lifetime > 0 ? 100.0 * (lifetime - idle) / lifetime : 100.0) << std::setw(12)
+			<< (lifetime - idle) * 1e-6 << std::setw(14) << lifetime * 1e-6 << "\n";
+	}
+	out << "level  span          count    total ms    GFLOP/s   cache misses   instructions\n";
+	for (std::map<std::pair<int, std::string>, Total>::const_iterator it = totals.begin();
+		it != totals.end(); ++it) {
+		const Total& total = it->second;
+		out << std::setw(5) << it->first.first << "  " << std::left << std::setw(12) << it->first.second
+			<< std::right << std::setw(7) << total.count << std::setw(12) << total.ns * 1e-6;
+		if (total.flops > 0)
+			out << std::setw(11) << total.flops / total.ns;
+		else
+			out << std::setw(11) << "-";
+		if (total.misses >= 0)
+			out << std::setw(15) << total.misses << std::setw(15) << total.instructions << "\n";
+		else
+			out << std::setw(15) << "-" << std::setw(15) << "-" << "\n";
+	}
+	std::lock_guard<std::mutex> counters(registry.counterLock);
+	for (std::map<std::string, double>::const_iterator it = registry.counters.begin();
+		it != registry.counters.end(); ++it)
+		out << it->first << ": " << std::setprecision(0) << it->second << std::setprecision(3) << "\n";
+	out.unsetf(std::ios::floatfield);
+}
+
+// Write all events to path in the Chrome trace event format; returns false
+// if the file cannot be written.
+inline bool traceWriteChrome(const std::string& path) {
+	std::ofstream out(path);
+	if (!out)
+		return false;
+	TraceRegistry& registry = traceRegistry();
+	std::lock_guard<std::mutex> lock(registry.guard);
+	out << "{\"traceEvents\": [\n";
+	bool first = true;
+	out << std::fixed << std::setprecision(3);
+	for (size_t t = 0; t < registry.threads.size(); t++) {
+		const TraceThread& thread = *registry.threads[t];
+		out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+			<< thread.id << ", \"args\": {\"name\": \"thread " << thread.id << "\"}}";
+		first = false;
+		for (size_t i = 0; i < thread.events.size(); i++) {
+			const TraceEvent& e = thread.events[i];
+			out << ",\n{\"name\": \"" << e.name << "\", \"pid\": 1, \"tid\": " << thread.id
+				<< ", \"ts\": " << e.begin * 1e-3;
+			if (e.kind == 'C') {
+				out << ", \"ph\": \"C\", \"args\": {\"value\": " << e.value << "}}";
+				continue;
+			}
+			out << ", \"ph\": \"X\", \"dur\": " << (e.end - e.begin) * 1e-3 << ", \"cat\": \""
+				<< (e.kind == 'I' ? "idle" : e.level < 0 ? "pool" : "strassen") << "\", \"args\": {";
+			const char* separator = "";
+			if (e.level >= 0) {
+				out << "\"level\": " << e.level;
+				separator = ", ";
+			}
+			if (e.value > 0) {
+				out << separator << "\"flops\": " << e.value << ", \"gflops\": " << e.value / (e.end - e.begin + 1);
+				separator = ", ";
+			}
+			if (e.misses >= 0)
+				out << separator << "\"cache_misses\": " << e.misses << ", \"instructions\": " << e.instructions;
+			out << "}}";
+		}
+	}
+	out << "\n]}\n";
+	return (bool)out;
+}
+
+#define MATRIX_TRACE_SPAN(var, name, level) TraceSpan var(name, level)
+#define MATRIX_TRACE_FLOPS(var, name, level, flops) TraceSpan var(name, level, flops)
+#define MATRIX_TRACE_END(var) var.finish()
+#define MATRIX_TRACE_COUNT(name, delta) traceCount(name, delta)
+
+#else
+
+class TraceIdle {
+public:
+	void idle() {}
+	void busy() {}
+};
+
+#define MATRIX_TRACE_SPAN(var, name, level)
+#define MATRIX_TRACE_FLOPS(var, name, level, flops)
+#define MATRIX_TRACE_END(var)
+#define MATRIX_TRACE_COUNT(name, delta)
+
+#endif
@@ -0,0 +1,208 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+#include "Gemm.h"
+#include "Matrix.h"
+#include "ThreadPool.h"
+
+// Checking products without redoing them. freivalds() tests c = a * b with
+// random vectors x: it compares a (b x) with c x, which costs O(n^2) per
+// trial against the O(n^2.8) of the product, so it can stay on in
+// production as a sampled sanity check (a few trials, or only some rows of
+// c). A wrong integer product fails a trial with probability at least 1/2;
+// floating point products pass when the residual is within a rounding
+// tolerance. errorNorms() is the exhaustive check for tests: it multiplies
+// again with the blocked kernel in a wider type and measures the difference.
+
+// Type the checks compute in: exact for integers, double for floating point.
+template <typename T> struct VerifyWide { typedef double type; };
+template <> struct VerifyWide<int> { typedef long long type; };
+template <> struct VerifyWide<long long> { typedef long long type; };
+template <> struct VerifyWide<short> { typedef long long type; };
+
+struct VerifyOptions {
+	int trials;			// random vectors to try
+	int rows;			// rows of c to check per trial, 0 = all of them
+	double tolerance;	// allowed residual relative to |a| |b| |x|; 0 = 16 k eps for
+						// floating point, integers are always compared exactly
+	unsigned long long seed;	// 0 = a different seed on every call
+	ThreadPool* pool;	// nullptr means ThreadPool::global()
+};
+
+// Options used by freivalds when none are given.
+inline VerifyOptions& verifyDefaults() {
+	static VerifyOptions options = { 2, 0, 0, 0, nullptr };
+	return options;
+}
+
+struct VerifyResult {
+	bool passed;
+	int trials;			// trials run; a failing trial ends the check
+	double residual;	// largest |a (b x) - c x| over the checked rows, relative to
+						// the largest |a| (|b| |x|)
+	double tolerance;	// bound the residual was held to
+	int row;			// row of c with the largest residual, -1 if nothing was checked
+};
+
+// Randomized check that c = a * b. Throws DimensionMismatch if the shapes
+// do not fit together.
+template <typename T, typename Access>
+VerifyResult freivalds(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	const VerifyOptions& options = verifyDefaults()) {
+	typedef typename VerifyWide<T>::type W;
+	if (b.getRows() != a.getCols())
+		throw DimensionMismatch(a.getCols(), b.getRows());
+	if (c.getRows() != a.getRows())
+		throw DimensionMismatch(a.getRows(), c.getRows());
+	if (c.getCols() != b.getCols())
+		throw DimensionMismatch(b.getCols(), c.getCols());
+	const int m = a.getRows(), k = a.getCols(), n = b.getCols();
+	const bool exact = std::is_integral<T>::value;
+	ThreadPool& pool = options.pool ? *options.pool : ThreadPool::global();
+	std::mt19937_64 generator(options.seed ? options.seed : std::random_device()());
+
+	VerifyResult result;
+	result.passed = true;
+	result.trials = 0;
+	result.residual = 0;
+	result.tolerance = exact ? 0 : options.tolerance > 0 ? options.tolerance :
+		16.0 * std::max(k, 1) * std::numeric_limits<T>::epsilon();
+	result.row = -1;
+
+	//rows of c to check: all of them, or a fresh sample every trial
+	std::vector<int> rows;
+	const bool sampled = options.rows > 0 && options.rows < m;
+	if (!sampled)
+		for (int i = 0; i < m; i++)
+			rows.push_back(i);
+	std::vector<W> x(n), y(k), size(k), z, w, bound;
+	const int grain = std::max(1, 16384 / std::max(1, std::max(k, n)));
+	for (int trial = 0; trial < options.trials && result.passed; trial++) {
+		result.trials++;
+		//x of random signs, so |x| is all ones and |b| |x| a row sum of |b|
+		for (int j = 0; j < n; j++)
+			x[j] = (generator() & 1) ? W(1) : W(-1);
+		if (sampled) {
+			rows.resize(options.rows);
+			for (int r = 0; r < options.rows; r++)
+				rows[r] = (int)(generator() % (unsigned long long)m);
+		}
+		const int count = (int)rows.size();
+		z.assign(count, W(0));
+		w.assign(count, W(0));
+		bound.assign(count, W(0));
+		pool.parallelFor(0, k, grain, [&](int lo, int hi) {
+			for (int p = lo; p < hi; p++) {
+				const T* bp = b.getRow(p);
+				W sum = 0, magnitude = 0;
+				for (int j = 0; j < n; j++) {
+					const W value = W(bp[j]);
+					sum += value * x[j];
+					magnitude += value < 0 ? -value : value;
+				}
+				y[p] = sum;
+				size[p] = magnitude;
+			}
+		});
+		pool.parallelFor(0, count, grain, [&](int lo, int hi) {
+			for (int r = lo; r < hi; r++) {
+				const T* ai = a.getRow(rows[r]);
+				const T* ci = c.getRow(rows[r]);
+				W sum = 0, magnitude = 0, product = 0;
+				for (int p = 0; p < k; p++) {
+					const W value = W(ai[p]);
+					sum += value * y[p];
+					magnitude += (value < 0 ? -value : value) * size[p];
+				}
+				for (int j = 0; j < n; j++)
+					product += W(ci[j]) * x[j];
+				z[r] = sum;
+				w[r] = product;
+				bound[r] = magnitude;
+			}
+		});
+		W largest = 0;
+		for (int r = 0; r < count; r++)
+			largest = std::max(largest, bound[r]);
+		for (int r = 0; r < count; r++) {
+			const double difference = std::fabs((double)(z[r] - w[r]));
+			const double relative = largest > 0 ? difference / (double)largest : difference;
+			if (result.row < 0 || relative > result.residual) {
+				result.residual = relative;
+				result.row = rows[r];
+			}
+			if (exact ? z[r] != w[r] : !(relative <= result.tolerance))
+				result.passed = false;
+		}
+	}
+	return result;
+}
+
+struct ErrorNorms {
+	double maxAbsolute;			// largest |c - reference|
+	double maxRelative;			// maxAbsolute over the largest |reference|
+	double frobeniusRelative;	// ||c - reference||_F / ||reference||_F
+	long long mismatches;		// entries that differ at all
+};
+
+// Difference of c from a * b recomputed by the blocked kernel in the
+// type of VerifyWide (so for float the reference is a double product).
+template <typename T, typename Access>
+ErrorNorms errorNorms(View<T, Access>& a, View<T, Access>& b, View<T, Access>& c,
+	ThreadPool& pool = ThreadPool::global()) {
+	typedef typename VerifyWide<T>::type W;
+	if (b.getRows() != a.getCols())
+		throw DimensionMismatch(a.getCols(), b.getRows());
+	if (c.getRows() != a.getRows())
+		throw DimensionMismatch(a.getRows(), c.getRows());
+	if (c.getCols() != b.getCols())
+		throw DimensionMismatch(b.getCols(), c.getCols());
+	const int m = a.getRows(), k = a.getCols(), n = b.getCols();
+	Matrix<W, Access> reference(m, n);
+	W* pr = reference.getData();
+	const size_t ldr = reference.getStride();
+	const T* pa = a.getData();
+	const T* pb = b.getData();
+	const size_t lda = a.getStride(), ldb = b.getStride();
+	pool.parallelFor(0, m, 64, [&](int lo, int hi) {
+		gemmBlocked(hi - lo, n, k, W(1), pa + lo * lda, lda, pb, ldb, W(0), pr + lo * ldr, ldr);
+	});
+
+	//per row sums, added up in order so the result does not depend on the pool
+	std::vector<double> largest(m, 0.0), absolute(m, 0.0), squares(m, 0.0), norms(m, 0.0);
+	std::vector<long long> differ(m, 0);
+	pool.parallelFor(0, m, 16, [&](int lo, int hi) {
+		for (int i = lo; i < hi; i++) {
+			const T* ci = c.getRow(i);
+			const W* ri = pr + i * ldr;
+			for (int j = 0; j < n; j++) {
+				const double value = (double)ri[j];
+				const double difference = std::fabs((double)(W(ci[j]) - ri[j]));
+				largest[i] = std::max(largest[i], std::fabs(value));
+				absolute[i] = std::max(absolute[i], difference);
+				squares[i] += difference * difference;
+				norms[i] += value * value;
+				if (W(ci[j]) != ri[j])
+					differ[i]++;
+			}
+		}
+	});
+	ErrorNorms result = { 0, 0, 0, 0 };
+	double scale = 0, squareSum = 0, normSum = 0;
+	for (int i = 0; i < m; i++) {
+		result.maxAbsolute = std::max(result.maxAbsolute, absolute[i]);
+		scale = std::max(scale, largest[i]);
+		squareSum += squares[i];
+		normSum += norms[i];
+		result.mismatches += differ[i];
+	}
+	result.maxRelative = scale > 0 ? result.maxAbsolute / scale : result.maxAbsolute;
+	result.frobeniusRelative = normSum > 0 ? std::sqrt(squareSum / normSum) : std::sqrt(squareSum);
+	return result;
+}
@@ -1,6 +1,9 @@
 #include "Matrix.h"
+#include "MixedPrecision.h"
+#include "Random.h"
+#include "Verify.h"
+#include <chrono>
 #include <iostream>
-#include <stdlib.h>
 #include <time.h>
 
 int main() {
@@ -9,18 +12,14 @@ int main() {
 	std::cout << "Give the row length N of N X N matrix: ";
 	std::cin >> N;
 
-	Matrix<int> A(N, N);
-	Matrix<int> B(N, N);
+	//Generate elements of A and B to random integers from -100 to 100, in
+	//parallel; the same seed gives the same matrices on any number of threads
+	unsigned long long seed = (unsigned long long)time(0);
+	std::cout << "Random seed: " << seed << "\n";
+	Matrix<int> A = randomMatrix<int>(N, N, uniformDistribution(-100, 100), seed, 0);
+	Matrix<int> B = randomMatrix<int>(N, N, uniformDistribution(-100, 100), seed, 1);
 	Matrix<int> C(N, N);
 
-	//Generate elements of A and B to random integers from -100 to 100
-	srand(time(0));
-	for (int i = 0; i < N; i++) {
-		for (int j = 0; j < N; j++) {
-			A(i, j) = (rand() % 201) - 100;
-			B(i, j) = (rand() % 201) - 100;
-		}
-	}
 	//print out A's element
 	std::cout << "A:\n";
 	for (int i = 0; i < N; i++) {
@@ -43,11 +42,12 @@ int main() {
 	View<int> view_A = A.makeView(0, 0, N, N);
 	View<int> view_B = B.makeView(0, 0, N, N);
 	View<int> view_C = C.makeView(0, 0, N, N);
-	omp_set_nested(1);
-	time_t now = time(NULL);
+	//wall clock time from steady_clock; clock() adds up the CPU time of all
+	//threads, so for the parallel product it is larger than the wall time
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
 	clock_t start = clock();
 	Matrix<int>::P_Strassen(view_A, view_B, view_C, N, 0);
-	time_t later = time(NULL);
+	std::chrono::steady_clock::time_point later = std::chrono::steady_clock::now();
 	clock_t end = clock();
 	for (int i = 0; i < N; i++) {
 		for (int j = 0; j < N; j++) {
@@ -55,15 +55,76 @@ int main() {
 		}
 		std::cout << std::endl;
 	}
-	std::cout << "Parallel Strassen took " << (later-now) << " seconds.\n";
-	std::cout << "CPU time was " << (end - start) / CLOCKS_PER_SEC << " seconds.\n";
+	std::cout << "Parallel Strassen took " << std::chrono::duration<double>(later - now).count()
+		<< " seconds.\n";
+	std::cout << "CPU time was " << (double)(end - start) / CLOCKS_PER_SEC << " seconds.\n";
+	//randomized check of the result in O(N^2) per trial, instead of comparing
+	//it by eye with the simple multiplication below
+	VerifyResult check = freivalds(view_A, view_B, view_C);
+	std::cout << "Freivalds check of P_Strassen (" << check.trials << " trials) "
+		<< (check.passed ? "passed" : "FAILED") << ".\n";
+	//tall and skinny and short and wide products at small crossovers halve
+	//their long dimensions many times before any Strassen step; they once
+	//overflowed the stack
+	const int shapes[4][5] = {
+		{ 2000, 4, 2000, 4, -1 }, { 4, 2000, 4, 4, -1 }, { 100, 3, 203, 2, 1 }, { 203, 3, 100, 2, 1 }
+	};
+	bool shaped = true;
+	for (int s = 0; s < 4; s++) {
+		const int m = shapes[s][0], k = shapes[s][1], n = shapes[s][2];
+		Matrix<int> SA = randomMatrix<int>(m, k, uniformDistribution(-100, 100), seed, 2);
+		Matrix<int> SB = randomMatrix<int>(k, n, uniformDistribution(-100, 100), seed, 3);
+		Matrix<int> SC(m, n);
+		View<int> view_SA = SA.makeView(0, 0, m, k);
+		View<int> view_SB = SB.makeView(0, 0, k, n);
+		View<int> view_SC = SC.makeView(0, 0, m, n);
+		StrassenConfig narrow = strassenDefaults();
+		narrow.crossover = shapes[s][3];
+		narrow.parallelDepth = shapes[s][4];
+		Matrix<int>::Multiply(view_SA, view_SB, view_SC, narrow);
+		shaped = shaped && freivalds(view_SA, view_SB, view_SC).passed;
+	}
+	std::cout << "Freivalds check of long and narrow products " << (shaped ? "passed" : "FAILED")
+		<< ".\n";
+#if MATRIX_TRACE
+	//built with tracing: where the time of P_Strassen went
+	traceReport(std::cout);
+	traceWriteChrome("strassen_trace.json");
+	traceReset();
+#endif
+	StrassenConfig lean = strassenDefaults();
+	lean.schedule = StrassenLean;
+	std::cout << "Strassen scratch was " << StrassenWorkspace<int>::requiredBytes(N, 0) << " bytes ("
+		<< StrassenWorkspace<int>::requiredBytes(N, 0, lean) << " with the lean schedule).\n";
+
+	//the elements fit in int8, so the same product can be read from a
+	//quarter of the memory and accumulated in int
+	Matrix<int8_t> A8(N, N);
+	Matrix<int8_t> B8(N, N);
+	Matrix<int> C8(N, N);
+	for (int i = 0; i < N; i++) {
+		for (int j = 0; j < N; j++) {
+			A8(i, j) = (int8_t)A(i, j);
+			B8(i, j) = (int8_t)B(i, j);
+		}
+	}
+	View<int8_t> view_A8 = A8.makeView(0, 0, N, N);
+	View<int8_t> view_B8 = B8.makeView(0, 0, N, N);
+	View<int> view_C8 = C8.makeView(0, 0, N, N);
+	int levels = multiplyMixed(view_A8, view_B8, view_C8);
+	bool same = true;
+	for (int i = 0; i < N; i++)
+		for (int j = 0; j < N; j++)
+			same = same && C8(i, j) == C(i, j);
+	std::cout << "int8 storage with int accumulation took " << levels << " Strassen levels and "
+		<< (same ? "matches" : "does not match") << " P_Strassen.\n";
 
 	//print out C's element with simple Multiplication
 	std::cout << "\nC using simple element by element multiplication:\n\n";
-	now = time(NULL);
+	now = std::chrono::steady_clock::now();
 	start = clock();
 	Matrix<int>::Multiplication(view_A, view_B, view_C, N);
-	later = time(NULL);
+	later = std::chrono::steady_clock::now();
 	end = clock();
 	for (int i = 0; i < N; i++) {
 		for (int j = 0; j < N; j++) {
@@ -71,6 +132,7 @@ int main() {
 		}
 		std::cout << std::endl;
 	}
-	std::cout << "Simple multiplication took " << (later - now) << " seconds.\n";
-	std::cout << "CPU time was " << (end - start) / CLOCKS_PER_SEC << " seconds.\n";
+	std::cout << "Simple multiplication took " << std::chrono::duration<double>(later - now).count()
+		<< " seconds.\n";
+	std::cout << "CPU time was " << (double)(end - start) / CLOCKS_PER_SEC << " seconds.\n";
 }
\ No newline at end of file